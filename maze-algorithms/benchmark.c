@@ -0,0 +1,668 @@
+/*
+Benchmarks for the maze generators and the kero_sprite drawing functions.
+
+Build with ./build_benchmark.sh then run:
+    ./benchmark                              run everything, JSON on stdout
+    ./benchmark -o results.json              write the JSON to a file
+    ./benchmark -f Blit                      only benchmarks with "Blit" in the name
+    ./benchmark -q                           shorter runs, fewer sizes
+    ./benchmark -c baseline.json [-t 10]     also compare against an earlier run, exits with 1 if anything is more than 10% slower
+
+Cycles, instructions, cache misses and branch misses come from perf_event_open. They're written as null if the kernel doesn't allow it (see /proc/sys/kernel/perf_event_paranoid).
+*/
+
+#include "kero_math.h"
+#include <stdbool.h>
+#include "kero_sprite.h"
+#include "maze.h"
+#include "maze_render.h"
+#include "kero_raster.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MAX_RESULTS 1024
+#define NUM_COUNTERS 4
+
+typedef struct {
+    char name[64];
+    char size[32];
+    uint64_t iterations;
+    double ns_per_iteration;
+    bool has_counters;
+    double counters[NUM_COUNTERS]; // Per iteration
+} result_t;
+
+static const char* counter_names[NUM_COUNTERS] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+static const uint64_t counter_configs[NUM_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+static int counter_fds[NUM_COUNTERS] = { -1, -1, -1, -1 };
+static bool counters_available = false;
+
+static result_t results[MAX_RESULTS];
+static int num_results = 0;
+static const char* filter = 0;
+static bool quick = false;
+static double target_seconds = 0.2;
+
+//------------------------------------------------------------
+// Hardware counters
+
+static void OpenCounters() {
+    for(int i = 0; i < NUM_COUNTERS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counter_configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        // Counter 0 leads the group so all four start and stop together
+        counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counter_fds[0], 0);
+        if(counter_fds[i] < 0) {
+            for(int j = 0; j < i; ++j) {
+                close(counter_fds[j]);
+                counter_fds[j] = -1;
+            }
+            return;
+        }
+    }
+    counters_available = true;
+}
+
+static void StartCounters() {
+    if(!counters_available) return;
+    ioctl(counter_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static bool StopCounters(uint64_t* values) {
+    if(!counters_available) return false;
+    ioctl(counter_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t data[1 + NUM_COUNTERS];
+    if(read(counter_fds[0], data, sizeof(data)) != sizeof(data) || data[0] != NUM_COUNTERS) return false;
+    memcpy(values, data+1, sizeof(uint64_t)*NUM_COUNTERS);
+    return true;
+}
+
+static double Now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec/1000000000.0;
+}
+
+//------------------------------------------------------------
+// Runner
+
+typedef void (*bench_func_t)(void* data);
+
+// Runs func enough times to fill target_seconds, best of 3
+static void Run(const char* name, const char* size, bench_func_t func, void* data) {
+    if(filter && !strstr(name, filter)) return;
+    if(num_results == MAX_RESULTS) return;
+    func(data);
+    uint64_t iterations = 1;
+    for(;;) {
+        double start = Now();
+        for(uint64_t i = 0; i < iterations; ++i) func(data);
+        double elapsed = Now() - start;
+        if(elapsed > target_seconds/10 || iterations > (1ULL<<40)) {
+            iterations = KSMax(1, (uint64_t)(iterations * (target_seconds/3) / KSMax(elapsed, 1e-9)));
+            break;
+        }
+        iterations *= 10;
+    }
+
+    result_t* result = &results[num_results++];
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    snprintf(result->size, sizeof(result->size), "%s", size);
+    result->iterations = iterations;
+    result->ns_per_iteration = 1e30;
+    for(int repeat = 0; repeat < 3; ++repeat) {
+        uint64_t values[NUM_COUNTERS];
+        StartCounters();
+        double start = Now();
+        for(uint64_t i = 0; i < iterations; ++i) func(data);
+        double elapsed = Now() - start;
+        bool has_counters = StopCounters(values);
+        double ns = elapsed*1e9/iterations;
+        if(ns < result->ns_per_iteration) {
+            result->ns_per_iteration = ns;
+            result->has_counters = has_counters;
+            for(int i = 0; i < NUM_COUNTERS && has_counters; ++i) {
+                result->counters[i] = (double)values[i]/iterations;
+            }
+        }
+    }
+    fprintf(stderr, "%-32s %-12s %14.1f ns\n", result->name, result->size, result->ns_per_iteration);
+}
+
+//------------------------------------------------------------
+// Generators
+
+typedef struct {
+    maze_t maze;
+    maze_algorithm_t algorithm;
+    int64_t* scratch;
+    uint64_t seed;
+    maze_t lanes[MAZE_LANES];
+    uint8_t* lanes_scratch;
+    maze_job_t* jobs;
+    int num_jobs;
+} generator_bench_t;
+
+static void BenchGenerate(void* data) {
+    generator_bench_t* bench = (generator_bench_t*)data;
+    memset(bench->maze.cells, 0, (size_t)bench->maze.width*bench->maze.height);
+    MazeGenerate(&bench->maze, bench->algorithm, bench->seed++, bench->scratch);
+}
+
+static void BenchGenerateLanes(void* data) {
+    generator_bench_t* bench = (generator_bench_t*)data;
+    uint64_t seeds[MAZE_LANES];
+    for(int i = 0; i < MAZE_LANES; ++i) {
+        seeds[i] = bench->seed++;
+    }
+    MazeGenerateLanes(bench->lanes, bench->algorithm, seeds, bench->lanes_scratch);
+}
+
+static void BenchBatch(void* data) {
+    generator_bench_t* bench = (generator_bench_t*)data;
+    MazeBatchRun(bench->jobs, bench->num_jobs, 0, 0);
+}
+
+static const char* algorithm_names[MAZE_NUM_ALGORITHMS] = { "RecursiveBacktracker", "Prims", "BinaryTree", "Sidewinder" };
+
+static void BenchGenerators() {
+    int sizes[] = { 32, 128, 512, 2048 };
+    int num_sizes = quick ? 3 : 4;
+    for(int s = 0; s < num_sizes; ++s) {
+        int size = sizes[s];
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "%dx%d", size, size);
+        generator_bench_t bench = {0};
+        bench.maze.width = bench.maze.height = size;
+        bench.maze.cells = (uint8_t*)malloc((size_t)size*size);
+        bench.scratch = (int64_t*)malloc(MazeScratchSize(size, size));
+        for(int algorithm = 0; algorithm < MAZE_NUM_ALGORITHMS; ++algorithm) {
+            char name[64];
+            snprintf(name, sizeof(name), "Maze%s", algorithm_names[algorithm]);
+            bench.algorithm = (maze_algorithm_t)algorithm;
+            Run(name, size_name, BenchGenerate, &bench);
+        }
+        if(size <= 512) {
+            bench.lanes_scratch = (uint8_t*)MazeAllocLarge(MazeLanesScratchSize(size, size), MAZE_MEMORY_DEFAULT, 0);
+            for(int i = 0; i < MAZE_LANES; ++i) {
+                bench.lanes[i].width = bench.lanes[i].height = size;
+                bench.lanes[i].cells = (uint8_t*)malloc((size_t)size*size);
+            }
+            for(int algorithm = MAZE_BINARY_TREE; algorithm <= MAZE_SIDEWINDER; ++algorithm) {
+                char name[64];
+                snprintf(name, sizeof(name), "MazeLanes%d%s", MAZE_LANES, algorithm_names[algorithm]);
+                bench.algorithm = (maze_algorithm_t)algorithm;
+                Run(name, size_name, BenchGenerateLanes, &bench);
+            }
+            for(int i = 0; i < MAZE_LANES; ++i) {
+                free(bench.lanes[i].cells);
+            }
+            free(bench.lanes_scratch);
+        }
+        if(size <= 128) {
+            bench.num_jobs = 256;
+            bench.jobs = (maze_job_t*)malloc(bench.num_jobs*sizeof(maze_job_t));
+            for(int algorithm = 0; algorithm < MAZE_NUM_ALGORITHMS; ++algorithm) {
+                for(int i = 0; i < bench.num_jobs; ++i) {
+                    bench.jobs[i] = (maze_job_t){ size, size, (maze_algorithm_t)algorithm, (uint64_t)i };
+                }
+                char name[64];
+                snprintf(name, sizeof(name), "MazeBatch256%s", algorithm_names[algorithm]);
+                Run(name, size_name, BenchBatch, &bench);
+            }
+            free(bench.jobs);
+        }
+        free(bench.maze.cells);
+        free(bench.scratch);
+    }
+}
+
+//------------------------------------------------------------
+// Sprites
+
+typedef struct {
+    ksprite_t dest;
+    ksprite_t opaque, alpha, walls;
+    ksprite_rle_t walls_rle;
+} sprite_bench_t;
+
+static void BenchSetAllPixels(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSSetAllPixels(&bench->dest, 0xffffffff);
+}
+
+static void BenchDrawRectFilled(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSDrawRectFilled(&bench->dest, bench->dest.w/8, bench->dest.h/8, bench->dest.w*7/8, bench->dest.h*7/8, 0xff00ff00);
+}
+
+static void BenchDrawRectFilledAlpha(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSDrawRectFilledAlpha(&bench->dest, bench->dest.w/8, bench->dest.h/8, bench->dest.w*7/8, bench->dest.h*7/8, 0x8000ff00);
+}
+
+static void BenchScanLines(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    for(int y = 0; y < bench->dest.h; y += 4) {
+        KSScanLine(&bench->dest, y, 0, bench->dest.w-1, 0xff0000ff);
+    }
+}
+
+// The maze wall pattern from main.c: short horizontal and vertical lines on a 10 pixel grid
+static void BenchDrawLineGrid(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    int size = 10;
+    for(int y = 0; y < bench->dest.h/size - 1; ++y) {
+        for(int x = 0; x < bench->dest.w/size - 1; ++x) {
+            KSDrawLine(&bench->dest, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
+            KSDrawLine(&bench->dest, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
+        }
+    }
+}
+
+static void BenchDrawLineDiagonal(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    for(int i = 0; i < 64; ++i) {
+        KSDrawLine(&bench->dest, 0, i*bench->dest.h/64, bench->dest.w-1, bench->dest.h-1 - i*bench->dest.h/64, 0xff000000);
+    }
+}
+
+static void BenchDrawTriangle(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSDrawTriangle(&bench->dest, bench->dest.w/2, 0, 0, bench->dest.h-1, bench->dest.w-1, bench->dest.h-1, 0xffff0000);
+}
+
+static void BenchBlit(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSBlit(&bench->walls, &bench->dest, 0, 0);
+}
+
+static void BenchBlitAlpha10(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSBlitAlpha10(&bench->walls, &bench->dest, 0, 0);
+}
+
+static void BenchRLEBlitAlpha10(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSRLEBlitAlpha10(&bench->walls_rle, &bench->dest, 0, 0);
+}
+
+static void BenchBlitBlend(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSBlitBlend(&bench->alpha, &bench->dest, 0, 0);
+}
+
+static void BenchBlitColored(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    KSBlitColored(&bench->opaque, &bench->dest, 0, 0, 0, 0, 0xff80c040);
+}
+
+static void BenchBlitSmallSprites(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    ksprite_t sprite = { 32, 32, bench->alpha.pixels, 0, 0 };
+    for(int y = 0; y < bench->dest.h; y += 48) {
+        for(int x = 0; x < bench->dest.w; x += 48) {
+            KSBlitAlpha10(&sprite, &bench->dest, x, y);
+        }
+    }
+}
+
+static void BenchBlitScaled(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    ksprite_t sprite = { 64, 64, bench->opaque.pixels, 0, 0 };
+    KSBlitScaledSafe(&sprite, &bench->dest, 0, 0, bench->dest.w/64.f, bench->dest.h/64.f, 0, 0);
+}
+
+static void BenchBlitScaledBilinear(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    ksprite_t sprite = { 64, 64, bench->opaque.pixels, 0, 0 };
+    KSBlitScaledBilinear(&sprite, &bench->dest, 0, 0, bench->dest.w/64.f, bench->dest.h/64.f, 0, 0);
+}
+
+static void BenchBlitScaledAlpha10(void* data) {
+    sprite_bench_t* bench = (sprite_bench_t*)data;
+    ksprite_t sprite = { 64, 64, bench->alpha.pixels, 0, 0 };
+    KSBlitScaledAlpha10(&sprite, &bench->dest, 0, 0, (bench->dest.w-1)/64, (bench->dest.h-1)/64, 0, 0);
+}
+
+// Random colours with alpha 0 for the first third, 255 for the middle and anything in the last third, so the blit paths see all three kinds of pixel
+static void FillTestSprite(ksprite_t* sprite, bool with_alpha) {
+    uint64_t rng = 1;
+    for(int i = 0; i < sprite->w*sprite->h; ++i) {
+        uint32_t pixel = (uint32_t)MazeRandom(&rng) & 0xffffff;
+        uint32_t alpha = 0xff;
+        if(with_alpha) {
+            int x = i % sprite->w;
+            alpha = x < sprite->w/3 ? 0 : x < sprite->w*2/3 ? 0xff : (uint32_t)(MazeRandom(&rng) & 0xff);
+        }
+        sprite->pixels[i] = pixel | alpha<<24;
+    }
+}
+
+// Like the monster maze wall layers: mostly transparent with solid blocks down the sides
+static void FillWallSprite(ksprite_t* sprite) {
+    for(int y = 0; y < sprite->h; ++y) {
+        for(int x = 0; x < sprite->w; ++x) {
+            bool wall = x < sprite->w/8 || x >= sprite->w*7/8;
+            sprite->pixels[y*sprite->w + x] = wall ? 0xff303030 : 0;
+        }
+    }
+}
+
+static void BenchSprites() {
+    int sizes[][2] = { { 320, 240 }, { 1280, 720 }, { 3840, 2160 } };
+    int num_sizes = quick ? 2 : 3;
+    for(int s = 0; s < num_sizes; ++s) {
+        sprite_bench_t bench;
+        int w = sizes[s][0], h = sizes[s][1];
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "%dx%d", w, h);
+        KSCreate(&bench.dest, w, h);
+        KSCreate(&bench.opaque, w, h);
+        KSCreate(&bench.alpha, w, h);
+        KSCreate(&bench.walls, w, h);
+        KSSetAllPixels(&bench.dest, 0);
+        FillTestSprite(&bench.opaque, false);
+        FillTestSprite(&bench.alpha, true);
+        FillWallSprite(&bench.walls);
+        // Classified like a loaded sprite, so the blits take their row class fast paths
+        KSClassifyRows(&bench.opaque);
+        KSClassifyRows(&bench.alpha);
+        KSClassifyRows(&bench.walls);
+        KSRLECreate(&bench.walls_rle, &bench.walls);
+
+        Run("KSSetAllPixels", size_name, BenchSetAllPixels, &bench);
+        Run("KSDrawRectFilled", size_name, BenchDrawRectFilled, &bench);
+        Run("KSDrawRectFilledAlpha", size_name, BenchDrawRectFilledAlpha, &bench);
+        Run("KSScanLine", size_name, BenchScanLines, &bench);
+        Run("KSDrawLineGrid", size_name, BenchDrawLineGrid, &bench);
+        Run("KSDrawLineDiagonal", size_name, BenchDrawLineDiagonal, &bench);
+        Run("KSDrawTriangle", size_name, BenchDrawTriangle, &bench);
+        Run("KSBlit", size_name, BenchBlit, &bench);
+        Run("KSBlitAlpha10", size_name, BenchBlitAlpha10, &bench);
+        Run("KSRLEBlitAlpha10", size_name, BenchRLEBlitAlpha10, &bench);
+        Run("KSBlitBlend", size_name, BenchBlitBlend, &bench);
+        Run("KSBlitColored", size_name, BenchBlitColored, &bench);
+        Run("KSBlitAlpha10Small", size_name, BenchBlitSmallSprites, &bench);
+        Run("KSBlitScaledSafe", size_name, BenchBlitScaled, &bench);
+        Run("KSBlitScaledBilinear", size_name, BenchBlitScaledBilinear, &bench);
+        Run("KSBlitScaledAlpha10", size_name, BenchBlitScaledAlpha10, &bench);
+
+        KSFree(&bench.dest);
+        KSFree(&bench.opaque);
+        KSFree(&bench.alpha);
+        KSFree(&bench.walls);
+        KSRLEFree(&bench.walls_rle);
+    }
+}
+
+//------------------------------------------------------------
+// Maze rendering
+
+typedef struct {
+    ksprite_t dest;
+    maze_t maze;
+    int cell_size;
+    maze_tiles_t tiles;
+} render_bench_t;
+
+static void BenchMazeDraw(void* data) {
+    render_bench_t* bench = (render_bench_t*)data;
+    MazeDraw(&bench->dest, &bench->maze, 0, 0, bench->cell_size, 0xff000000);
+}
+
+static void BenchMazeTilesDraw(void* data) {
+    render_bench_t* bench = (render_bench_t*)data;
+    MazeTilesDraw(&bench->tiles, &bench->dest, &bench->maze, 0, 0);
+}
+
+static void BenchMazeDrawOverview(void* data) {
+    render_bench_t* bench = (render_bench_t*)data;
+    MazeDrawOverview(&bench->dest, &bench->maze, 0, 0, bench->cell_size, 0xffffffff, 0xff000000);
+}
+
+// The article's way of drawing the walls, for comparison
+static void BenchMazeDrawLines(void* data) {
+    render_bench_t* bench = (render_bench_t*)data;
+    maze_t* maze = &bench->maze;
+    int size = bench->cell_size;
+    for(int y = 0; y < maze->height; ++y) {
+        for(int x = 0; x < maze->width; ++x) {
+            if(!(maze->cells[x + y*maze->width] & MAZE_UP)) {
+                KSDrawLine(&bench->dest, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
+            }
+            if(!(maze->cells[x + y*maze->width] & MAZE_RIGHT)) {
+                KSDrawLine(&bench->dest, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
+            }
+        }
+    }
+}
+
+static void BenchMazeRender() {
+    int cell_sizes[] = { 1, 4 };
+    render_bench_t bench;
+    bench.maze.width = 1000;
+    bench.maze.height = 700;
+    bench.maze.cells = (uint8_t*)calloc(1, 1000*700);
+    int64_t* scratch = (int64_t*)malloc(MazeScratchSize(1000, 700));
+    MazeGenerate(&bench.maze, MAZE_RECURSIVE_BACKTRACKER, 1, scratch);
+    for(int s = 0; s < 2; ++s) {
+        bench.cell_size = cell_sizes[s];
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "1000x700x%d", bench.cell_size);
+        KSCreate(&bench.dest, 1000*bench.cell_size+1, 700*bench.cell_size+1);
+        KSSetAllPixels(&bench.dest, 0xffffffff);
+        Run("MazeDraw", size_name, BenchMazeDraw, &bench);
+        Run("MazeDrawLines", size_name, BenchMazeDrawLines, &bench);
+        maze_tile_style_t style = { 1, 0xffffffff, 0xff000000 };
+        MazeTilesCreate(&bench.tiles, bench.cell_size, MazeTileSolid, &style);
+        Run("MazeTilesDraw", size_name, BenchMazeTilesDraw, &bench);
+        MazeTilesFree(&bench.tiles);
+        KSFree(&bench.dest);
+        // Overviews draw every wall unit as a cell_size square, so the maze takes twice the width and height
+        KSCreate(&bench.dest, 2001*bench.cell_size, 1401*bench.cell_size);
+        Run("MazeDrawOverview", size_name, BenchMazeDrawOverview, &bench);
+        KSFree(&bench.dest);
+    }
+    free(scratch);
+    free(bench.maze.cells);
+}
+
+//------------------------------------------------------------
+// Banded rasterizer
+
+typedef struct {
+    ksprite_t dest;
+    ksprite_t icon;
+    kr_buffer_t buffer;
+} raster_bench_t;
+
+// A dashboard-like frame: 60 panels, each with a translucent chart area, a line graph and an icon
+static void DrawDashboard(raster_bench_t* bench, bool banded) {
+    ksprite_t* dest = &bench->dest;
+    kr_buffer_t* buffer = &bench->buffer;
+    int panel_w = dest->w/10, panel_h = dest->h/6;
+    if(banded) {
+        KRBegin(buffer, dest);
+        KRClear(buffer, 0xff101010);
+    }
+    else {
+        KSSetAllPixels(dest, 0xff101010);
+    }
+    for(int p = 0; p < 60; ++p) {
+        int x = (p%10)*panel_w, y = (p/10)*panel_h;
+        int graph_y = y + panel_h*5/6;
+        if(banded) {
+            KRDrawRectFilled(buffer, x+4, y+4, x+panel_w-4, y+panel_h-4, 0xff303030);
+            KRDrawRectFilledAlpha(buffer, x+10, y+10, x+panel_w-10, y+panel_h/2, 0x80406080);
+            for(int i = 0; i < 20; ++i) {
+                KRDrawLine(buffer, x+10+i*panel_w/22, graph_y - (i*37)%(panel_h/4), x+10+(i+1)*panel_w/22, graph_y - ((i+1)*37)%(panel_h/4), 0xff00ff00);
+            }
+            KRBlitBlend(buffer, &bench->icon, x+panel_w-bench->icon.w-10, y+10);
+        }
+        else {
+            KSDrawRectFilled(dest, x+4, y+4, x+panel_w-4, y+panel_h-4, 0xff303030);
+            KSDrawRectFilledAlpha(dest, x+10, y+10, x+panel_w-10, y+panel_h/2, 0x80406080);
+            for(int i = 0; i < 20; ++i) {
+                KSDrawLine(dest, x+10+i*panel_w/22, graph_y - (i*37)%(panel_h/4), x+10+(i+1)*panel_w/22, graph_y - ((i+1)*37)%(panel_h/4), 0xff00ff00);
+            }
+            KSBlitBlend(&bench->icon, dest, x+panel_w-bench->icon.w-10, y+10);
+        }
+    }
+    if(banded) {
+        KRFlush(buffer);
+    }
+}
+
+static void BenchDashboard(void* data) {
+    DrawDashboard((raster_bench_t*)data, false);
+}
+
+static void BenchDashboardBanded(void* data) {
+    DrawDashboard((raster_bench_t*)data, true);
+}
+
+static void BenchRaster() {
+    int sizes[][2] = { { 1280, 720 }, { 3840, 2160 } };
+    raster_bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    KSCreate(&bench.icon, 32, 32);
+    FillTestSprite(&bench.icon, true);
+    KSClassifyRows(&bench.icon);
+    KRInit(0);
+    for(int s = 0; s < 2; ++s) {
+        int w = sizes[s][0], h = sizes[s][1];
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "%dx%d", w, h);
+        KSCreate(&bench.dest, w, h);
+        Run("Dashboard", size_name, BenchDashboard, &bench);
+        Run("DashboardBanded", size_name, BenchDashboardBanded, &bench);
+        KSFree(&bench.dest);
+    }
+    KRFree(&bench.buffer);
+    KSFree(&bench.icon);
+    KRShutdown();
+}
+
+//------------------------------------------------------------
+// Output
+
+static void WriteJSON(FILE* file) {
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"benchmarks\": [\n", KSKernelName());
+    for(int i = 0; i < num_results; ++i) {
+        result_t* result = &results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"size\": \"%s\", \"iterations\": %llu, \"ns_per_iteration\": %.3f", result->name, result->size, (unsigned long long)result->iterations, result->ns_per_iteration);
+        for(int c = 0; c < NUM_COUNTERS; ++c) {
+            if(result->has_counters) {
+                fprintf(file, ", \"%s\": %.1f", counter_names[c], result->counters[c]);
+            }
+            else {
+                fprintf(file, ", \"%s\": null", counter_names[c]);
+            }
+        }
+        fprintf(file, "}%s\n", i < num_results-1 ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+// Only understands files written by WriteJSON: finds each "name", "size" and "ns_per_iteration" in order
+static int Compare(const char* path, double threshold) {
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        fprintf(stderr, "Can't open baseline %s\n", path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* text = (char*)malloc(length+1);
+    text[fread(text, 1, length, file)] = 0;
+    fclose(file);
+
+    int regressions = 0;
+    char* it = text;
+    while((it = strstr(it, "\"name\": \""))) {
+        char name[64] = {0}, size[32] = {0};
+        double ns = 0;
+        if(sscanf(it, "\"name\": \"%63[^\"]\", \"size\": \"%31[^\"]\", \"iterations\": %*u, \"ns_per_iteration\": %lf", name, size, &ns) != 3) {
+            ++it;
+            continue;
+        }
+        it += 8;
+        for(int i = 0; i < num_results; ++i) {
+            if(strcmp(results[i].name, name) || strcmp(results[i].size, size)) continue;
+            double change = (results[i].ns_per_iteration - ns) / ns * 100;
+            bool regressed = change > threshold;
+            regressions += regressed;
+            fprintf(stderr, "%s %-32s %-12s %14.1f -> %14.1f ns (%+.1f%%)\n", regressed ? "REGRESSION" : "          ", name, size, ns, results[i].ns_per_iteration, change);
+        }
+    }
+    free(text);
+    return regressions;
+}
+
+int main(int argc, char* argv[]) {
+    const char* output_path = 0;
+    const char* baseline_path = 0;
+    double threshold = 10;
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-o") && i+1 < argc) output_path = argv[++i];
+        else if(!strcmp(argv[i], "-c") && i+1 < argc) baseline_path = argv[++i];
+        else if(!strcmp(argv[i], "-t") && i+1 < argc) threshold = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-f") && i+1 < argc) filter = argv[++i];
+        else if(!strcmp(argv[i], "-q")) quick = true;
+        else {
+            fprintf(stderr, "Usage: %s [-o results.json] [-c baseline.json] [-t percent] [-f filter] [-q]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(quick) {
+        target_seconds = 0.05;
+    }
+
+    OpenCounters();
+    if(!counters_available) {
+        fprintf(stderr, "perf_event_open failed, hardware counters will be null\n");
+    }
+    MazeBatchInit(0, MAZE_MEMORY_DEFAULT);
+
+    BenchGenerators();
+    BenchSprites();
+    BenchMazeRender();
+    BenchRaster();
+
+    FILE* output = output_path ? fopen(output_path, "w") : stdout;
+    if(!output) {
+        fprintf(stderr, "Can't write %s\n", output_path);
+        return 2;
+    }
+    WriteJSON(output);
+    if(output != stdout) {
+        fclose(output);
+    }
+
+    int status = 0;
+    if(baseline_path) {
+        int regressions = Compare(baseline_path, threshold);
+        if(regressions < 0) status = 2;
+        else if(regressions > 0) {
+            fprintf(stderr, "%d regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+            status = 1;
+        }
+    }
+    MazeBatchShutdown();
+    return status;
+}
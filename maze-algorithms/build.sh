@@ -1 +1 @@
-gcc -no-pie -std=gnu99 main.c -lX11 -lm -o a.out -g
+gcc -no-pie -std=gnu99 main.c -lX11 -lXext -lm -lpthread -o a.out -g
\ No newline at end of file
@@ -0,0 +1 @@
+gcc -O2 -std=gnu99 benchmark.c -lm -lpthread -o benchmark -g
\ No newline at end of file
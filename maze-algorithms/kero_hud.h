@@ -0,0 +1,354 @@
+/*
+Kero HUD keeps histograms of the frame times Kero Platform measures (kp_frame_times) and draws them over the frame: the median, 95th and 99th percentile and worst of the last KH_WINDOW frames for the whole frame, for sending it to the screen and for how late the frame limit sleep woke up, with a scrolling graph of the most recent frames under them.
+
+The histograms are HDR style. Buckets get wider as the values get bigger, KH_SUB_BUCKETS to each power of two, so anything from a nanosecond to minutes is kept to within 3% in a few KB, and recording a value is a couple of increments.
+
+The text is drawn with glyphs from a tiny built-in font that are rendered once, the first time the overlay is drawn, and only copied after that, so the whole overlay costs a few microseconds a frame.
+
+Include kero_platform.h and kero_sprite.h first. It isn't thread safe, record and draw from the thread that calls KPFlip.
+*/
+
+#ifndef KERO_HUD_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "kero_profile.h"
+
+#define KH_SUB_BITS 4
+#define KH_SUB_BUCKETS (1<<KH_SUB_BITS)
+#define KH_MAX_BITS 40 // Values from 2^40ns (about 18 minutes) up all go in the last bucket
+#define KH_BUCKETS ((KH_MAX_BITS-KH_SUB_BITS+1)*KH_SUB_BUCKETS)
+
+    // About 8 seconds at 60fps
+#ifndef KH_WINDOW
+#define KH_WINDOW 512 // Must be a power of 2
+#endif
+
+    // Pixels per font pixel
+#ifndef KH_SCALE
+#define KH_SCALE 2
+#endif
+
+    // Layout of the overlay, see KHDraw
+#define KH_CHAR_WIDTH (4*KH_SCALE)
+#define KH_LINE_HEIGHT (6*KH_SCALE)
+#define KH_PADDING (4*KH_SCALE)
+#define KH_COLUMNS 35
+#define KH_GRAPH_WIDTH (KH_COLUMNS*KH_CHAR_WIDTH)
+#define KH_GRAPH_HEIGHT 64
+#define KH_WIDTH (KH_GRAPH_WIDTH + 2*KH_PADDING)
+#define KH_HEIGHT (KH_PADDING + 4*KH_LINE_HEIGHT + KH_PADDING/2 + KH_GRAPH_HEIGHT + KH_PADDING/2 + KH_LINE_HEIGHT + KH_PADDING)
+
+#define KH_BACKGROUND 0xff202020
+#define KH_TEXT 0xffe0e0e0
+#define KH_GRID 0xff383838
+#define KH_FRAME 0xff40c040
+#define KH_SLOW_FRAME 0xffe04040 // Frames more than half as long again as the median
+#define KH_PRESENT 0xff4080e0
+
+    typedef struct {
+        uint32_t counts[KH_BUCKETS];
+        uint16_t window[KH_WINDOW]; // Bucket of each of the last KH_WINDOW values, so they can be taken out again
+        uint64_t total; // Values ever recorded
+    } kh_histogram_t;
+
+    //------------------------------------------------------------
+
+    /*
+     Usage
+
+    while(running) {
+        ...draw...
+        KHRecordFrame();
+        KHDraw(frame_buffer, 8, 8);
+        KPFlip();
+    }
+    */
+
+    void KHRecordFrame();
+    /*
+    Adds kp_frame_times from the last KPFlip/KPFlipRects to the histograms and the graph. Call it once per frame, whether the overlay is drawn or not.
+    */
+
+    void KHDraw(ksprite_t* target, int x, int y);
+    /*
+    Draws the overlay, KH_WIDTH by KH_HEIGHT pixels, with its top left corner at (x, y). Times are in milliseconds. Bars in the graph are frame times with the time spent sending the frame in blue at the bottom, and the graph's scale (the top) is written under it.
+    It draws over whatever is there with a solid background, so it also works with a frame buffer that is only partly redrawn each frame. Its area is marked dirty if the target has a ks_dirty_t.
+    */
+
+    void KHRecord(kh_histogram_t* histogram, int64_t value);
+    /*
+    Adds a value to a histogram, replacing the one recorded KH_WINDOW values ago. Negative values count as 0.
+    */
+
+    int64_t KHPercentile(kh_histogram_t* histogram, double fraction);
+    /*
+    The value that fraction (0 to 1) of the last KH_WINDOW values are less than or equal to, to within 3%. 1 gives the largest. 0 if nothing has been recorded.
+    */
+
+    //------------------------------------------------------------
+    // Histograms
+
+    static int KHBucket(uint64_t value) {
+        if(value >= (uint64_t)1<<KH_MAX_BITS) value = ((uint64_t)1<<KH_MAX_BITS) - 1;
+        // Below 2*KH_SUB_BUCKETS every value has a bucket of its own
+        if(value < KH_SUB_BUCKETS) return (int)value;
+#if defined(__GNUC__)
+        int top_bit = 63 - __builtin_clzll(value);
+#else
+        int top_bit = KH_SUB_BITS;
+        while(value >> (top_bit+1)) ++top_bit;
+#endif
+        return (top_bit - KH_SUB_BITS + 1)*KH_SUB_BUCKETS + (int)((value >> (top_bit - KH_SUB_BITS)) & (KH_SUB_BUCKETS-1));
+    }
+
+    // The middle of the bucket
+    static int64_t KHBucketValue(int bucket) {
+        if(bucket < 2*KH_SUB_BUCKETS) return bucket;
+        int shift = bucket/KH_SUB_BUCKETS - 1;
+        return ((int64_t)(KH_SUB_BUCKETS + bucket%KH_SUB_BUCKETS) << shift) + (((int64_t)1 << shift) >> 1);
+    }
+
+    void KHRecord(kh_histogram_t* histogram, int64_t value) {
+        int bucket = KHBucket(value > 0 ? (uint64_t)value : 0);
+        int slot = histogram->total & (KH_WINDOW-1);
+        if(histogram->total >= KH_WINDOW) {
+            --histogram->counts[histogram->window[slot]];
+        }
+        histogram->window[slot] = (uint16_t)bucket;
+        ++histogram->counts[bucket];
+        ++histogram->total;
+    }
+
+    // How many of num_values are at or below the fraction percentile
+    static inline uint64_t KHRank(double fraction, uint64_t num_values) {
+        double wanted = fraction*num_values;
+        uint64_t rank = wanted < 1 ? 1 : (uint64_t)wanted + (wanted > (uint64_t)wanted);
+        return rank < num_values ? rank : num_values;
+    }
+
+    // Fills out[i] with the percentile for fractions[i] in one pass over the buckets. fractions must be in increasing order
+    static void KHPercentiles(kh_histogram_t* histogram, const double* fractions, int64_t* out, int count) {
+        uint64_t num_values = histogram->total < KH_WINDOW ? histogram->total : KH_WINDOW;
+        int i = 0;
+        if(num_values) {
+            uint64_t rank = KHRank(fractions[0], num_values);
+            uint64_t seen = 0;
+            for(int bucket = 0; bucket < KH_BUCKETS && i < count; ++bucket) {
+                if(!histogram->counts[bucket]) continue;
+                seen += histogram->counts[bucket];
+                while(i < count && seen >= rank) {
+                    out[i++] = KHBucketValue(bucket);
+                    if(i < count) rank = KHRank(fractions[i], num_values);
+                }
+            }
+        }
+        for(; i < count; ++i) {
+            out[i] = 0;
+        }
+    }
+
+    int64_t KHPercentile(kh_histogram_t* histogram, double fraction) {
+        int64_t value;
+        KHPercentiles(histogram, &fraction, &value, 1);
+        return value;
+    }
+
+    //------------------------------------------------------------
+    // Font
+
+    // 3x5 pixels, one octal digit per row from the top, the high bit of each on the left. Lower case is drawn as upper case
+    static const char kh_font_chars[] = " 0123456789.:-/%+ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    static const uint16_t kh_font[] = {
+        000000, 075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717, 000002, 002020, 000700, 011244, 051245, 002720,
+        025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152, 055655, 044447, 057755, 065555, 025552, 065644, 025563, 065655, 034216, 072222, 055557, 055552, 055775, 055255, 055222, 071247,
+    };
+#define KH_NUM_GLYPHS ((int)sizeof(kh_font)/(int)sizeof(kh_font[0]))
+
+    //------------------------------------------------------------
+    // Overlay
+
+    static struct {
+        kh_histogram_t frame, present, sleep_error;
+        int64_t graph_frame[KH_GRAPH_WIDTH], graph_present[KH_GRAPH_WIDTH]; // Rings of the last KH_GRAPH_WIDTH frames
+        uint64_t num_frames;
+        bool glyphs_ready;
+        ksprite_t glyphs[KH_NUM_GLYPHS];
+        uint8_t glyph_index[128]; // Glyph for each ASCII character, 0 (space) for the ones the font doesn't have
+        int64_t label_scale; // The graph scale scale_label was written for
+        char scale_label[KH_COLUMNS-9+1];
+    } kh_hud;
+
+    // Renders every glyph at KH_SCALE on the background, so drawing text is one row copy per line of pixels
+    static void KHMakeGlyphs() {
+        for(int i = 0; i < KH_NUM_GLYPHS; ++i) {
+            ksprite_t* glyph = &kh_hud.glyphs[i];
+            KSCreate(glyph, KH_CHAR_WIDTH, KH_LINE_HEIGHT);
+            KSSetAllPixels(glyph, KH_BACKGROUND);
+            for(int row = 0; row < 5; ++row) {
+                for(int column = 0; column < 3; ++column) {
+                    if(kh_font[i] >> ((4-row)*3 + 2-column) & 1) {
+                        KSDrawRectFilled(glyph, column*KH_SCALE, row*KH_SCALE, (column+1)*KH_SCALE-1, (row+1)*KH_SCALE-1, KH_TEXT);
+                    }
+                }
+            }
+            uint8_t c = (uint8_t)kh_font_chars[i];
+            kh_hud.glyph_index[c] = i;
+            if(c >= 'A' && c <= 'Z') {
+                kh_hud.glyph_index[c - 'A' + 'a'] = i;
+            }
+        }
+        kh_hud.glyphs_ready = true;
+    }
+
+    static void KHDrawText(ksprite_t* target, int x, int y, const char* text) {
+        for(; *text; ++text, x += KH_CHAR_WIDTH) {
+            int glyph = kh_hud.glyph_index[(uint8_t)*text & 127];
+            // Spaces are already background
+            if(glyph) {
+                KSBlit(&kh_hud.glyphs[glyph], target, x, y);
+            }
+        }
+    }
+
+    // One pixel wide, y0 to y1 inclusive. Bars are too thin for KSDrawRectFilled to be worth its setup, and the whole panel is already marked dirty
+    static inline void KHDrawBar(ksprite_t* target, int x, int y0, int y1, uint32_t pixel) {
+        if(x < 0 || x > target->w-1) return;
+        y0 = y0 < 0 ? 0 : y0;
+        y1 = y1 > target->h-1 ? target->h-1 : y1;
+        for(uint32_t* p = target->pixels + y0*target->w + x; y0 <= y1; ++y0, p += target->w) {
+            *p = pixel;
+        }
+    }
+
+    // value in units of the last decimal place, right aligned in width characters like %*.*f but without printf's cost.
+    // Too big for the width shows as all 9s. Not null terminated.
+    static void KHFormatFixed(char* out, int width, int decimals, int64_t value) {
+        int64_t max = 1;
+        for(int i = 0; i < width-1; ++i) {
+            max *= 10;
+        }
+        value = value > max-1 ? max-1 : value < 0 ? 0 : value;
+        for(int i = 0; i < width; ++i) {
+            char* c = out + width-1 - i;
+            if(i == decimals) {
+                *c = '.';
+            }
+            else if(i <= decimals+1 || value) {
+                *c = '0' + value%10;
+                value /= 10;
+            }
+            else {
+                *c = ' ';
+            }
+        }
+    }
+
+    // Right aligned in 7 characters with two decimals like %7.2f. Anything from 10 seconds up shows as 9999.99
+    static void KHFormatMs(char* out, int64_t nanoseconds) {
+        KHFormatFixed(out, 7, 2, (nanoseconds + 5000)/10000);
+    }
+
+    // A line of the table: label then p50, p95, p99 and max in milliseconds
+    static void KHDrawRow(ksprite_t* target, int x, int y, const char* label, kh_histogram_t* histogram) {
+        static const double fractions[] = { 0.5, 0.95, 0.99, 1 };
+        int64_t values[4];
+        KHPercentiles(histogram, fractions, values, 4);
+        char line[KH_COLUMNS+1];
+        memset(line, ' ', 7);
+        memcpy(line, label, strlen(label));
+        for(int i = 0; i < 4; ++i) {
+            KHFormatMs(line + 7 + 7*i, values[i]);
+        }
+        line[KH_COLUMNS] = 0;
+        KHDrawText(target, x, y, line);
+    }
+
+    void KHRecordFrame() {
+        KHRecord(&kh_hud.frame, kp_frame_times.frame);
+        KHRecord(&kh_hud.present, kp_frame_times.present);
+        KHRecord(&kh_hud.sleep_error, kp_frame_times.sleep_error);
+        int slot = kh_hud.num_frames % KH_GRAPH_WIDTH;
+        kh_hud.graph_frame[slot] = kp_frame_times.frame;
+        kh_hud.graph_present[slot] = kp_frame_times.present;
+        ++kh_hud.num_frames;
+    }
+
+    void KHDraw(ksprite_t* target, int x, int y) {
+        KPROF_FUNCTION();
+        if(!kh_hud.glyphs_ready) {
+            KHMakeGlyphs();
+        }
+        KSDrawRectFilled(target, x, y, x + KH_WIDTH-1, y + KH_HEIGHT-1, KH_BACKGROUND);
+        int left = x + KH_PADDING;
+        int top = y + KH_PADDING;
+        KHDrawText(target, left, top, "MS         P50    P95    P99    MAX");
+        KHDrawRow(target, left, top + KH_LINE_HEIGHT, "FRAME", &kh_hud.frame);
+        KHDrawRow(target, left, top + 2*KH_LINE_HEIGHT, "PRESENT", &kh_hud.present);
+        KHDrawRow(target, left, top + 3*KH_LINE_HEIGHT, "SLEEP", &kh_hud.sleep_error);
+
+        // Scaled to the first of 1, 2, 5, 10, 20, 50... ms with room for the 99th percentile, so it only changes when the frame rate really does
+        static const double fractions[] = { 0.5, 0.99 };
+        int64_t frame[2];
+        KHPercentiles(&kh_hud.frame, fractions, frame, 2);
+        int64_t scale = 1000000;
+        for(int step = 0; scale < frame[1] + frame[1]/4; ++step) {
+            scale = scale/(step%3 == 1 ? 2 : 1)*(step%3 == 1 ? 5 : 2);
+        }
+        int graph_top = top + 4*KH_LINE_HEIGHT + KH_PADDING/2;
+        int graph_bottom = graph_top + KH_GRAPH_HEIGHT-1;
+        KSDrawRectFilled(target, left, graph_top + KH_GRAPH_HEIGHT/2, left + KH_GRAPH_WIDTH-1, graph_top + KH_GRAPH_HEIGHT/2, KH_GRID);
+        // Oldest on the left
+        int num_bars = kh_hud.num_frames < KH_GRAPH_WIDTH ? (int)kh_hud.num_frames : KH_GRAPH_WIDTH;
+        for(int i = 0; i < num_bars; ++i) {
+            int slot = (kh_hud.num_frames - num_bars + i) % KH_GRAPH_WIDTH;
+            int64_t frame_time = kh_hud.graph_frame[slot];
+            int64_t height = frame_time*KH_GRAPH_HEIGHT/scale;
+            height = height > KH_GRAPH_HEIGHT ? KH_GRAPH_HEIGHT : height < 1 ? 1 : height;
+            int64_t present_height = kh_hud.graph_present[slot]*KH_GRAPH_HEIGHT/scale;
+            present_height = present_height > height ? height : present_height;
+            int bar_x = left + KH_GRAPH_WIDTH - num_bars + i;
+            KHDrawBar(target, bar_x, graph_bottom - (int)height + 1, graph_bottom - (int)present_height, frame_time > frame[0] + frame[0]/2 ? KH_SLOW_FRAME : KH_FRAME);
+            KHDrawBar(target, bar_x, graph_bottom - (int)present_height + 1, graph_bottom, KH_PRESENT);
+        }
+
+        // The scale hardly ever changes, so its label is only written when it does
+        if(scale != kh_hud.label_scale) {
+            char digits[20];
+            int num_digits = 0;
+            for(int64_t ms = scale/1000000; ms || !num_digits; ms /= 10) {
+                digits[num_digits++] = '0' + ms%10;
+            }
+            char* c = kh_hud.scale_label;
+            memcpy(c, "TOP ", 4);
+            c += 4;
+            while(num_digits) {
+                *c++ = digits[--num_digits];
+            }
+            memcpy(c, " MS", 4);
+            kh_hud.label_scale = scale;
+        }
+        // FPS like %5.1f, then the label right aligned
+        char line[KH_COLUMNS+1];
+        memset(line, ' ', KH_COLUMNS);
+        KHFormatFixed(line, 5, 1, frame[0] ? (10000000000 + frame[0]/2)/frame[0] : 0);
+        memcpy(line + 5, " FPS", 4);
+        int label_length = (int)strlen(kh_hud.scale_label);
+        memcpy(line + KH_COLUMNS - label_length, kh_hud.scale_label, label_length);
+        line[KH_COLUMNS] = 0;
+        KHDrawText(target, left, graph_bottom + 1 + KH_PADDING/2, line);
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#define KERO_HUD_H
+#endif
@@ -15,18 +15,32 @@ extern "C"{
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "kero_profile.h"
     
     struct{
         unsigned int w, h;
     } kp_window;
     typedef struct{
-        unsigned int w, h;
+        int w, h;
         uint32_t* pixels;
-    } kp_frame_buffer_t;
+        uint8_t* rows; // Always 0, the frame buffer is never row classified
+        void* dirty; // A ks_dirty_t to track drawing with, or 0
+    } kp_frame_buffer_t; // Same layout as ksprite_t
     static kp_frame_buffer_t kp_frame_buffer;
+    typedef struct{
+        int x, y, w, h;
+    } kp_rect_t; // Same layout as ks_rect_t and SDL_Rect
     float kp_delta = 0.f;
+    typedef struct{
+        int64_t frame; // From the end of the last frame to the end of this one, kp_delta in nanoseconds
+        int64_t present; // Sending the frame to the screen, including waiting for the server to finish reading it
+        int64_t sleep_error; // How late the frame limit sleep woke up, before spinning the rest of the way, 0 if there was no sleep
+    } kp_frame_times_t; // Nanoseconds
+    kp_frame_times_t kp_frame_times;
     bool kp_reset_keyboard_on_focus_out = true;
     bool kp_fullscreen = false;
+    bool kp_headless = false; // Set by KPInit when there's no window, see Headless below
+    bool kp_preserve_frame_buffer = true; // See KPStartPresentThread
     int kp_windowed_width = 0, kp_windowed_height = 0;
     int kp_windowed_x = 0, kp_windowed_y = 0;
     struct{
@@ -50,13 +64,22 @@ extern "C"{
             };
         };
     } kp_event_t;
+    typedef void (*kp_frame_callback_t)(const uint32_t* pixels, int w, int h, uint64_t frame, void* user);
     
     //------------------------------------------------------------
     
     /*
      Usage
      
-    Include this file. Currently this single header contains the entire Kero_Platform library. On Linux link against X11 (-lX11). On Windows/Mac link against SDL2 (-lSDL2)
+    Include this file. Currently this single header contains the entire Kero_Platform library. On Linux link against X11, its extension library and pthreads (-lX11 -lXext -lpthread). On Windows/Mac link against SDL2 (-lSDL2)
+    On Linux the frame buffer is shared with the X server through MIT-SHM when it can be, so KPFlip doesn't have to send the pixels down the X socket. Remote displays, or setting KP_NO_SHM in the environment, use plain XPutImage instead.
+    
+    Headless
+    Define KERO_PLATFORM_HEADLESS before including to build without any window system (POSIX only, link nothing extra). The normal Linux build runs the same way when KP_HEADLESS is set in the environment, or when KPInit can't open a display.
+    Headless, kp_frame_buffer is plain memory, kp_headless is true, nothing is shown, the frame limit starts at 0 so frames run as fast as they're drawn, and the only events are the ones from an event script. The rest of the API works as normal, so drawing code doesn't need to know.
+    In any mode these are read from the environment by KPInit:
+    KP_FRAME_FILES=frames/%05llu.ppm  writes every frame to its own file, see KPWriteFrameFile
+    KP_EVENT_SCRIPT=path              plays an event script, see KPSetEventScript
     */
     
     
@@ -68,33 +91,85 @@ width and height are the internal size of the frame, not the total size of the w
     This sets a target framerate of 60fps and disables key repeat.
     */
     
+    /*
+    kp_frame_buffer is the frame to draw into. It has the same layout as kero_sprite's ksprite_t, so keep a pointer to it rather than a copy and it stays right through resizes and flips:
+    
+    ksprite_t* frame_buffer = (ksprite_t*)&kp_frame_buffer;
+    
+    Resizing reuses the frame buffer's memory when the new size fits in it, so only growing past the biggest size so far allocates.
+    */
+    
     void KPFlip();
     /*
     Send frame buffer to screen.
     Sleep until time since last flip = target frame time (1/fps).
     Sets kp_delta variable to the number of seconds from the end of the last frame to the end of this one, including sleep time. DO NOT MANUALLY CHANGE THE VALUE OF kp_delta!
+    kp_frame_times has the same frame time in nanoseconds, along with how long sending the frame took and how late the sleep woke up. kero_hud.h keeps histograms of them and draws them.
+    With the present thread running, present and sleep_error are from the last frame it finished sending, which is a frame or two behind.
+    */
+    
+    void KPFlipRects(kp_rect_t* rects, int count);
+    /*
+    Same as KPFlip but only sends the parts of the frame buffer inside rects to the screen. Overlapping and nearby rectangles are merged first (rects is overwritten while doing so), so pass them exactly as they were drawn. With a count of 0 nothing is sent and the call just waits for the frame time.
+    Use it with a ks_dirty_t on the sprite you draw into kp_frame_buffer with, then only what changed is sent each frame:
+    
+    ks_dirty_t dirty = {0};
+    frame_buffer.dirty = &dirty;
+    ...draw...
+    KPFlipRects((kp_rect_t*)dirty.rects, dirty.count);
+    dirty.count = 0;
+    */
+    
+    bool KPStartPresentThread();
+    /*
+    Switches to three frame buffers and a thread that sends them to the screen, so KPFlip only queues the finished frame and hands back a free buffer. The next frame can then be drawn while the last one is still being sent, and the frame limit sleep happens on that thread too. KPFlip only waits when drawing gets a whole buffer ahead.
+    kp_frame_buffer.pixels changes on every KPFlip/KPFlipRects, so take it again after each one rather than keeping a copy.
+    The buffer handed back is brought up to date with the frame just flipped, by copying the areas passed to KPFlipRects since it was last drawn into, or the whole frame after a KPFlip. If every frame is drawn from scratch, set kp_preserve_frame_buffer to false to skip the copy and the buffer will hold an older frame.
+    Linux only, it returns false on other platforms, headless, if it can't make a second connection to the X server or if the thread can't be started. When it returns false the single frame buffer is kept as it was. There's no stopping it once started.
+    */
+    
+    int KPDrainEvents(kp_event_t* out, int max);
+    /*
+    Copies up to max waiting events into out, oldest first, and returns how many it copied. Never blocks.
+    Events are read from the window system into a fixed ring of KP_EVENT_QUEUE_SIZE events as they arrive, and mouse movement only updates kp_mouse, so handling input doesn't allocate or wait on the server.
     */
     
     int KPEventsQueued();
     /*
-    Returns number of events queued.
-    Updates mouse position and button state.
+    Reads any events that have arrived and returns the number waiting.
     */
     
     kp_event_t* KPNextEvent();
     /*
     Returns pointer to next event in queue and removes that event from the queue.
     The event may have type KPEVENT_NONE in which case it should be ignored.
+    The event lives in the queue, so it's only valid until the next KPEventsQueued/KPDrainEvents call.
     */
     
     void KPFreeEvent(kp_event_t* e);
     /*
-    Frees the event. Should be called for every event retrieved by KPNextEvent to avoid a memory leak.
+    Does nothing now that events aren't allocated. Kept so existing event loops still compile.
     */
     
     /*
     Example event handling code:
     
+    kp_event_t events[64];
+    int num_events = KPDrainEvents(events, 64);
+    for(int i = 0; i < num_events; ++i) {
+        kp_event_t* e = &events[i];
+        switch(e->type) {
+            case KPEVENT_KEY_PRESS:{
+                if(e->key == KEY_ESCAPE) game_running = false;
+            }break;
+            case KPEVENT_QUIT:{
+                game_running = false;
+            }break;
+        }
+    }
+    
+    or one at a time:
+    
     while(KPEventsQueued()) {
         kpEvent* e = KPNextEvent();
         switch(e->type) {
@@ -119,11 +194,12 @@ width and height are the internal size of the frame, not the total size of the w
     /*
     Target number of frames per second. When calling KPFlip() the process will sleep until 1/fps seconds have elapsed since the last flip.
     Call this with fps of 0 to disable frame limit.
+    The new rate starts from the next flip. With the present thread running it can still be changed, the thread picks it up before its next wait.
     */
     
     void KPUpdateMouse();
     /*
-    Updates the mouse position and buttons.
+    Asks the window system where the mouse is right now. kp_mouse is already kept up to date from mouse events, so this is only needed if you can't wait for the next one. On Linux it's a round trip to the X server.
     Mouse x/y are kp_mouse.x/y
     Buttons are kp_mouse.buttons & MOUSE_LEFT/MOUSE_RIGHT/MOUSE_OTHER
     */
@@ -177,21 +253,184 @@ Key repeats (holding key down) are ignored automatically.
     Open a URL in the default web browser.
     */
     
+    void KPSetFrameCallback(kp_frame_callback_t callback, void* user);
+    /*
+    KPFlip and KPFlipRects call callback with the whole frame buffer once the frame is drawn, before waiting for the frame time. frame counts up from 0 at KPInit. user is passed through. Pass a callback of 0 to stop.
+    The pixels belong to kp_frame_buffer, so copy them if they're needed after the callback returns.
+    */
+    
+    void KPWriteFrameFile(const uint32_t* pixels, int w, int h, uint64_t frame, void* user);
+    /*
+    A frame callback that writes each frame to its own binary PPM file. user is a printf format for the path, given the frame number as an unsigned long long:
+    
+    KPSetFrameCallback(KPWriteFrameFile, "frames/%05llu.ppm");
+    */
+    
+    bool KPSetEventScript(const char* const script);
+    bool KPLoadEventScript(const char* const path);
+    /*
+    Replaces the event script with script, or the contents of the file at path. Returns false, and prints the line it couldn't read, if the script is bad.
+    Each step of the script is put into the event queue once that many frames have been flipped, as if it came from the window system, so kp_keyboard and kp_mouse are updated too. Works with a window as well as headless.
+    One step per line, # starts a comment:
+    
+    0 key_press space
+    2 key_release space
+    10 mouse_move 100 200            # Only moves kp_mouse, like real motion
+    11 mouse_press left 100 200      # left, right or other
+    12 mouse_release left 100 200
+    30 resize 1920 1080
+    40 focus_out
+    41 focus_in
+    600 quit
+    
+    Key names are the KEY_ defines in lower case without KEY_ (a, 0, up, escape, lshift, equal...). Steps on the same frame keep their order.
+    Headless nothing else ends the program, so a script for a program that runs until it's told to quit should end with quit.
+    */
+    
     //------------------------------------------------------------
     
 #define KEY_ENTER KEY_RETURN
     
-#if defined(__linux__)
+    // Every upload has a fixed cost on top of its pixels, so two rectangles are merged if their bounding box only adds this many pixels that didn't need sending
+#define KP_MERGE_SLACK 4096
+    // Past this many rectangles after clipping everything goes as one bounding box, which also keeps the pairwise merge small
+#define KP_MAX_FLIP_RECTS 64
+    
+    // Events are translated into this ring as they're read. head and tail only ever count up, the slot is the count modulo the size.
+#ifndef KP_EVENT_QUEUE_SIZE
+#define KP_EVENT_QUEUE_SIZE 256 // Must be a power of 2
+#endif
+    static kp_event_t kp_event_queue[KP_EVENT_QUEUE_SIZE];
+    static unsigned int kp_event_head = 0, kp_event_tail = 0;
+    static kp_event_t kp_event_none;
+    
+    static inline int KPQueueCount() {
+        return (int)(kp_event_tail - kp_event_head);
+    }
+    
+    static inline kp_event_t* KPQueueSlot(unsigned int index) {
+        return &kp_event_queue[index & (KP_EVENT_QUEUE_SIZE-1)];
+    }
+    
+    // Adds the event written at the tail. A resize that arrives straight after another one still waiting in the queue
+    // replaces its size instead, so however many come in together during a drag the app sees one, with the latest size.
+    // Only the newest queued event is merged into, so events never move past each other.
+    static void KPQueueCommit() {
+        kp_event_t* event = KPQueueSlot(kp_event_tail);
+        if(event->type == KPEVENT_RESIZE && kp_event_tail != kp_event_head) {
+            kp_event_t* last = KPQueueSlot(kp_event_tail - 1);
+            if(last->type == KPEVENT_RESIZE) {
+                last->width = event->width;
+                last->height = event->height;
+                return;
+            }
+        }
+        ++kp_event_tail;
+    }
+    
+    static void KPPumpEvents();
+    static void KPApplyResize(int width, int height);
+    
+    // Events are read ahead of the app, so a resize only replaces kp_frame_buffer when the app takes the event off the
+    // queue. Until then the app keeps drawing into the buffer it knows about.
+    static kp_event_t* KPQueuePop() {
+        kp_event_t* event = KPQueueSlot(kp_event_head++);
+        if(event->type == KPEVENT_RESIZE) {
+            KPApplyResize(event->width, event->height);
+        }
+        return event;
+    }
+    
+    int KPDrainEvents(kp_event_t* out, int max) {
+        KPROF_FUNCTION();
+        KPPumpEvents();
+        int count = 0;
+        while(count < max && kp_event_head != kp_event_tail) {
+            out[count++] = *KPQueuePop();
+        }
+        return count;
+    }
+    
+    void KPFreeEvent(kp_event_t* e) {
+        (void)e;
+    }
+    
+    // Clips rects to the window and merges them in place, returns how many are left
+    static int KPMergeRects(kp_rect_t* rects, int count) {
+        int n = 0;
+        for(int i = 0; i < count; ++i) {
+            int left = rects[i].x > 0 ? rects[i].x : 0;
+            int top = rects[i].y > 0 ? rects[i].y : 0;
+            int right = rects[i].x + rects[i].w < (int)kp_window.w ? rects[i].x + rects[i].w : (int)kp_window.w;
+            int bottom = rects[i].y + rects[i].h < (int)kp_window.h ? rects[i].y + rects[i].h : (int)kp_window.h;
+            if(left >= right || top >= bottom) continue;
+            rects[n].x = left;
+            rects[n].y = top;
+            rects[n].w = right - left;
+            rects[n].h = bottom - top;
+            ++n;
+        }
+        // Past the limit the pairwise merge below would be the slow part, so skip it
+        if(n > KP_MAX_FLIP_RECTS) {
+            for(int i = 1; i < n; ++i) {
+                int right = rects[0].x + rects[0].w > rects[i].x + rects[i].w ? rects[0].x + rects[0].w : rects[i].x + rects[i].w;
+                int bottom = rects[0].y + rects[0].h > rects[i].y + rects[i].h ? rects[0].y + rects[0].h : rects[i].y + rects[i].h;
+                rects[0].x = rects[0].x < rects[i].x ? rects[0].x : rects[i].x;
+                rects[0].y = rects[0].y < rects[i].y ? rects[0].y : rects[i].y;
+                rects[0].w = right - rects[0].x;
+                rects[0].h = bottom - rects[0].y;
+            }
+            return 1;
+        }
+        for(int i = 0; i < n; ++i) {
+            for(int j = i+1; j < n; ++j) {
+                kp_rect_t* a = &rects[i];
+                kp_rect_t* b = &rects[j];
+                int left = a->x < b->x ? a->x : b->x;
+                int top = a->y < b->y ? a->y : b->y;
+                int right = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+                int bottom = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+                int64_t waste = (int64_t)(right-left)*(bottom-top) - (int64_t)a->w*a->h - (int64_t)b->w*b->h;
+                if(waste > KP_MERGE_SLACK) continue;
+                a->x = left;
+                a->y = top;
+                a->w = right - left;
+                a->h = bottom - top;
+                rects[j] = rects[--n];
+                // a grew, so check it against everything again
+                j = i;
+            }
+        }
+        return n;
+    }
+    
+    // Counts finished frames, event scripts use it as their clock
+    static uint64_t kp_frame_number = 0;
+    static kp_frame_callback_t kp_frame_callback = 0;
+    static void* kp_frame_callback_user = 0;
+    
+    void KPSetFrameCallback(kp_frame_callback_t callback, void* user) {
+        kp_frame_callback = callback;
+        kp_frame_callback_user = user;
+    }
+    
+    static void KPHandOffFrame() {
+        if(kp_frame_callback) {
+            kp_frame_callback(kp_frame_buffer.pixels, kp_frame_buffer.w, kp_frame_buffer.h, kp_frame_number, kp_frame_callback_user);
+        }
+        ++kp_frame_number;
+    }
+    
+    static void KPPumpScript();
+    static void KPStartFromEnvironment();
+    
+#if defined(__linux__) || defined(KERO_PLATFORM_HEADLESS)
+    
+    // Shared by X11 and headless
     
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/Xatom.h>
-#define XK_MISCELLANY
-#define XK_LATIN1
-#include <X11/keysymdef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <X11/XKBlib.h>
+#include <errno.h>
 #include <time.h>
     typedef struct timespec timespec;
     
@@ -200,6 +439,282 @@ Key repeats (holding key down) are ignored automatically.
 #define MOUSE_RIGHT (0b10)
 #define MOUSE_OTHER (0b100)
     
+    static int64_t frame_start; // CLOCK_MONOTONIC nanoseconds
+    static int64_t frame_deadline; // When the current frame should end, 0 to start a new schedule
+    // The schedule belongs to whichever thread waits for the deadline, the present thread if it's running, so a new
+    // rate is left here (plus 1, 0 when there's none) for it to pick up rather than written straight into it
+    static unsigned long kp_requested_frame_time = 0;
+    bool kp_keyboard[256];
+    
+    // fps = 0 to disable frame limiting
+    void KPSetTargetFramerate(const unsigned int fps) {
+        unsigned long frame_time = fps ? 1000000000/fps : 0;
+        __atomic_store_n(&kp_requested_frame_time, frame_time + 1, __ATOMIC_RELEASE);
+    }
+    
+    // Unlike CLOCK_REALTIME this never jumps when NTP or the user sets the clock
+    static inline int64_t KPMonotonicNow() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    }
+    
+    void KPSleep(unsigned long nanoseconds) {
+        timespec sleep_time = { 0, nanoseconds };
+        nanosleep(&sleep_time, 0);
+    }
+    
+    // Frames end on a fixed schedule of deadlines, each one target_frame_time after the last, so a slow frame is made up
+    // by the next one instead of pushing every frame after it back. The sleep is absolute so it can't be stretched by
+    // the time spent working out how long to sleep, and stops KP_SPIN_TIME short of the deadline because the kernel
+    // often wakes us late. The rest is spun.
+#ifndef KP_SPIN_TIME
+#define KP_SPIN_TIME 300000 // Nanoseconds
+#endif
+    // Returns the time it finished waiting. sleep_error is measured when the sleep returns, the spin after it always ends
+    // on time. A frame that finishes too close to its deadline doesn't sleep, so it has no sleep error
+    static int64_t KPWaitForDeadline(int64_t* sleep_error) {
+        KPROF_FUNCTION();
+        int64_t now = KPMonotonicNow();
+        *sleep_error = 0;
+        unsigned long requested = __atomic_exchange_n(&kp_requested_frame_time, 0, __ATOMIC_ACQUIRE);
+        if(requested) {
+            target_frame_time = requested - 1;
+            frame_deadline = 0;
+        }
+        if(target_frame_time) {
+            if(!frame_deadline) {
+                frame_deadline = frame_start + target_frame_time;
+            }
+            if(now > frame_deadline + (int64_t)target_frame_time) {
+                // More than a whole frame behind (a breakpoint, a hitch loading something), so start a new schedule rather than rushing the next few frames
+                frame_deadline = now;
+            }
+            int64_t wake = frame_deadline - KP_SPIN_TIME;
+            if(now < wake) {
+                timespec wake_time = { (time_t)(wake/1000000000), (long)(wake%1000000000) };
+                while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, 0) == EINTR);
+                *sleep_error = KPMonotonicNow() - wake;
+            }
+            while(KPMonotonicNow() < frame_deadline) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            }
+            now = KPMonotonicNow();
+            frame_deadline += target_frame_time;
+        }
+        return now;
+    }
+    
+    static void KPFinishFrame() {
+        int64_t now = KPWaitForDeadline(&kp_frame_times.sleep_error);
+        kp_frame_times.frame = now - frame_start;
+        kp_delta = kp_frame_times.frame/1000000000.f;
+        frame_start = now;
+    }
+    
+    double KPClock() {
+        timespec clock_time;
+        clock_gettime(CLOCK_REALTIME, &clock_time);
+        return clock_time.tv_sec*1000.0 + clock_time.tv_nsec/1000000.0;
+    }
+    
+    // Headless the frame buffer is plain memory and there's nothing to send it to
+    static size_t kp_headless_capacity = 0; // Pixels
+    
+    static void KPHeadlessInit(const unsigned int width, const unsigned int height) {
+        kp_headless = true;
+        kp_windowed_width = width;
+        kp_windowed_height = height;
+        kp_window.w = width;
+        kp_window.h = height;
+        kp_headless_capacity = (size_t)width*height;
+        kp_frame_buffer.pixels = (uint32_t*)calloc(kp_headless_capacity, sizeof(uint32_t));
+        kp_frame_buffer.w = width;
+        kp_frame_buffer.h = height;
+        // No screen to keep in step with
+        KPSetTargetFramerate(0);
+        frame_start = KPMonotonicNow();
+    }
+    
+    static void KPHeadlessResize(int width, int height) {
+        if(!kp_fullscreen) {
+            kp_windowed_width = width;
+            kp_windowed_height = height;
+        }
+        kp_window.w = width;
+        kp_window.h = height;
+        size_t needed = (size_t)width*height;
+        if(needed > kp_headless_capacity) {
+            // Half as big again, so growing a bit at a time doesn't allocate every time
+            kp_headless_capacity = needed > kp_headless_capacity*3/2 ? needed : kp_headless_capacity*3/2;
+            free(kp_frame_buffer.pixels);
+            kp_frame_buffer.pixels = (uint32_t*)calloc(kp_headless_capacity, sizeof(uint32_t));
+        }
+        kp_frame_buffer.w = width;
+        kp_frame_buffer.h = height;
+    }
+    
+    static void KPHeadlessFlip() {
+        // Handing the frame over is as close as headless gets to sending it anywhere
+        int64_t start = KPMonotonicNow();
+        KPHandOffFrame();
+        kp_frame_times.present = KPMonotonicNow() - start;
+        KPFinishFrame();
+    }
+    
+    // Never blocks, there's nothing to wait for
+    static kp_event_t* KPPollEvent() {
+        KPPumpEvents();
+        if(kp_event_head == kp_event_tail) {
+            kp_event_none.type = KPEVENT_NONE;
+            return &kp_event_none;
+        }
+        return KPQueuePop();
+    }
+    
+#endif // __linux__ || KERO_PLATFORM_HEADLESS
+    
+#if defined(KERO_PLATFORM_HEADLESS)
+    
+    // Key consts. The same values as the X11 build (the low byte of the keysym)
+#define KEY_UP (0x52)
+#define KEY_DOWN (0x54)
+#define KEY_LEFT (0x51)
+#define KEY_RIGHT (0x53)
+#define KEY_SPACE (' ')
+#define KEY_RETURN (0x0d)
+#define KEY_ESCAPE (0x1b)
+#define KEY_LSHIFT (0xe1)
+#define KEY_RSHIFT (0xe2)
+#define KEY_LALT (0xe9)
+#define KEY_RALT (0xea)
+#define KEY_Q ('q')
+#define KEY_W ('w')
+#define KEY_E ('e')
+#define KEY_R ('r')
+#define KEY_T ('t')
+#define KEY_Y ('y')
+#define KEY_U ('u')
+#define KEY_I ('i')
+#define KEY_O ('o')
+#define KEY_P ('p')
+#define KEY_A ('a')
+#define KEY_S ('s')
+#define KEY_D ('d')
+#define KEY_F ('f')
+#define KEY_G ('g')
+#define KEY_H ('h')
+#define KEY_J ('j')
+#define KEY_K ('k')
+#define KEY_L ('l')
+#define KEY_Z ('z')
+#define KEY_X ('x')
+#define KEY_C ('c')
+#define KEY_V ('v')
+#define KEY_B ('b')
+#define KEY_N ('n')
+#define KEY_M ('m')
+#define KEY_EQUAL ('=')
+#define KEY_MINUS ('-')
+#define KEY_0 ('0')
+#define KEY_1 ('1')
+#define KEY_2 ('2')
+#define KEY_3 ('3')
+#define KEY_4 ('4')
+#define KEY_5 ('5')
+#define KEY_6 ('6')
+#define KEY_7 ('7')
+#define KEY_8 ('8')
+#define KEY_9 ('9')
+    
+    void KPSetWindowTitle(const char* const title) {
+        (void)title;
+    }
+    
+    void KPInit(const unsigned int width, const unsigned int height, const char* const title) {
+        KPROF_THREAD_NAME("main");
+        (void)title;
+        KPHeadlessInit(width, height);
+        KPStartFromEnvironment();
+    }
+    
+    void KPFlip() {
+        KPROF_FUNCTION();
+        KPHeadlessFlip();
+    }
+    
+    void KPFlipRects(kp_rect_t* rects, int count) {
+        KPROF_FUNCTION();
+        // Nothing is sent, but rects ends up the same as on the other backends
+        KPMergeRects(rects, count);
+        KPHeadlessFlip();
+    }
+    
+    void KPUpdateMouse() {
+    }
+    
+    static void KPApplyResize(int width, int height) {
+        KPROF_FUNCTION();
+        KPHeadlessResize(width, height);
+    }
+    
+    static void KPPumpEvents() {
+        KPPumpScript();
+    }
+    
+    int KPEventsQueued() {
+        KPPumpEvents();
+        return KPQueueCount();
+    }
+    
+    kp_event_t* KPNextEvent() {
+        KPROF_FUNCTION();
+        return KPPollEvent();
+    }
+    
+    void KPShowCursor(const bool show) {
+        (void)show;
+    }
+    
+    void KPSetCursorPos(int x, int y, int* dx, int* dy) {
+        if(dx) *dx = x - kp_mouse.x;
+        if(dy) *dy = y - kp_mouse.y;
+        kp_mouse.x = x;
+        kp_mouse.y = y;
+    }
+    
+    void KPFullscreen(bool full) {
+        kp_fullscreen = full;
+    }
+    
+    void KPOpenURL(const char* const url) {
+        (void)url;
+    }
+    
+    bool KPStartPresentThread() {
+        return false;
+    }
+    
+    // End of KERO_PLATFORM_HEADLESS
+    
+    //------------------------------------------------------------
+    
+#elif defined(__linux__)
+    
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#define XK_MISCELLANY
+#define XK_LATIN1
+#include <X11/keysymdef.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <pthread.h>
+    
     // Key consts
 #define KEY_UP ((uint8_t)XK_Up)
 #define KEY_DOWN ((uint8_t)XK_Down)
@@ -260,40 +775,394 @@ Key repeats (holding key down) are ignored automatically.
     static XVisualInfo visual_info;
     static XSetWindowAttributes window_attributes;
     static Window xwindow;
-    static XImage* ximage;
     static Atom WM_DELETE_WINDOW;
     static GC graphics_context;
-    static timespec frame_start;
-    static timespec frame_finish;
-    bool kp_keyboard[256];
+    typedef struct {
+        XImage* image; // Just a header for the current size, pointing at storage
+        char* storage;
+        size_t capacity; // Bytes
+        XShmSegmentInfo shm_info;
+        bool shm_active; // storage is shm_info's segment
+    } kp_image_t;
+    static kp_image_t kp_image; // The frame buffer, unless the present thread is running
+    static int shm_completion_type;
+    static bool shm_attach_failed;
+    static int kp_queued_width, kp_queued_height; // Size of the last resize put in the event queue
+    
+    // XShmAttach fails with an X error rather than a return value when the server can't see our memory (remote displays)
+    static int KPShmErrorHandler(Display* d, XErrorEvent* e) {
+        (void)d;
+        (void)e;
+        shm_attach_failed = true;
+        return 0;
+    }
     
-    // KPSetWindowTitle on Linux is very slow and inconsistent. Don't call every frame.
-    void KPSetWindowTitle(const char* const title) {
-        XStoreName(display, xwindow, title);
+    static bool KPCreateShmStorage(Display* d, kp_image_t* image, size_t capacity) {
+        if(getenv("KP_NO_SHM") || !XShmQueryExtension(d)) return false;
+        XShmSegmentInfo* shm_info = &image->shm_info;
+        shm_info->shmid = shmget(IPC_PRIVATE, capacity, IPC_CREAT | 0600);
+        if(shm_info->shmid < 0) return false;
+        shm_info->shmaddr = (char*)shmat(shm_info->shmid, 0, 0);
+        shm_info->readOnly = False;
+        bool attached = false;
+        if(shm_info->shmaddr != (char*)-1) {
+            shm_attach_failed = false;
+            int (*old_handler)(Display*, XErrorEvent*) = XSetErrorHandler(KPShmErrorHandler);
+            XShmAttach(d, shm_info);
+            XSync(d, False);
+            XSetErrorHandler(old_handler);
+            attached = !shm_attach_failed;
+        }
+        // Marked for removal straight away, so the segment goes when both sides detach, even if we crash
+        shmctl(shm_info->shmid, IPC_RMID, 0);
+        if(!attached) {
+            if(shm_info->shmaddr != (char*)-1) shmdt(shm_info->shmaddr);
+            return false;
+        }
+        image->storage = shm_info->shmaddr;
+        image->capacity = capacity;
+        image->shm_active = true;
+        return true;
     }
     
-    // fps = 0 to disable frame limiting
-    void KPSetTargetFramerate(const unsigned int fps) {
-        if(fps) {
-            target_frame_time = 1000000000/fps;
+    static void KPFreeStorage(Display* d, kp_image_t* image) {
+        if(image->shm_active) {
+            XShmDetach(d, &image->shm_info);
+            XSync(d, False);
+            shmdt(image->shm_info.shmaddr);
+            image->shm_active = false;
         }
-        else{
-            target_frame_time = 0;
+        else {
+            free(image->storage);
         }
+        image->storage = 0;
+        image->capacity = 0;
+    }
+    
+    // Makes image the size of the window for d to send, and returns its pixels. The storage is kept as long as the window
+    // fits in it, so most resizes only replace the XImage header and don't talk to the server at all.
+    static uint32_t* KPSizeImage(Display* d, kp_image_t* image) {
+        size_t needed = sizeof(uint32_t)*kp_window.w*kp_window.h;
+        if(image->image) {
+            image->image->data = 0;
+            XDestroyImage(image->image);
+            image->image = 0;
+        }
+        if(needed > image->capacity) {
+            // Half as big again, so dragging a window bigger only allocates a few times
+            size_t capacity = needed > image->capacity*3/2 ? needed : image->capacity*3/2;
+            if(image->storage) {
+                KPFreeStorage(d, image);
+            }
+            if(!KPCreateShmStorage(d, image, capacity)) {
+                image->storage = (char*)malloc(capacity);
+                image->capacity = capacity;
+            }
+        }
+        if(image->shm_active) {
+            image->image = XShmCreateImage(d, visual_info.visual, visual_info.depth, ZPixmap, image->storage, &image->shm_info, kp_window.w, kp_window.h);
+        }
+        else {
+            image->image = XCreateImage(d, visual_info.visual, visual_info.depth, ZPixmap, 0, image->storage, kp_window.w, kp_window.h, 32, 0);
+        }
+        return (uint32_t*)image->storage;
+    }
+    
+    static void KPDestroyImage(Display* d, kp_image_t* image) {
+        image->image->data = 0;
+        XDestroyImage(image->image);
+        image->image = 0;
+        KPFreeStorage(d, image);
+    }
+    
+    static void KPCreateFrameBuffer() {
+        kp_frame_buffer.pixels = KPSizeImage(display, &kp_image);
+        kp_frame_buffer.w = kp_window.w;
+        kp_frame_buffer.h = kp_window.h;
+    }
+    
+    static void KPDestroyFrameBuffer() {
+        KPDestroyImage(display, &kp_image);
+    }
+    
+    static Bool KPIsShmCompletion(Display* d, XEvent* e, XPointer arg) {
+        (void)d;
+        (void)arg;
+        return e->type == shm_completion_type;
+    }
+    
+    // Sends part of an image. With shm only the last put of a frame asks for a completion event, they finish in order.
+    static void KPPutImage(Display* d, GC gc, kp_image_t* image, int x, int y, int w, int h, bool last) {
+        if(image->shm_active) {
+            XShmPutImage(d, xwindow, gc, image->image, x, y, x, y, w, h, last);
+        }
+        else {
+            XPutImage(d, xwindow, gc, image->image, x, y, x, y, w, h);
+        }
+    }
+    
+    // The server reads a shm image after XShmPutImage has returned, so drawing into it again has to wait until it's done
+    static void KPWaitForPut(Display* d, kp_image_t* image) {
+        KPROF_FUNCTION();
+        if(!image->shm_active) return;
+        XEvent e;
+        XIfEvent(d, &e, KPIsShmCompletion, 0);
+    }
+    
+    //------------------------------------------------------------
+    // Present thread, see KPStartPresentThread
+    
+#define KP_PRESENT_BUFFERS 3
+    // Frames of changed areas kept to bring an old buffer up to date, anything older is copied whole
+#define KP_PRESENT_HISTORY 8
+    
+    typedef enum {
+        KP_BUFFER_FREE, KP_BUFFER_DRAWING, KP_BUFFER_QUEUED, KP_BUFFER_PRESENTING
+    } kp_buffer_state_t;
+    
+    typedef struct {
+        kp_image_t image;
+        uint32_t* pixels;
+        kp_buffer_state_t state;
+        uint64_t frame; // The frame whose pixels it holds
+        kp_rect_t rects[KP_MAX_FLIP_RECTS]; // What to send when queued
+        int num_rects; // -1 to send everything
+    } kp_present_buffer_t;
+    
+    static struct {
+        bool running;
+        Display* display; // Its own connection, so it never shares Xlib state with the thread drawing and reading events
+        GC gc;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t queued, freed;
+        kp_present_buffer_t buffers[KP_PRESENT_BUFFERS];
+        int drawing; // The buffer in kp_frame_buffer
+        int queue[KP_PRESENT_BUFFERS]; // Waiting to be sent, oldest first
+        unsigned queue_head, queue_tail;
+        bool busy; // Sending a buffer or waiting out its frame time
+        int64_t present_time, sleep_error; // Of the last buffer sent, for kp_frame_times
+        uint64_t frame; // Frames flipped since the thread started
+        kp_rect_t history[KP_PRESENT_HISTORY][KP_MAX_FLIP_RECTS]; // What changed in each of the last frames
+        int history_count[KP_PRESENT_HISTORY]; // -1 when the whole frame did
+        int64_t last_flip;
+    } kp_present;
+    
+    static void* KPPresentThread(void* data) {
+        (void)data;
+        Display* d = kp_present.display;
+        KPROF_THREAD_NAME("kero present");
+        pthread_mutex_lock(&kp_present.mutex);
+        for(;;) {
+            while(kp_present.queue_head == kp_present.queue_tail) {
+                pthread_cond_wait(&kp_present.queued, &kp_present.mutex);
+            }
+            kp_present_buffer_t* buffer = &kp_present.buffers[kp_present.queue[kp_present.queue_head++ % KP_PRESENT_BUFFERS]];
+            buffer->state = KP_BUFFER_PRESENTING;
+            kp_present.busy = true;
+            pthread_mutex_unlock(&kp_present.mutex);
+            KPROF_ZONE("present");
+            
+            int64_t put_start = KPMonotonicNow();
+            int count = buffer->num_rects;
+            if(count < 0) {
+                KPPutImage(d, kp_present.gc, &buffer->image, 0, 0, buffer->image.image->width, buffer->image.image->height, true);
+            }
+            for(int i = 0; i < count; ++i) {
+                KPPutImage(d, kp_present.gc, &buffer->image, buffer->rects[i].x, buffer->rects[i].y, buffer->rects[i].w, buffer->rects[i].h, i == count-1);
+            }
+            if(count) {
+                XFlush(d);
+            }
+            int64_t put_time = KPMonotonicNow() - put_start;
+            // The frame limit is kept here, the drawing thread only waits when it runs out of buffers
+            int64_t sleep_error;
+            frame_start = KPWaitForDeadline(&sleep_error);
+            if(count) {
+                KPWaitForPut(d, &buffer->image);
+            }
+            put_time += KPMonotonicNow() - frame_start;
+            
+            pthread_mutex_lock(&kp_present.mutex);
+            buffer->state = KP_BUFFER_FREE;
+            kp_present.busy = false;
+            kp_present.present_time = put_time;
+            kp_present.sleep_error = sleep_error;
+            pthread_cond_broadcast(&kp_present.freed);
+        }
+        return 0;
+    }
+    
+    // Copies whatever changed since buffer was last drawn from latest, which holds frame
+    static void KPPresentCatchUp(kp_present_buffer_t* buffer, const kp_present_buffer_t* latest, uint64_t frame) {
+        KPROF_FUNCTION();
+        if(buffer->frame == frame) return;
+        bool whole = frame - buffer->frame > KP_PRESENT_HISTORY;
+        for(uint64_t f = buffer->frame+1; !whole && f <= frame; ++f) {
+            whole = kp_present.history_count[f % KP_PRESENT_HISTORY] < 0;
+        }
+        int w = kp_frame_buffer.w;
+        if(whole) {
+            memcpy(buffer->pixels, latest->pixels, sizeof(uint32_t)*w*kp_frame_buffer.h);
+            return;
+        }
+        for(uint64_t f = buffer->frame+1; f <= frame; ++f) {
+            int slot = f % KP_PRESENT_HISTORY;
+            for(int i = 0; i < kp_present.history_count[slot]; ++i) {
+                kp_rect_t r = kp_present.history[slot][i];
+                for(int y = r.y; y < r.y + r.h; ++y) {
+                    memcpy(buffer->pixels + y*w + r.x, latest->pixels + y*w + r.x, sizeof(uint32_t)*r.w);
+                }
+            }
+        }
+    }
+    
+    // rects are already merged, count -1 sends the whole frame
+    static void KPPresentFlip(kp_rect_t* rects, int count) {
+        KPROF_FUNCTION();
+        KPHandOffFrame();
+        pthread_mutex_lock(&kp_present.mutex);
+        kp_present_buffer_t* done = &kp_present.buffers[kp_present.drawing];
+        uint64_t frame = ++kp_present.frame;
+        int slot = frame % KP_PRESENT_HISTORY;
+        done->frame = frame;
+        done->num_rects = count;
+        kp_present.history_count[slot] = count;
+        for(int i = 0; i < count; ++i) {
+            done->rects[i] = rects[i];
+            kp_present.history[slot][i] = rects[i];
+        }
+        done->state = KP_BUFFER_QUEUED;
+        kp_present.queue[kp_present.queue_tail++ % KP_PRESENT_BUFFERS] = kp_present.drawing;
+        pthread_cond_signal(&kp_present.queued);
+        // Only waits when drawing is a whole buffer ahead of presenting
+        KPROF_BEGIN("wait for buffer");
+        int next;
+        for(;;) {
+            next = -1;
+            for(int i = 0; i < KP_PRESENT_BUFFERS; ++i) {
+                // The most recent one has the least to catch up on
+                if(kp_present.buffers[i].state == KP_BUFFER_FREE && (next < 0 || kp_present.buffers[i].frame > kp_present.buffers[next].frame)) {
+                    next = i;
+                }
+            }
+            if(next >= 0) break;
+            pthread_cond_wait(&kp_present.freed, &kp_present.mutex);
+        }
+        KPROF_END();
+        kp_present_buffer_t* buffer = &kp_present.buffers[next];
+        buffer->state = KP_BUFFER_DRAWING;
+        kp_present.drawing = next;
+        kp_frame_times.present = kp_present.present_time;
+        kp_frame_times.sleep_error = kp_present.sleep_error;
+        pthread_mutex_unlock(&kp_present.mutex);
+        
+        // The present thread only reads done, so it can be copied from while it's sent
+        if(kp_preserve_frame_buffer) {
+            KPPresentCatchUp(buffer, done, frame);
+        }
+        buffer->frame = frame;
+        kp_frame_buffer.pixels = buffer->pixels;
+        int64_t now = KPMonotonicNow();
+        kp_frame_times.frame = now - kp_present.last_flip;
+        kp_delta = kp_frame_times.frame/1000000000.f;
+        kp_present.last_flip = now;
+    }
+    
+    static void KPPresentResize() {
+        KPROF_FUNCTION();
+        pthread_mutex_lock(&kp_present.mutex);
+        // The buffers can only change once the thread is done with them. It's then waiting on queued, so its connection is free to use here.
+        while(kp_present.queue_head != kp_present.queue_tail || kp_present.busy) {
+            pthread_cond_wait(&kp_present.freed, &kp_present.mutex);
+        }
+        for(int i = 0; i < KP_PRESENT_BUFFERS; ++i) {
+            kp_present_buffer_t* buffer = &kp_present.buffers[i];
+            buffer->pixels = KPSizeImage(kp_present.display, &buffer->image);
+            buffer->state = i == kp_present.drawing ? KP_BUFFER_DRAWING : KP_BUFFER_FREE;
+            buffer->frame = kp_present.frame;
+        }
+        pthread_mutex_unlock(&kp_present.mutex);
+        kp_frame_buffer.pixels = kp_present.buffers[kp_present.drawing].pixels;
+        kp_frame_buffer.w = kp_window.w;
+        kp_frame_buffer.h = kp_window.h;
+    }
+    
+    bool KPStartPresentThread() {
+        if(kp_present.running) return true;
+        if(kp_headless) return false;
+        kp_present.display = XOpenDisplay(DisplayString(display));
+        if(!kp_present.display) return false;
+        kp_present.gc = DefaultGC(kp_present.display, screen);
+        for(int i = 0; i < KP_PRESENT_BUFFERS; ++i) {
+            kp_present_buffer_t* buffer = &kp_present.buffers[i];
+            buffer->pixels = KPSizeImage(kp_present.display, &buffer->image);
+            // Carry on from what's been drawn so far
+            memcpy(buffer->pixels, kp_frame_buffer.pixels, sizeof(uint32_t)*kp_window.w*kp_window.h);
+            buffer->state = i ? KP_BUFFER_FREE : KP_BUFFER_DRAWING;
+            buffer->frame = 0;
+        }
+        kp_present.drawing = 0;
+        kp_present.frame = 0;
+        kp_present.queue_head = kp_present.queue_tail = 0;
+        kp_present.busy = false;
+        pthread_mutex_init(&kp_present.mutex, 0);
+        pthread_cond_init(&kp_present.queued, 0);
+        pthread_cond_init(&kp_present.freed, 0);
+        // Started before the frame buffer goes, so on failure everything carries on as it was
+        if(pthread_create(&kp_present.thread, 0, KPPresentThread, 0) != 0) {
+            pthread_mutex_destroy(&kp_present.mutex);
+            pthread_cond_destroy(&kp_present.queued);
+            pthread_cond_destroy(&kp_present.freed);
+            for(int i = 0; i < KP_PRESENT_BUFFERS; ++i) {
+                KPDestroyImage(kp_present.display, &kp_present.buffers[i].image);
+                kp_present.buffers[i].pixels = 0;
+            }
+            XCloseDisplay(kp_present.display);
+            kp_present.display = 0;
+            return false;
+        }
+        KPDestroyFrameBuffer();
+        kp_present.last_flip = KPMonotonicNow();
+        kp_frame_buffer.pixels = kp_present.buffers[0].pixels;
+        kp_present.running = true;
+        return true;
+    }
+    
+    // KPSetWindowTitle on Linux is very slow and inconsistent. Don't call every frame.
+    void KPSetWindowTitle(const char* const title) {
+        if(kp_headless) return;
+        XStoreName(display, xwindow, title);
     }
     
     void KPInit(const unsigned int width, const unsigned int height, const char* const title) {
+        KPROF_THREAD_NAME("main");
         kp_windowed_width = width;
         kp_windowed_height = height;
         kp_window.w = width;
         kp_window.h = height;
-        display = XOpenDisplay(0);
+        kp_queued_width = width;
+        kp_queued_height = height;
+        bool want_headless = getenv("KP_HEADLESS") != 0;
+        if(!want_headless) {
+            // Before any other Xlib call, KPStartPresentThread uses Xlib from a second thread
+            XInitThreads();
+        }
+        display = want_headless ? 0 : XOpenDisplay(0);
+        if(!display) {
+            if(!want_headless) {
+                fprintf(stderr, "kero_platform: can't open a display, running headless\n");
+            }
+            KPHeadlessInit(width, height);
+            KPStartFromEnvironment();
+            return;
+        }
         root_window = XDefaultRootWindow(display);
         screen = XDefaultScreen(display);
         XMatchVisualInfo(display, screen, 24, TrueColor, &visual_info);
         window_attributes.background_pixel = 0;
         window_attributes.colormap = XCreateColormap(display, root_window, visual_info.visual, AllocNone);
-        window_attributes.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask | FocusChangeMask | ButtonPressMask | ButtonReleaseMask;
+        window_attributes.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask | FocusChangeMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask;
         xwindow = XCreateWindow(display, root_window, 0, 0, kp_window.w, kp_window.h, 0, visual_info.depth, 0, visual_info.visual, CWBackPixel | CWColormap | CWEventMask, &window_attributes);
         XMapWindow(display, xwindow);
         XFlush(display);
@@ -301,14 +1170,15 @@ Key repeats (holding key down) are ignored automatically.
         XSetWMProtocols(display, xwindow, &WM_DELETE_WINDOW, 1);
         XkbSetDetectableAutoRepeat(display, True, 0);
         KPSetWindowTitle(title);
-        kp_frame_buffer.pixels = (uint32_t*)malloc(sizeof(uint32_t)*kp_window.w*kp_window.h);
-        kp_frame_buffer.w = kp_window.w;
-        kp_frame_buffer.h = kp_window.h;
-        ximage = XCreateImage(display, visual_info.visual, visual_info.depth, ZPixmap, 0, (char*)kp_frame_buffer.pixels, kp_window.w, kp_window.h, 32, 0);
+        shm_completion_type = XShmGetEventBase(display) + ShmCompletion;
+        KPCreateFrameBuffer();
         graphics_context = DefaultGC(display, screen);
         KPSetTargetFramerate(60);
         _NET_WM_STATE_ATOM = XInternAtom(display, "_NET_WM_STATE", False);
-        clock_gettime(CLOCK_REALTIME, &frame_start);
+        // Only to know where the mouse starts, after this MotionNotify keeps kp_mouse up to date
+        KPUpdateMouse();
+        frame_start = KPMonotonicNow();
+        KPStartFromEnvironment();
     }
     
 #ifdef KERO_PLATFORM_GL
@@ -322,12 +1192,14 @@ Key repeats (holding key down) are ignored automatically.
         kp_windowed_height = height;
         kp_window.w = width;
         kp_window.h = height;
+        kp_queued_width = width;
+        kp_queued_height = height;
         display = XOpenDisplay(0);
         root_window = XDefaultRootWindow(display);
         screen = XDefaultScreen(display);
         visual_info = *glXChooseVisual(display, 0, gl_attributes);
         window_attributes.colormap = XCreateColormap(display, root_window, visual_info.visual, AllocNone);
-        window_attributes.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask | FocusChangeMask | ButtonPressMask | ButtonReleaseMask;
+        window_attributes.event_mask = StructureNotifyMask | KeyPressMask | KeyReleaseMask | FocusChangeMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask;
         xwindow = XCreateWindow(display, root_window, 0, 0, kp_window.w, kp_window.h, 0, visual_info.depth, 0, visual_info.visual, CWColormap | CWEventMask, &window_attributes);
         XMapWindow(display, xwindow);
         XFlush(display);
@@ -339,7 +1211,7 @@ Key repeats (holding key down) are ignored automatically.
         glXMakeCurrent(display, xwindow, gl_context);
         //KPGLSetTargetFramerate(60);
         _NET_WM_STATE_ATOM = XInternAtom(display, "_NET_WM_STATE", False);
-        clock_gettime(CLOCK_REALTIME, &frame_start);
+        frame_start = KPMonotonicNow();
     }
     
     void KPGLFlip() {
@@ -347,28 +1219,60 @@ Key repeats (holding key down) are ignored automatically.
     }
 #endif // KERO_PLATFORM_GL
     
-    void KPSleep(unsigned long nanoseconds) {
-        timespec sleep_time = { 0, nanoseconds };
-        nanosleep(&sleep_time, 0);
+    void KPFlip() {
+        KPROF_FUNCTION();
+        if(kp_headless) {
+            KPHeadlessFlip();
+            return;
+        }
+        if(kp_present.running) {
+            KPPresentFlip(0, -1);
+            return;
+        }
+        KPROF_BEGIN("XPutImage");
+        int64_t put_start = KPMonotonicNow();
+        KPPutImage(display, graphics_context, &kp_image, 0, 0, kp_window.w, kp_window.h, true);
+        XFlush(display);
+        int64_t put_time = KPMonotonicNow() - put_start;
+        KPROF_END();
+        // The server copies the image while we wait for the frame time
+        KPHandOffFrame();
+        KPFinishFrame();
+        KPWaitForPut(display, &kp_image);
+        kp_frame_times.present = put_time + KPMonotonicNow() - frame_start;
     }
     
-    void KPFlip() {
-        XPutImage(display, xwindow, graphics_context, ximage, 0, 0, 0, 0, kp_window.w, kp_window.h);
-        if(target_frame_time) {
-            // Delay until we take up the full frame time
-            clock_gettime(CLOCK_REALTIME, &frame_finish);
-            long unsigned frame_time = (frame_finish.tv_sec - frame_start.tv_sec)*1000000000 + (frame_finish.tv_nsec - frame_start.tv_nsec);
-            timespec sleep_time;
-            sleep_time.tv_sec = 0;
-            sleep_time.tv_nsec = target_frame_time - frame_time;
-            nanosleep(&sleep_time, 0);
-        }
-        clock_gettime(CLOCK_REALTIME, &frame_finish);
-        kp_delta = (frame_finish.tv_sec - frame_start.tv_sec) +(frame_finish.tv_nsec - frame_start.tv_nsec)/1000000000.f;
-        frame_start = frame_finish;
+    void KPFlipRects(kp_rect_t* rects, int count) {
+        KPROF_FUNCTION();
+        count = KPMergeRects(rects, count);
+        if(kp_headless) {
+            KPHeadlessFlip();
+            return;
+        }
+        if(kp_present.running) {
+            KPPresentFlip(rects, count);
+            return;
+        }
+        KPROF_BEGIN("XPutImage");
+        int64_t put_start = KPMonotonicNow();
+        for(int i = 0; i < count; ++i) {
+            KPPutImage(display, graphics_context, &kp_image, rects[i].x, rects[i].y, rects[i].w, rects[i].h, i == count-1);
+        }
+        if(count) {
+            XFlush(display);
+        }
+        int64_t put_time = KPMonotonicNow() - put_start;
+        KPROF_END();
+        KPHandOffFrame();
+        KPFinishFrame();
+        if(count) {
+            KPWaitForPut(display, &kp_image);
+        }
+        kp_frame_times.present = put_time + KPMonotonicNow() - frame_start;
     }
     
     void KPUpdateMouse() {
+        if(kp_headless) return;
         Window window_returned;
         int display_x, display_y;
         unsigned int mask_return;
@@ -378,17 +1282,34 @@ Key repeats (holding key down) are ignored automatically.
         }
     }
     
-    int KPEventsQueued() {
-        KPUpdateMouse();
-        return XEventsQueued(display, QueuedAfterFlush);
+    static void KPApplyResize(int width, int height) {
+        KPROF_FUNCTION();
+        if(!kp_fullscreen) {
+            kp_windowed_width = width;
+            kp_windowed_height = height;
+        }
+        kp_window.w = width;
+        kp_window.h = height;
+        if(kp_headless) {
+            KPHeadlessResize(width, height);
+            return;
+        }
+        if(kp_present.running) {
+            KPPresentResize();
+            return;
+        }
+        KPCreateFrameBuffer();
     }
     
-    kp_event_t* KPNextEvent() {
-        kp_event_t* event = (kp_event_t*)malloc(sizeof(kp_event_t));
+    // Returns false for events that don't go in the queue
+    static bool KPTranslateEvent(XEvent* x_event, kp_event_t* event) {
+        XEvent e = *x_event;
         event->type = KPEVENT_NONE;
-        XEvent e;
-        XNextEvent(display, &e);
         switch(e.type) {
+            case MotionNotify:{
+                kp_mouse.x = e.xmotion.x;
+                kp_mouse.y = e.xmotion.y;
+            }break;
             case KeyPress:{
                 event->type = KPEVENT_KEY_PRESS;
                 uint8_t symbol = (uint8_t)XLookupKeysym(&e.xkey, 0);
@@ -403,8 +1324,8 @@ Key repeats (holding key down) are ignored automatically.
             }break;
             case ButtonPress:{
                 event->type = KPEVENT_MOUSE_BUTTON_PRESS;
-                event->x = e.xbutton.x;
-                event->y = e.xbutton.y;
+                event->x = kp_mouse.x = e.xbutton.x;
+                event->y = kp_mouse.y = e.xbutton.y;
                 event->button = MOUSE_OTHER;
                 switch(e.xbutton.button) {
                     case Button1:{
@@ -419,8 +1340,8 @@ Key repeats (holding key down) are ignored automatically.
             }break;
             case ButtonRelease:{
                 event->type = KPEVENT_MOUSE_BUTTON_RELEASE;
-                event->x = e.xbutton.x;
-                event->y = e.xbutton.y;
+                event->x = kp_mouse.x = e.xbutton.x;
+                event->y = kp_mouse.y = e.xbutton.y;
                 event->button = MOUSE_OTHER;
                 switch(e.xbutton.button) {
                     case Button1:{
@@ -441,21 +1362,12 @@ Key repeats (holding key down) are ignored automatically.
             }break;
             case ConfigureNotify:{
                 XConfigureEvent* ev = (XConfigureEvent*)&e;
-                if(ev->width != kp_window.w || ev->height != kp_window.h) {
+                if(ev->width != kp_queued_width || ev->height != kp_queued_height) {
                     event->type = KPEVENT_RESIZE;
-                    if(!kp_fullscreen) {
-                        kp_windowed_width = ev->width;
-                        kp_windowed_height = ev->height;
-                    }
-                    kp_window.w = ev->width;
-                    kp_window.h = ev->height;
-                    event->width = kp_window.w;
-                    event->height = kp_window.h;
-                    XDestroyImage(ximage);
-                    kp_frame_buffer.pixels = (uint32_t*)malloc(sizeof(uint32_t)*kp_window.w*kp_window.h);
-                    kp_frame_buffer.w = kp_window.w;
-                    kp_frame_buffer.h = kp_window.h;
-                    ximage = XCreateImage(display, visual_info.visual, visual_info.depth, ZPixmap, 0, (char*)kp_frame_buffer.pixels, kp_window.w, kp_window.h, 32, 0);
+                    kp_queued_width = ev->width;
+                    kp_queued_height = ev->height;
+                    event->width = ev->width;
+                    event->height = ev->height;
                 }
             }break;
             case DestroyNotify:{
@@ -472,14 +1384,47 @@ Key repeats (holding key down) are ignored automatically.
                 event->type = KPEVENT_FOCUS_IN;
             }break;
         }
-        return event;
+        return event->type != KPEVENT_NONE;
     }
     
-    void KPFreeEvent(kp_event_t* e) {
-        free(e);
+    static void KPPumpEvents() {
+        KPPumpScript();
+        if(kp_headless) return;
+        // QueuedAfterFlush reads whatever has arrived without waiting on the server. Whatever doesn't fit stays in Xlib's queue for next time.
+        int pending = XEventsQueued(display, QueuedAfterFlush);
+        while(pending-- > 0 && KPQueueCount() < KP_EVENT_QUEUE_SIZE) {
+            XEvent e;
+            XNextEvent(display, &e);
+            if(KPTranslateEvent(&e, KPQueueSlot(kp_event_tail))) {
+                KPQueueCommit();
+            }
+        }
+    }
+    
+    int KPEventsQueued() {
+        KPPumpEvents();
+        return KPQueueCount();
+    }
+    
+    kp_event_t* KPNextEvent() {
+        KPROF_FUNCTION();
+        if(kp_headless) return KPPollEvent();
+        KPPumpScript();
+        if(kp_event_head == kp_event_tail) {
+            // Block for the next X event, like KPNextEvent always has
+            XEvent e;
+            XNextEvent(display, &e);
+            if(!KPTranslateEvent(&e, KPQueueSlot(kp_event_tail))) {
+                kp_event_none.type = KPEVENT_NONE;
+                return &kp_event_none;
+            }
+            KPQueueCommit();
+        }
+        return KPQueuePop();
     }
     
     void KPShowCursor(const bool show) {
+        if(kp_headless) return;
         if(show) {
             XUndefineCursor(display, xwindow);
         }
@@ -494,21 +1439,21 @@ Key repeats (holding key down) are ignored automatically.
         }
     }
     
-    double KPClock() {
-        timespec clock_time;
-        clock_gettime(CLOCK_REALTIME, &clock_time);
-        return clock_time.tv_sec*1000.0 + clock_time.tv_nsec/1000000.0;
-    }
-    
     void KPSetCursorPos(int x, int y, int* dx, int* dy) {
         if(dx) *dx = x - kp_mouse.x;
         if(dy) *dy = y - kp_mouse.y;
+        if(kp_headless) {
+            kp_mouse.x = x;
+            kp_mouse.y = y;
+            return;
+        }
         XWarpPointer(display, xwindow, xwindow, 0, 0, 0, 0, x, y);
         XFlush(display);
     }
     
     void KPFullscreen(bool full) {
         kp_fullscreen = full;
+        if(kp_headless) return;
         XEvent xev = {0};
         xev.type = ClientMessage;
         xev.xclient.window = xwindow;
@@ -614,6 +1559,7 @@ Key repeats (holding key down) are ignored automatically.
     }
     
     void KPInit(const unsigned int width, const unsigned int height, const char* const title) {
+        KPROF_THREAD_NAME("main");
         SDL_Init(SDL_INIT_VIDEO);
         kp_windowed_width = width;
         kp_windowed_height = height;
@@ -626,129 +1572,193 @@ Key repeats (holding key down) are ignored automatically.
         kp_frame_buffer.pixels = (uint32_t*)canvas->pixels;
         kp_keyboard = SDL_GetKeyboardState(NULL);
         KPSetTargetFramerate(60);
+        KPUpdateMouse();
         frame_start = SDL_GetTicks();
+        KPStartFromEnvironment();
     }
     
     void KPSleep(unsigned long nanoseconds) {
         SDL_Delay(nanoseconds / 1000000);
     }
     
-    void KPFlip() {
-        SDL_UpdateWindowSurface(sdlwindow);
+    // For kp_frame_times, the frame limit itself is only kept to the millisecond
+    static inline int64_t KPMonotonicNow() {
+        static uint64_t frequency = 0;
+        if(!frequency) frequency = SDL_GetPerformanceFrequency();
+        uint64_t ticks = SDL_GetPerformanceCounter();
+        return (int64_t)(ticks/frequency*1000000000 + ticks%frequency*1000000000/frequency);
+    }
+    
+    static void KPFinishFrame() {
+        kp_frame_times.sleep_error = 0;
         if(target_frame_time) {
             // Delay until we take up the full frame time
             frame_finish = SDL_GetTicks();
             int32_t sleep_time = target_frame_time - (frame_finish - frame_start);
-            sleep_time = sleep_time > 0 ? sleep_time : 0;
-            SDL_Delay(sleep_time);
+            if(sleep_time > 0) {
+                SDL_Delay(sleep_time);
+                kp_frame_times.sleep_error = ((int64_t)(SDL_GetTicks() - frame_finish) - sleep_time)*1000000;
+            }
         }
         frame_finish = SDL_GetTicks();
         kp_delta = (frame_finish - frame_start) / 1000.f;
+        kp_frame_times.frame = (int64_t)(frame_finish - frame_start)*1000000;
         frame_start = frame_finish;
     }
     
+    void KPFlip() {
+        KPROF_FUNCTION();
+        KPROF_BEGIN("SDL_UpdateWindowSurface");
+        int64_t put_start = KPMonotonicNow();
+        SDL_UpdateWindowSurface(sdlwindow);
+        kp_frame_times.present = KPMonotonicNow() - put_start;
+        KPROF_END();
+        KPHandOffFrame();
+        KPFinishFrame();
+    }
+    
+    void KPFlipRects(kp_rect_t* rects, int count) {
+        KPROF_FUNCTION();
+        count = KPMergeRects(rects, count);
+        int64_t put_start = KPMonotonicNow();
+        if(count) {
+            KPROF_ZONE("SDL_UpdateWindowSurfaceRects");
+            SDL_UpdateWindowSurfaceRects(sdlwindow, (SDL_Rect*)rects, count);
+        }
+        kp_frame_times.present = KPMonotonicNow() - put_start;
+        KPHandOffFrame();
+        KPFinishFrame();
+    }
+    
     void KPUpdateMouse() {
         kp_mouse.buttons = SDL_GetMouseState(&kp_mouse.x, &kp_mouse.y);
     }
     
-    int KPEventsQueued() {
-        KPUpdateMouse();
-        return SDL_PollEvent(0);
+    static void KPApplyResize(int width, int height) {
+        KPROF_FUNCTION();
+        if(!kp_fullscreen) {
+            kp_windowed_width = width;
+            kp_windowed_height = height;
+        }
+        kp_window.w = width;
+        kp_window.h = height;
+        SDL_FreeSurface(canvas);
+        canvas = SDL_GetWindowSurface(sdlwindow);
+        kp_frame_buffer.pixels = canvas->pixels;
+        kp_frame_buffer.w = kp_window.w;
+        kp_frame_buffer.h = kp_window.h;
     }
     
-    kp_event_t* KPNextEvent() {
-        kp_event_t* event = (kp_event_t*)malloc(sizeof(kp_event_t));
+    // Returns false for events that don't go in the queue
+    static bool KPTranslateEvent(SDL_Event* sdl_event, kp_event_t* event) {
+        SDL_Event e = *sdl_event;
         event->type = KPEVENT_NONE;
-        SDL_Event e;
-        if(SDL_PollEvent(&e)) {
-            switch(e.type) {
-                case SDL_KEYDOWN:{
-                    event->type = KPEVENT_KEY_PRESS;
+        switch(e.type) {
+            case SDL_MOUSEMOTION:{
+                kp_mouse.x = e.motion.x;
+                kp_mouse.y = e.motion.y;
+            }break;
+            case SDL_KEYDOWN:{
+                event->type = KPEVENT_KEY_PRESS;
+                int unsigned symbol = SDL_GetScancodeFromKey(e.key.keysym.sym);
+                event->key = symbol;
+            }break;
+            case SDL_KEYUP:{
+                if(!e.key.repeat) {
+                    event->type = KPEVENT_KEY_RELEASE;
                     int unsigned symbol = SDL_GetScancodeFromKey(e.key.keysym.sym);
                     event->key = symbol;
-                }break;
-                case SDL_KEYUP:{
-                    if(!e.key.repeat) {
-                        event->type = KPEVENT_KEY_RELEASE;
-                        int unsigned symbol = SDL_GetScancodeFromKey(e.key.keysym.sym);
-                        event->key = symbol;
-                    }
-                }break;
-                case SDL_MOUSEBUTTONDOWN:{
-                    event->type = KPEVENT_MOUSE_BUTTON_PRESS;
-                    event->x = e.button.x;
-                    event->y = e.button.y;
-                    event->button = MOUSE_OTHER;
-                    switch(e.button.button) {
-                        case SDL_BUTTON_LEFT:{
-                            event->button = MOUSE_LEFT;
-                            kp_mouse.buttons |= MOUSE_LEFT;
-                        }break;
-                        case SDL_BUTTON_RIGHT:{
-                            event->button = MOUSE_RIGHT;
-                            kp_mouse.buttons |= MOUSE_RIGHT;
-                        }break;
-                    }
-                }break;
-                case SDL_MOUSEBUTTONUP:{
-                    event->type = KPEVENT_MOUSE_BUTTON_RELEASE;
-                    event->x = e.button.x;
-                    event->y = e.button.y;
-                    event->button = MOUSE_OTHER;
-                    switch(e.button.button) {
-                        case SDL_BUTTON_LEFT:{
-                            event->button = MOUSE_LEFT;
-                            kp_mouse.buttons &= ~MOUSE_LEFT;
-                        }break;
-                        case SDL_BUTTON_RIGHT:{
-                            event->button = MOUSE_RIGHT;
-                            kp_mouse.buttons &= ~MOUSE_RIGHT;
-                        }break;
-                    }
-                }break;
-                case SDL_QUIT:{
-                    event->type = KPEVENT_QUIT;
-                }break;
-                case SDL_WINDOWEVENT:{
-                    switch(e.window.event) {
-                        case SDL_WINDOWEVENT_SIZE_CHANGED:{
-                            event->type = KPEVENT_RESIZE;
-                            if(!kp_fullscreen) {
-                                kp_windowed_width = e.window.data1;
-                                kp_windowed_height = e.window.data2;
-                            }
-                            kp_window.w = e.window.data1;
-                            kp_window.h = e.window.data2;
-                            event->width = kp_window.w;
-                            event->height = kp_window.h;
-                            SDL_FreeSurface(canvas);
-                            canvas = SDL_GetWindowSurface(sdlwindow);
-                            kp_frame_buffer.pixels = canvas->pixels;
-                            kp_frame_buffer.w = kp_window.w;
-                            kp_frame_buffer.h = kp_window.h;
-                        }break;
-                        case SDL_WINDOWEVENT_FOCUS_LOST:{
-                            event->type = KPEVENT_FOCUS_OUT;
-                        }break;
-                        case SDL_WINDOWEVENT_FOCUS_GAINED:{
-                            event->type = KPEVENT_FOCUS_IN;
-                        }break;
-                    }
-                }break;
-            }
+                }
+            }break;
+            case SDL_MOUSEBUTTONDOWN:{
+                event->type = KPEVENT_MOUSE_BUTTON_PRESS;
+                event->x = kp_mouse.x = e.button.x;
+                event->y = kp_mouse.y = e.button.y;
+                event->button = MOUSE_OTHER;
+                switch(e.button.button) {
+                    case SDL_BUTTON_LEFT:{
+                        event->button = MOUSE_LEFT;
+                        kp_mouse.buttons |= MOUSE_LEFT;
+                    }break;
+                    case SDL_BUTTON_RIGHT:{
+                        event->button = MOUSE_RIGHT;
+                        kp_mouse.buttons |= MOUSE_RIGHT;
+                    }break;
+                }
+            }break;
+            case SDL_MOUSEBUTTONUP:{
+                event->type = KPEVENT_MOUSE_BUTTON_RELEASE;
+                event->x = kp_mouse.x = e.button.x;
+                event->y = kp_mouse.y = e.button.y;
+                event->button = MOUSE_OTHER;
+                switch(e.button.button) {
+                    case SDL_BUTTON_LEFT:{
+                        event->button = MOUSE_LEFT;
+                        kp_mouse.buttons &= ~MOUSE_LEFT;
+                    }break;
+                    case SDL_BUTTON_RIGHT:{
+                        event->button = MOUSE_RIGHT;
+                        kp_mouse.buttons &= ~MOUSE_RIGHT;
+                    }break;
+                }
+            }break;
+            case SDL_QUIT:{
+                event->type = KPEVENT_QUIT;
+            }break;
+            case SDL_WINDOWEVENT:{
+                switch(e.window.event) {
+                    case SDL_WINDOWEVENT_SIZE_CHANGED:{
+                        event->type = KPEVENT_RESIZE;
+                        event->width = e.window.data1;
+                        event->height = e.window.data2;
+                    }break;
+                    case SDL_WINDOWEVENT_FOCUS_LOST:{
+                        event->type = KPEVENT_FOCUS_OUT;
+                    }break;
+                    case SDL_WINDOWEVENT_FOCUS_GAINED:{
+                        event->type = KPEVENT_FOCUS_IN;
+                    }break;
+                }
+            }break;
         }
         
-        return event;
+        return event->type != KPEVENT_NONE;
     }
     
-    void KPFreeEvent(kp_event_t* e) {
-        free(e);
+    static void KPPumpEvents() {
+        KPPumpScript();
+        SDL_Event e;
+        while(KPQueueCount() < KP_EVENT_QUEUE_SIZE && SDL_PollEvent(&e)) {
+            if(KPTranslateEvent(&e, KPQueueSlot(kp_event_tail))) {
+                KPQueueCommit();
+            }
+        }
+    }
+    
+    int KPEventsQueued() {
+        KPPumpEvents();
+        return KPQueueCount();
+    }
+    
+    kp_event_t* KPNextEvent() {
+        KPROF_FUNCTION();
+        KPPumpEvents();
+        if(kp_event_head == kp_event_tail) {
+            kp_event_none.type = KPEVENT_NONE;
+            return &kp_event_none;
+        }
+        return KPQueuePop();
     }
     
     void KPShowCursor(const bool show) {
         SDL_ShowCursor(show);
     }
     
+    // SDL wants the window surface updated from the thread that made the window
+    bool KPStartPresentThread() {
+        return false;
+    }
+    
     double KPClock() {
         return SDL_GetTicks();
     }
@@ -790,6 +1800,224 @@ Key repeats (holding key down) are ignored automatically.
     
     //------------------------------------------------------------
     
+    // Frame files and event scripts, every platform
+    
+#include <stdlib.h>
+#include <string.h>
+    
+    void KPWriteFrameFile(const uint32_t* pixels, int w, int h, uint64_t frame, void* user) {
+        char path[1024];
+        snprintf(path, sizeof(path), (const char*)user, (unsigned long long)frame);
+        FILE* file = fopen(path, "wb");
+        if(!file) return;
+        fprintf(file, "P6\n%d %d\n255\n", w, h);
+        uint8_t* row = (uint8_t*)malloc(w*3);
+        for(int y = 0; y < h; ++y) {
+            for(int x = 0; x < w; ++x) {
+                uint32_t pixel = pixels[y*w + x];
+                row[x*3] = (uint8_t)(pixel >> 16);
+                row[x*3 + 1] = (uint8_t)(pixel >> 8);
+                row[x*3 + 2] = (uint8_t)pixel;
+            }
+            fwrite(row, 3, w, file);
+        }
+        free(row);
+        fclose(file);
+    }
+    
+    typedef struct {
+        uint64_t frame; // Queued once this many frames have been flipped
+        kp_event_t event; // KPEVENT_NONE is a mouse move, which only updates kp_mouse
+        int x, y;
+    } kp_script_step_t;
+    static kp_script_step_t* kp_script = 0;
+    static int kp_script_length = 0, kp_script_next = 0;
+    
+    static const struct {
+        const char* name;
+        uint8_t key;
+    } kp_key_names[] = {
+        {"up", KEY_UP}, {"down", KEY_DOWN}, {"left", KEY_LEFT}, {"right", KEY_RIGHT},
+        {"space", KEY_SPACE}, {"return", KEY_RETURN}, {"enter", KEY_ENTER}, {"escape", KEY_ESCAPE},
+        {"lshift", KEY_LSHIFT}, {"rshift", KEY_RSHIFT}, {"lalt", KEY_LALT}, {"ralt", KEY_RALT},
+        {"equal", KEY_EQUAL}, {"minus", KEY_MINUS},
+        {"q", KEY_Q}, {"w", KEY_W}, {"e", KEY_E}, {"r", KEY_R}, {"t", KEY_T}, {"y", KEY_Y}, {"u", KEY_U}, {"i", KEY_I}, {"o", KEY_O}, {"p", KEY_P},
+        {"a", KEY_A}, {"s", KEY_S}, {"d", KEY_D}, {"f", KEY_F}, {"g", KEY_G}, {"h", KEY_H}, {"j", KEY_J}, {"k", KEY_K}, {"l", KEY_L},
+        {"z", KEY_Z}, {"x", KEY_X}, {"c", KEY_C}, {"v", KEY_V}, {"b", KEY_B}, {"n", KEY_N}, {"m", KEY_M},
+        {"0", KEY_0}, {"1", KEY_1}, {"2", KEY_2}, {"3", KEY_3}, {"4", KEY_4}, {"5", KEY_5}, {"6", KEY_6}, {"7", KEY_7}, {"8", KEY_8}, {"9", KEY_9},
+    };
+    
+    static bool KPKeyFromName(const char* name, uint8_t* key) {
+        for(int i = 0; i < (int)(sizeof(kp_key_names)/sizeof(kp_key_names[0])); ++i) {
+            if(!strcmp(kp_key_names[i].name, name)) {
+                *key = kp_key_names[i].key;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static bool KPButtonFromName(const char* name, uint8_t* button) {
+        if(!strcmp(name, "left")) *button = MOUSE_LEFT;
+        else if(!strcmp(name, "right")) *button = MOUSE_RIGHT;
+        else if(!strcmp(name, "other")) *button = MOUSE_OTHER;
+        else return false;
+        return true;
+    }
+    
+    // Returns false if the line isn't a step
+    static bool KPReadScriptStep(const char* line, kp_script_step_t* step) {
+        unsigned long long frame;
+        char name[32], arg[32];
+        int length;
+        int x, y;
+        if(sscanf(line, "%llu %31s%n", &frame, name, &length) < 2) return false;
+        const char* rest = line + length;
+        memset(step, 0, sizeof(*step));
+        step->frame = frame;
+        if(!strcmp(name, "key_press") || !strcmp(name, "key_release")) {
+            step->event.type = name[4] == 'p' ? KPEVENT_KEY_PRESS : KPEVENT_KEY_RELEASE;
+            return sscanf(rest, "%31s", arg) == 1 && KPKeyFromName(arg, &step->event.key);
+        }
+        if(!strcmp(name, "mouse_press") || !strcmp(name, "mouse_release")) {
+            step->event.type = name[6] == 'p' ? KPEVENT_MOUSE_BUTTON_PRESS : KPEVENT_MOUSE_BUTTON_RELEASE;
+            if(sscanf(rest, "%31s %d %d", arg, &x, &y) != 3 || x < 0 || y < 0) return false;
+            step->event.x = x;
+            step->event.y = y;
+            return KPButtonFromName(arg, &step->event.button);
+        }
+        if(!strcmp(name, "mouse_move")) {
+            step->event.type = KPEVENT_NONE;
+            return sscanf(rest, "%d %d", &step->x, &step->y) == 2;
+        }
+        if(!strcmp(name, "resize")) {
+            step->event.type = KPEVENT_RESIZE;
+            if(sscanf(rest, "%d %d", &x, &y) != 2 || x <= 0 || y <= 0) return false;
+            step->event.width = x;
+            step->event.height = y;
+            return true;
+        }
+        if(!strcmp(name, "focus_in")) step->event.type = KPEVENT_FOCUS_IN;
+        else if(!strcmp(name, "focus_out")) step->event.type = KPEVENT_FOCUS_OUT;
+        else if(!strcmp(name, "quit")) step->event.type = KPEVENT_QUIT;
+        else return false;
+        return true;
+    }
+    
+    bool KPSetEventScript(const char* const script) {
+        free(kp_script);
+        kp_script = 0;
+        kp_script_length = 0;
+        kp_script_next = 0;
+        int capacity = 0;
+        const char* line = script;
+        for(int line_number = 1; *line; ++line_number) {
+            const char* end = strchr(line, '\n');
+            if(!end) end = line + strlen(line);
+            char text[256];
+            int length = end - line < (int)sizeof(text)-1 ? (int)(end - line) : (int)sizeof(text)-1;
+            memcpy(text, line, length);
+            text[length] = 0;
+            line = *end ? end+1 : end;
+            char* comment = strchr(text, '#');
+            if(comment) *comment = 0;
+            if(strspn(text, " \t\r") == strlen(text)) continue;
+            kp_script_step_t step;
+            if(!KPReadScriptStep(text, &step)) {
+                fprintf(stderr, "kero_platform: can't read line %d of the event script: %s\n", line_number, text);
+                return false;
+            }
+            if(kp_script_length == capacity) {
+                capacity = capacity ? capacity*2 : 64;
+                kp_script = (kp_script_step_t*)realloc(kp_script, capacity*sizeof(kp_script_step_t));
+            }
+            // Kept in frame order, steps on the same frame stay in the order they were written
+            int at = kp_script_length++;
+            while(at > 0 && kp_script[at-1].frame > step.frame) {
+                kp_script[at] = kp_script[at-1];
+                --at;
+            }
+            kp_script[at] = step;
+        }
+        return true;
+    }
+    
+    bool KPLoadEventScript(const char* const path) {
+        FILE* file = fopen(path, "rb");
+        if(!file) {
+            fprintf(stderr, "kero_platform: can't open event script %s\n", path);
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        char* script = (char*)malloc(size+1);
+        size = (long)fread(script, 1, size, file);
+        script[size] = 0;
+        fclose(file);
+        bool loaded = KPSetEventScript(script);
+        free(script);
+        return loaded;
+    }
+    
+    // Queues the steps that are due, updating the keyboard and mouse the way real events do
+    static void KPPumpScript() {
+        while(kp_script_next < kp_script_length && kp_script[kp_script_next].frame <= kp_frame_number && KPQueueCount() < KP_EVENT_QUEUE_SIZE) {
+            kp_script_step_t* step = &kp_script[kp_script_next++];
+            kp_event_t event = step->event;
+            switch(event.type) {
+                case KPEVENT_NONE:{
+                    kp_mouse.x = step->x;
+                    kp_mouse.y = step->y;
+                }break;
+                case KPEVENT_MOUSE_BUTTON_PRESS:{
+                    kp_mouse.x = event.x;
+                    kp_mouse.y = event.y;
+                    kp_mouse.buttons |= event.button;
+                }break;
+                case KPEVENT_MOUSE_BUTTON_RELEASE:{
+                    kp_mouse.x = event.x;
+                    kp_mouse.y = event.y;
+                    kp_mouse.buttons &= ~event.button;
+                }break;
+#if defined(__linux__) || defined(KERO_PLATFORM_HEADLESS)
+                // SDL owns its keyboard state
+                case KPEVENT_KEY_PRESS:{
+                    kp_keyboard[event.key] = true;
+                }break;
+                case KPEVENT_KEY_RELEASE:{
+                    kp_keyboard[event.key] = false;
+                }break;
+                case KPEVENT_FOCUS_OUT:{
+                    if(kp_reset_keyboard_on_focus_out) {
+                        memset(kp_keyboard, false, sizeof(kp_keyboard));
+                    }
+                    kp_mouse.buttons = 0;
+                }break;
+#endif
+                default: break;
+            }
+            if(event.type != KPEVENT_NONE) {
+                *KPQueueSlot(kp_event_tail) = event;
+                KPQueueCommit();
+            }
+        }
+    }
+    
+    // Lets a program be recorded or driven from outside without changing it
+    static void KPStartFromEnvironment() {
+        const char* frame_files = getenv("KP_FRAME_FILES");
+        if(frame_files) {
+            KPSetFrameCallback(KPWriteFrameFile, (void*)frame_files);
+        }
+        const char* script = getenv("KP_EVENT_SCRIPT");
+        if(script) {
+            KPLoadEventScript(script);
+        }
+    }
+    
+    //------------------------------------------------------------
+    
 #ifdef __cplusplus
 }
 #endif
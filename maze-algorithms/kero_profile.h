@@ -0,0 +1,232 @@
+/*
+Kero Profile times scoped zones of code and writes them out as a Chrome trace (chrome://tracing, Perfetto or speedscope will open it), so a run can be read frame by frame: where the time went between drawing, generating, sending the frame and sleeping.
+
+It's compiled out unless KERO_PROFILE is defined (add -DKERO_PROFILE to the gcc line). Without it every macro below is empty and none of the code exists. kero_platform, kero_sprite, maze.h and maze_render.h already have zones in their hot functions.
+
+Each thread writes its zones into its own ring of KPROF_RING_SIZE events, so recording never takes a lock. When a ring fills, the oldest zones are overwritten. Zones are recorded when they end.
+
+Zones need GCC or Clang (they use the cleanup attribute). With other compilers KPROF_ZONE and KPROF_FUNCTION are empty, but KPROF_BEGIN/KPROF_END still work.
+*/
+
+#ifndef KERO_PROFILE_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+    /*
+     Usage
+
+    KPROF_FUNCTION();           Times the rest of the function, named after it
+    KPROF_ZONE("name");         Times the rest of the enclosing block. name must be a string that outlives the program, like a literal
+    KPROF_BEGIN("name");        Same as KPROF_ZONE but ended by hand, for code that isn't one block
+    KPROF_END();
+    KPROF_THREAD_NAME("name");  Names the calling thread in the trace
+
+    Set KERO_TRACE=trace.json in the environment to have the trace written at exit, or call KProfWriteTrace(path) yourself.
+    Writing the trace while other threads are still recording may catch a zone half written, which only affects that zone.
+    */
+
+#ifdef KERO_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+    // 1.5MB per thread that records anything
+#ifndef KPROF_RING_SIZE
+#define KPROF_RING_SIZE 65536 // Must be a power of 2
+#endif
+#define KPROF_MAX_DEPTH 64 // Of KPROF_BEGIN zones waiting for their KPROF_END
+
+    typedef struct {
+        const char* name;
+        uint64_t start, duration; // Nanoseconds
+    } kprof_event_t;
+
+    typedef struct {
+        const char* name;
+        uint64_t start;
+    } kprof_zone_t;
+
+    typedef struct kprof_thread_t {
+        kprof_event_t events[KPROF_RING_SIZE];
+        uint64_t count; // Events ever written, only this thread changes it
+        int id;
+        const char* name;
+        kprof_zone_t open[KPROF_MAX_DEPTH];
+        int depth;
+        struct kprof_thread_t* next;
+    } kprof_thread_t;
+
+#if defined(_MSC_VER)
+#define KPROF_THREAD_LOCAL __declspec(thread)
+#else
+#define KPROF_THREAD_LOCAL __thread
+#endif
+
+#if defined(__GNUC__)
+#define KProfAtomicLoad(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define KProfAtomicStore(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define KProfAtomicPush(head, node) do { (node)->next = __atomic_load_n((head), __ATOMIC_RELAXED); } while(!__atomic_compare_exchange_n((head), &(node)->next, (node), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+#define KProfAtomicIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#else
+    // MSVC on x86, where plain volatile loads and stores are already ordered enough for one writer
+#include <intrin.h>
+#define KProfAtomicLoad(p) (*(volatile uint64_t*)(p))
+#define KProfAtomicStore(p, v) (*(volatile uint64_t*)(p) = (v))
+#define KProfAtomicPush(head, node) do { (node)->next = *(head); } while(_InterlockedCompareExchangePointer((void* volatile*)(head), (node), (node)->next) != (node)->next)
+#define KProfAtomicIncrement(p) _InterlockedIncrement((volatile long*)(p))
+#endif
+
+#if defined(__linux__) || defined(KERO_PLATFORM_HEADLESS)
+#include <time.h>
+    static inline uint64_t KProfNow() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    }
+#else
+#include <SDL2/SDL.h>
+    static inline uint64_t KProfNow() {
+        static uint64_t frequency = 0;
+        if(!frequency) frequency = SDL_GetPerformanceFrequency();
+        uint64_t ticks = SDL_GetPerformanceCounter();
+        return ticks/frequency*1000000000 + ticks%frequency*1000000000/frequency;
+    }
+#endif
+
+    static kprof_thread_t* kprof_threads = 0; // Every thread that has recorded, newest first
+    static volatile long kprof_num_threads = 0;
+    static uint64_t kprof_epoch = 0; // Trace timestamps count from here
+    static KPROF_THREAD_LOCAL kprof_thread_t* kprof_this_thread = 0;
+
+    bool KProfWriteTrace(const char* path);
+
+    static void KProfWriteTraceAtExit() {
+        KProfWriteTrace(getenv("KERO_TRACE"));
+    }
+
+    // The ring is made the first time a thread records, and is never freed so the trace can still be written after the thread ends
+    static kprof_thread_t* KProfThread() {
+        if(kprof_this_thread) return kprof_this_thread;
+        kprof_thread_t* thread = (kprof_thread_t*)calloc(1, sizeof(kprof_thread_t));
+        if(!thread) return 0;
+        thread->id = (int)KProfAtomicIncrement(&kprof_num_threads);
+        if(thread->id == 1) {
+            // The first thread to record starts the clock
+            kprof_epoch = KProfNow();
+            if(getenv("KERO_TRACE")) {
+                atexit(KProfWriteTraceAtExit);
+            }
+        }
+        KProfAtomicPush(&kprof_threads, thread);
+        kprof_this_thread = thread;
+        return thread;
+    }
+
+    static inline void KProfRecord(const char* name, uint64_t start, uint64_t end) {
+        kprof_thread_t* thread = KProfThread();
+        if(!thread) return;
+        kprof_event_t* event = &thread->events[thread->count & (KPROF_RING_SIZE-1)];
+        event->name = name;
+        event->start = start;
+        event->duration = end - start;
+        KProfAtomicStore(&thread->count, thread->count+1);
+    }
+
+    static inline kprof_zone_t KProfZoneBegin(const char* name) {
+        kprof_zone_t zone = { name, KProfNow() };
+        return zone;
+    }
+
+    static inline void KProfZoneEnd(kprof_zone_t* zone) {
+        KProfRecord(zone->name, zone->start, KProfNow());
+    }
+
+    static inline void KProfBegin(const char* name) {
+        kprof_thread_t* thread = KProfThread();
+        if(!thread) return;
+        if(thread->depth < KPROF_MAX_DEPTH) {
+            thread->open[thread->depth] = KProfZoneBegin(name);
+        }
+        ++thread->depth;
+    }
+
+    static inline void KProfEnd() {
+        kprof_thread_t* thread = KProfThread();
+        if(!thread || thread->depth <= 0) return;
+        if(--thread->depth < KPROF_MAX_DEPTH) {
+            KProfZoneEnd(&thread->open[thread->depth]);
+        }
+    }
+
+    static inline void KProfThreadName(const char* name) {
+        kprof_thread_t* thread = KProfThread();
+        if(thread) thread->name = name;
+    }
+
+    bool KProfWriteTrace(const char* path) {
+        if(!path) return false;
+        FILE* file = fopen(path, "w");
+        if(!file) {
+            fprintf(stderr, "kero_profile: can't write %s\n", path);
+            return false;
+        }
+        fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+        bool first = true;
+        for(kprof_thread_t* thread = (kprof_thread_t*)KProfAtomicLoad(&kprof_threads); thread; thread = thread->next) {
+            if(thread->name) {
+                fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", first ? "" : ",\n", thread->id, thread->name);
+                first = false;
+            }
+            uint64_t count = KProfAtomicLoad(&thread->count);
+            uint64_t oldest = count > KPROF_RING_SIZE ? count - KPROF_RING_SIZE : 0;
+            for(uint64_t i = oldest; i < count; ++i) {
+                const kprof_event_t* event = &thread->events[i & (KPROF_RING_SIZE-1)];
+                // Microseconds, which is what the trace format counts in
+                fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}", first ? "" : ",\n",
+                        event->name, thread->id, (int64_t)(event->start - kprof_epoch)/1000.0, event->duration/1000.0);
+                first = false;
+            }
+            if(count > KPROF_RING_SIZE) {
+                fprintf(stderr, "kero_profile: thread %d recorded %llu zones, only the last %d are in the trace\n", thread->id, (unsigned long long)count, KPROF_RING_SIZE);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return true;
+    }
+
+#define KPROF_CONCAT_(a, b) a##b
+#define KPROF_CONCAT(a, b) KPROF_CONCAT_(a, b)
+#if defined(__GNUC__)
+#define KPROF_ZONE(name) kprof_zone_t KPROF_CONCAT(kprof_zone_, __LINE__) __attribute__((cleanup(KProfZoneEnd))) = KProfZoneBegin(name)
+#define KPROF_FUNCTION() KPROF_ZONE(__func__)
+#else
+#define KPROF_ZONE(name)
+#define KPROF_FUNCTION()
+#endif
+#define KPROF_BEGIN(name) KProfBegin(name)
+#define KPROF_END() KProfEnd()
+#define KPROF_THREAD_NAME(name) KProfThreadName(name)
+
+#else // KERO_PROFILE
+
+#define KPROF_ZONE(name)
+#define KPROF_FUNCTION()
+#define KPROF_BEGIN(name)
+#define KPROF_END()
+#define KPROF_THREAD_NAME(name)
+
+#endif // KERO_PROFILE
+
+#ifdef __cplusplus
+}
+#endif
+
+#define KERO_PROFILE_H
+#endif
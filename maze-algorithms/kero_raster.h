@@ -0,0 +1,460 @@
+/*
+Kero Raster records kero_sprite draw calls into a command buffer instead of drawing them straight away. When the buffer is flushed the target is split into horizontal bands of KR_BAND_HEIGHT rows and a pool of worker threads draws the bands in parallel. Every band plays back the whole command list clipped to its own rows, so no two threads ever write the same pixel and no locks are needed while drawing.
+
+A band is small enough to stay in cache while every command that touches it is drawn, so overdraw (clear, background, panels, text...) costs cache bandwidth instead of memory bandwidth, on top of scaling with the number of cores.
+
+Include kero_sprite.h first. On Linux link against pthreads (-lpthread). On Windows/Mac the workers are SDL2 threads, same as Kero Platform.
+*/
+
+#ifndef KERO_RASTER_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "kero_profile.h"
+#include "kero_thread.h"
+
+    // 32 rows of a 4K target are 480KB, which fits in L2 on most CPUs
+#ifndef KR_BAND_HEIGHT
+#define KR_BAND_HEIGHT 32
+#endif
+
+    typedef enum {
+        KR_CLEAR, KR_RECT_FILLED, KR_RECT_FILLED_ALPHA, KR_BLIT, KR_BLIT_BLEND, KR_BLIT_ALPHA10, KR_LINE, KR_TRIANGLE
+    } kr_command_type_t;
+
+    typedef struct {
+        kr_command_type_t type;
+        int top, bottom; // Rows the command can touch, clipped to the target, so bands outside them skip it
+        uint32_t colour;
+        union {
+            struct { int x1, y1, x2, y2; } rect; // Rectangles and lines
+            struct { ksprite_t* sprite; int x, y; } blit;
+            struct { float x0, y0, x1, y1, x2, y2; } triangle;
+        };
+    } kr_command_t;
+
+    typedef struct {
+        ksprite_t* target;
+        kr_command_t* commands;
+        int num_commands, capacity;
+    } kr_buffer_t;
+
+    //------------------------------------------------------------
+
+    /*
+     Usage
+
+    Include this file after kero_sprite.h. On Linux link against pthreads (-lpthread).
+    */
+
+    bool KRInit(int num_threads);
+    /*
+    Starts the worker threads. num_threads includes the thread calling KRFlush. 0 uses one thread per CPU. A worker that fails to start just leaves its bands to the others. Returns false only if the pool can't be allocated.
+    KRFlush calls this with 0 if you haven't.
+    */
+
+    void KRShutdown();
+    /*
+    Stops the worker threads.
+    */
+
+    void KRBegin(kr_buffer_t* buffer, ksprite_t* target);
+    /*
+    Starts recording commands for target, dropping any that weren't flushed. buffer should start zeroed, it can be reused
+    every frame and only grows when a frame has more commands than any before it.
+    */
+
+    void KRClear(kr_buffer_t* buffer, uint32_t colour);
+    void KRDrawRectFilled(kr_buffer_t* buffer, int x1, int y1, int x2, int y2, uint32_t colour);
+    void KRDrawRectFilledAlpha(kr_buffer_t* buffer, int x1, int y1, int x2, int y2, uint32_t colour);
+    void KRBlit(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y);
+    void KRBlitBlend(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y);
+    void KRBlitAlpha10(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y);
+    void KRDrawLine(kr_buffer_t* buffer, int x0, int y0, int x1, int y1, uint32_t colour);
+    void KRDrawTriangle(kr_buffer_t* buffer, float x0, float y0, float x1, float y1, float x2, float y2, uint32_t colour);
+    /*
+    Record the kero_sprite call of the same name (KRClear is KSSetAllPixels). Commands that can't touch the target are
+    dropped here. Sprites are kept by pointer, so they must not change or be freed until KRFlush has returned.
+    */
+
+    void KRFlush(kr_buffer_t* buffer);
+    /*
+    Draws every recorded command and empties the buffer, returning once the target is finished. The pixels are exactly
+    the same as making the kero_sprite calls in order on one thread, except that a vertical line entirely above or below
+    the target draws nothing, where KSDrawLine clamps it onto the edge row. Only one flush can run at a time.
+    */
+
+    void KRFree(kr_buffer_t* buffer);
+
+    /*
+    Example:
+
+    kr_buffer_t buffer = {0};
+    KRBegin(&buffer, &frame_buffer);
+    KRClear(&buffer, 0xff202020);
+    KRDrawRectFilled(&buffer, 10, 10, 200, 100, 0xff4080c0);
+    KRBlitAlpha10(&buffer, &icon, 20, 20);
+    KRFlush(&buffer);
+    KPFlip();
+    */
+
+    //------------------------------------------------------------
+    // Recording
+
+    // left, top, right and bottom bound what the command can draw, inclusive
+    static kr_command_t* KRPush(kr_buffer_t* buffer, kr_command_type_t type, int left, int top, int right, int bottom, uint32_t colour) {
+        if(!buffer->target) return 0;
+        // The bands draw through views without dirty lists, so the whole command is marked here
+        KSMarkDirty(buffer->target, left, top, right, bottom);
+        top = KSMax(0, top);
+        bottom = KSMin(buffer->target->h-1, bottom);
+        if(top > bottom) return 0;
+        if(buffer->num_commands == buffer->capacity) {
+            int capacity = KSMax(64, buffer->capacity*2);
+            kr_command_t* commands = (kr_command_t*)realloc(buffer->commands, capacity*sizeof(kr_command_t));
+            if(!commands) return 0;
+            buffer->commands = commands;
+            buffer->capacity = capacity;
+        }
+        kr_command_t* command = &buffer->commands[buffer->num_commands++];
+        command->type = type;
+        command->top = top;
+        command->bottom = bottom;
+        command->colour = colour;
+        return command;
+    }
+
+    void KRBegin(kr_buffer_t* buffer, ksprite_t* target) {
+        buffer->target = target;
+        buffer->num_commands = 0;
+    }
+
+    void KRClear(kr_buffer_t* buffer, uint32_t colour) {
+        if(!buffer->target) return;
+        // Everything recorded so far would be painted over
+        buffer->num_commands = 0;
+        KRPush(buffer, KR_CLEAR, 0, 0, buffer->target->w-1, buffer->target->h-1, colour);
+    }
+
+    static void KRPushRect(kr_buffer_t* buffer, kr_command_type_t type, int x1, int y1, int x2, int y2, uint32_t colour) {
+        kr_command_t* command = KRPush(buffer, type, KSMin(x1, x2), KSMin(y1, y2), KSMax(x1, x2), KSMax(y1, y2), colour);
+        if(!command) return;
+        command->rect.x1 = x1;
+        command->rect.y1 = y1;
+        command->rect.x2 = x2;
+        command->rect.y2 = y2;
+    }
+
+    void KRDrawRectFilled(kr_buffer_t* buffer, int x1, int y1, int x2, int y2, uint32_t colour) {
+        KRPushRect(buffer, KR_RECT_FILLED, x1, y1, x2, y2, colour);
+    }
+
+    void KRDrawRectFilledAlpha(kr_buffer_t* buffer, int x1, int y1, int x2, int y2, uint32_t colour) {
+        KRPushRect(buffer, KR_RECT_FILLED_ALPHA, x1, y1, x2, y2, colour);
+    }
+
+    void KRDrawLine(kr_buffer_t* buffer, int x0, int y0, int x1, int y1, uint32_t colour) {
+        KRPushRect(buffer, KR_LINE, x0, y0, x1, y1, colour);
+    }
+
+    static void KRPushBlit(kr_buffer_t* buffer, kr_command_type_t type, ksprite_t* sprite, int x, int y) {
+        if(sprite->w <= 0 || sprite->h <= 0) return;
+        kr_command_t* command = KRPush(buffer, type, x, y, x+sprite->w-1, y+sprite->h-1, 0);
+        if(!command) return;
+        command->blit.sprite = sprite;
+        command->blit.x = x;
+        command->blit.y = y;
+    }
+
+    void KRBlit(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y) {
+        KRPushBlit(buffer, KR_BLIT, sprite, x, y);
+    }
+
+    void KRBlitBlend(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y) {
+        KRPushBlit(buffer, KR_BLIT_BLEND, sprite, x, y);
+    }
+
+    void KRBlitAlpha10(kr_buffer_t* buffer, ksprite_t* sprite, int x, int y) {
+        KRPushBlit(buffer, KR_BLIT_ALPHA10, sprite, x, y);
+    }
+
+    void KRDrawTriangle(kr_buffer_t* buffer, float x0, float y0, float x1, float y1, float x2, float y2, uint32_t colour) {
+        if(!buffer->target) return;
+        float left = KSMin(x0, KSMin(x1, x2));
+        float right = KSMax(x0, KSMax(x1, x2));
+        float top = KSMin(y0, KSMin(y1, y2));
+        float bottom = KSMax(y0, KSMax(y1, y2));
+        // KSDrawTriangle truncates towards zero, so a bit of slack either side covers every pixel it can draw
+        kr_command_t* command = KRPush(buffer, KR_TRIANGLE, (int)KSMax(left, -1.f)-1, (int)KSMax(top, -1.f)-1,
+                                       (int)KSMin(right, (float)buffer->target->w)+1, (int)KSMin(bottom, (float)buffer->target->h)+1, colour);
+        if(!command) return;
+        command->triangle.x0 = x0;
+        command->triangle.y0 = y0;
+        command->triangle.x1 = x1;
+        command->triangle.y1 = y1;
+        command->triangle.x2 = x2;
+        command->triangle.y2 = y2;
+    }
+
+    void KRFree(kr_buffer_t* buffer) {
+        free(buffer->commands);
+        buffer->commands = 0;
+        buffer->num_commands = buffer->capacity = 0;
+        buffer->target = 0;
+    }
+
+    //------------------------------------------------------------
+    // Playback
+
+    // KSDrawLine's Bresenham walk, started at the band's first row and stopped once it leaves the band, so a line costs
+    // each band only the pixels inside it. Steep lines step y every iteration and shallow ones step x every iteration,
+    // so the walk's position and error at any row can be worked out directly and give exactly the pixels KSDrawLine would.
+    static void KRDrawLineBand(ksprite_t* band, int top, int x0, int y0, int x1, int y1, uint32_t pixel) {
+        int dx = KSAbsolute(x1 - x0);
+        int dy = KSAbsolute(y1 - y0);
+        int sx = x0<x1 ? 1:-1;
+        int sy = y0<y1 ? 1:-1;
+        int err = (dx>dy ? dx:-dy) / 2;
+        int bottom = top + band->h;
+        // Rows to skip before the line reaches the band
+        int64_t rows = sy > 0 ? top - y0 : y0 - (bottom-1);
+        if(rows > dy) return;
+        if(rows > 0) {
+            int64_t steps;
+            if(dx > dy) {
+                // x steps at the first error below dy on the row before
+                int64_t c = err + (int64_t)dx*(rows-1) - dy;
+                steps = (c < 0 ? 0 : c/dy + 1) + 1;
+            }
+            else {
+                int64_t c = err + (int64_t)dx*rows;
+                steps = c <= 0 ? 0 : (c + dy-1)/dy;
+            }
+            x0 += (int)steps*sx;
+            y0 += (int)rows*sy;
+            err = (int)(err - dy*steps + (int64_t)dx*rows);
+        }
+        for(;;) {
+            if(y0 >= top && y0 < bottom) {
+                KSSetPixelSafe(band, x0, y0-top, pixel);
+            }
+            else {
+                break;
+            }
+            if(x0 == x1 && y0 == y1) break;
+            int e2 = err;
+            if (e2 > -dx) { err -= dy; x0 += sx; }
+            if (e2 <  dy) { err += dx; y0 += sy; }
+        }
+    }
+
+    // KSDrawTriangle with the rows outside the band skipped. y is kept in target space so every edge is interpolated
+    // exactly as it would be for the whole target.
+    static void KRDrawTriangleBand(ksprite_t* band, int top, float x0, float y0, float x1, float y1, float x2, float y2, uint32_t pixel) {
+        int bottom = top + band->h;
+        if(y0 > y1){
+            KSSwap(float, x0, x1);
+            KSSwap(float, y0, y1);
+        }
+        if(y1 > y2){
+            KSSwap(float, x1, x2);
+            KSSwap(float, y1, y2);
+        }
+        if(y0 > y1){
+            KSSwap(float, x0, x1);
+            KSSwap(float, y0, y1);
+        }
+        if(y1>y0){
+            int first = y0;
+            for(int y = KSMax(first, top); y <= y1 && y < bottom; ++y){
+                float x01 = x0+(x1-x0)*((KSMin(KSMax((float)y,y0),y1)-y0)/(y1-y0));
+                float x02 = x0+(x2-x0)*((KSMin(KSMax((float)y,y0),y1)-y0)/(y2-y0));
+                KSScanLine(band, y-top, x01, x02, pixel);
+            }
+        }
+        if(y2>y1){
+            int first = y1;
+            for(int y = KSMax(first, top); y <= y2 && y < bottom; ++y){
+                float x02 = x0+(x2-x0)*((KSMin(KSMax((float)y,y1),y2)-y0)/(y2-y0));
+                float x12 = x1+(x2-x1)*((KSMin(KSMax((float)y,y1),y2)-y1)/(y2-y1));
+                KSScanLine(band, y-top, x02, x12, pixel);
+            }
+        }
+    }
+
+    // Plays every command that touches rows [top, bottom) into a sprite that only covers those rows. Everything with
+    // integer coordinates is simply moved up by top, kero_sprite's own clipping does the rest.
+    static void KRDrawBand(const kr_buffer_t* buffer, int top, int bottom) {
+        KPROF_FUNCTION();
+        ksprite_t* target = buffer->target;
+        ksprite_t band = { target->w, bottom-top, target->pixels + (size_t)top*target->w, 0, 0 };
+        for(int i = 0; i < buffer->num_commands; ++i) {
+            const kr_command_t* c = &buffer->commands[i];
+            if(c->bottom < top || c->top >= bottom) continue;
+            switch(c->type) {
+                case KR_CLEAR:{
+                    KSSetAllPixels(&band, c->colour);
+                }break;
+                case KR_RECT_FILLED:{
+                    KSDrawRectFilled(&band, c->rect.x1, c->rect.y1-top, c->rect.x2, c->rect.y2-top, c->colour);
+                }break;
+                case KR_RECT_FILLED_ALPHA:{
+                    KSDrawRectFilledAlpha(&band, c->rect.x1, c->rect.y1-top, c->rect.x2, c->rect.y2-top, c->colour);
+                }break;
+                case KR_BLIT:{
+                    KSBlit(c->blit.sprite, &band, c->blit.x, c->blit.y-top);
+                }break;
+                case KR_BLIT_BLEND:{
+                    KSBlitBlend(c->blit.sprite, &band, c->blit.x, c->blit.y-top);
+                }break;
+                case KR_BLIT_ALPHA10:{
+                    KSBlitAlpha10(c->blit.sprite, &band, c->blit.x, c->blit.y-top);
+                }break;
+                case KR_LINE:{
+                    KRDrawLineBand(&band, top, c->rect.x1, c->rect.y1, c->rect.x2, c->rect.y2, c->colour);
+                }break;
+                case KR_TRIANGLE:{
+                    KRDrawTriangleBand(&band, top, c->triangle.x0, c->triangle.y0, c->triangle.x1, c->triangle.y1, c->triangle.x2, c->triangle.y2, c->colour);
+                }break;
+            }
+        }
+    }
+
+    //------------------------------------------------------------
+    // Worker pool
+
+    static struct {
+        int num_threads;
+        kt_thread_t* threads;
+        kt_mutex_t mutex;
+        kt_cond_t start, done;
+        unsigned generation;
+        int num_finished;
+        bool quit;
+        const kr_buffer_t* buffer;
+        int num_bands;
+        kt_atomic_t next_band;
+    } kr_pool;
+
+    // Bands are handed out one at a time so a thread that gets cheap bands goes on to take more
+    static void KRPoolWork() {
+        const kr_buffer_t* buffer = kr_pool.buffer;
+        for(;;) {
+            int band = KTAtomicAdd(&kr_pool.next_band, 1);
+            if(band >= kr_pool.num_bands) break;
+            int top = band*KR_BAND_HEIGHT;
+            KRDrawBand(buffer, top, KSMin(top + KR_BAND_HEIGHT, buffer->target->h));
+        }
+    }
+
+    static kt_thread_result_t KRPoolThread(void* data) {
+        (void)data;
+        KPROF_THREAD_NAME("kero raster");
+        unsigned seen = 0;
+        for(;;) {
+            KTLock(kr_pool.mutex);
+            while(kr_pool.generation == seen && !kr_pool.quit) {
+                KTCondWait(kr_pool.start, kr_pool.mutex);
+            }
+            seen = kr_pool.generation;
+            bool quit = kr_pool.quit;
+            KTUnlock(kr_pool.mutex);
+            if(quit) break;
+            KRPoolWork();
+            KTLock(kr_pool.mutex);
+            if(++kr_pool.num_finished == kr_pool.num_threads-1) {
+                KTCondBroadcast(kr_pool.done);
+            }
+            KTUnlock(kr_pool.mutex);
+        }
+        return 0;
+    }
+
+    bool KRInit(int num_threads) {
+        if(kr_pool.threads) return true;
+        if(num_threads <= 0) {
+            num_threads = KTCPUCount();
+        }
+        kr_pool.threads = (kt_thread_t*)calloc(num_threads, sizeof(kt_thread_t));
+        if(!kr_pool.threads) return false;
+        kr_pool.num_threads = num_threads;
+        kr_pool.generation = 0;
+        kr_pool.quit = false;
+        // Pick the kero_sprite kernels now rather than have every worker race to do it on its first fill
+        KSPickKernels();
+        KTMutexInit(&kr_pool.mutex);
+        KTCondInit(&kr_pool.start);
+        KTCondInit(&kr_pool.done);
+        // Thread 0 is the one calling KRFlush
+        for(int i = 1; i < num_threads; ++i) {
+            if(!KTThreadStart(&kr_pool.threads[i], KRPoolThread, 0, "kero raster")) {
+                // KRFlush waits for num_threads-1 finishes, so it has to count only the threads that are running
+                kr_pool.num_threads = i;
+                break;
+            }
+        }
+        return true;
+    }
+
+    void KRFlush(kr_buffer_t* buffer) {
+        KPROF_FUNCTION();
+        if(!buffer->target || !buffer->num_commands) return;
+        int num_bands = (buffer->target->h + KR_BAND_HEIGHT-1) / KR_BAND_HEIGHT;
+        if(!kr_pool.threads) {
+            KRInit(0);
+        }
+        if(!kr_pool.threads || kr_pool.num_threads == 1 || num_bands == 1) {
+            for(int top = 0; top < buffer->target->h; top += KR_BAND_HEIGHT) {
+                KRDrawBand(buffer, top, KSMin(top + KR_BAND_HEIGHT, buffer->target->h));
+            }
+            buffer->num_commands = 0;
+            return;
+        }
+        KTLock(kr_pool.mutex);
+        kr_pool.buffer = buffer;
+        kr_pool.num_bands = num_bands;
+        kr_pool.num_finished = 0;
+        KTAtomicSet(&kr_pool.next_band, 0);
+        ++kr_pool.generation;
+        KTCondBroadcast(kr_pool.start);
+        KTUnlock(kr_pool.mutex);
+
+        KRPoolWork();
+
+        KTLock(kr_pool.mutex);
+        while(kr_pool.num_finished < kr_pool.num_threads-1) {
+            KTCondWait(kr_pool.done, kr_pool.mutex);
+        }
+        KTUnlock(kr_pool.mutex);
+        buffer->num_commands = 0;
+    }
+
+    void KRShutdown() {
+        if(!kr_pool.threads) return;
+        KTLock(kr_pool.mutex);
+        kr_pool.quit = true;
+        KTCondBroadcast(kr_pool.start);
+        KTUnlock(kr_pool.mutex);
+        for(int i = 1; i < kr_pool.num_threads; ++i) {
+            KTThreadJoin(kr_pool.threads[i]);
+        }
+        KTMutexDestroy(&kr_pool.mutex);
+        KTCondDestroy(&kr_pool.start);
+        KTCondDestroy(&kr_pool.done);
+        free(kr_pool.threads);
+        kr_pool.threads = 0;
+        kr_pool.num_threads = 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#define KERO_RASTER_H
+#endif
@@ -5,10 +5,12 @@ extern "C"{
 #endif
     
 #include <string.h>
+#include <math.h>
 #include <stdint.h>
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #include "stb_image.h"
+#include "kero_profile.h"
     
 #define KSMax(a, b) ((a)>(b)?(a):(b))
 #define KSMin(a, b) ((a)<(b)?(a):(b))
@@ -31,13 +33,104 @@ extern "C"{
 #define KSBLACK 0xff000000
 #define KSWHITE 0xffffffff
     
+    // Row classes, see KSClassifyRows. A row with none of these set is mixed.
+#define KS_ROW_TRANSPARENT 1 // every pixel has alpha 0
+#define KS_ROW_SOLID 2 // no pixel has alpha 0
+#define KS_ROW_OPAQUE 4 // every pixel has alpha 255
+    
+    // Dirty rectangles. Point a sprite's dirty at a ks_dirty_t and the drawing functions add the area
+    // they draw to, clipped to the sprite, so a frame buffer can be sent to the screen a few rectangles
+    // at a time (see KPFlipRects). The single pixel functions (KSSetPixel and friends) don't, they're
+    // too hot, so use KSMarkDirty if you draw with them. Set count back to 0 once the frame is shown.
+    typedef struct{
+        int x, y, w, h;
+    } ks_rect_t;
+    
+    typedef struct{
+        ks_rect_t* rects;
+        int count, capacity;
+    } ks_dirty_t;
+    
     typedef struct{
         int w,h;
         uint32_t* pixels;
+        uint8_t* rows; // one KS_ROW_ class per row, or 0 if the sprite hasn't been classified
+        ks_dirty_t* dirty; // 0 unless you want drawing into this sprite tracked
     } ksprite_t;
+    // Every drawing function follows dirty if it isn't 0, so a ksprite_t you fill in yourself has to have rows and dirty
+    // zeroed too: { w, h, pixels, 0, 0 } or start from {0}. KSCreate, KSLoad and KSCreateFromSprite do it for you.
+    
+    // Looks at the alpha of every row once, so the blits can skip transparent rows and copy solid
+    // rows whole. KSLoad and KSCreateFromSprite do this for you. If you draw into a sprite and then
+    // blit it somewhere else, call this again afterwards, or the blits will use stale classes.
+    void KSClassifyRows(ksprite_t* sprite){
+        if(!sprite->rows){
+            sprite->rows = (uint8_t*)malloc(KSMax(sprite->h, 1));
+        }
+        for(int y = 0; y < sprite->h; ++y){
+            uint32_t* row = sprite->pixels + y*sprite->w;
+            uint32_t any = 0, all = 0xff;
+            int zeroes = 0;
+            for(int x = 0; x < sprite->w; ++x){
+                uint32_t alpha = row[x]>>24;
+                any |= alpha;
+                all &= alpha;
+                zeroes += alpha == 0;
+            }
+            sprite->rows[y] = (any == 0 ? KS_ROW_TRANSPARENT : 0) | (zeroes == 0 ? KS_ROW_SOLID : 0) | (all == 0xff ? KS_ROW_OPAQUE : 0);
+        }
+    }
+    
+    static inline int KSRowClass(ksprite_t* sprite, int y){
+        return sprite->rows ? sprite->rows[y] : 0;
+    }
+    
+    // Adds the rectangle with corners (x1, y1) and (x2, y2), inclusive, to the sprite's dirty list if it has one
+    static inline void KSMarkDirty(ksprite_t* sprite, int x1, int y1, int x2, int y2){
+        ks_dirty_t* dirty = sprite->dirty;
+        if(!dirty) return;
+        int left = KSMax(0, KSMin(x1, x2));
+        int right = KSMin(sprite->w-1, KSMax(x1, x2));
+        int top = KSMax(0, KSMin(y1, y2));
+        int bottom = KSMin(sprite->h-1, KSMax(y1, y2));
+        if(left > right || top > bottom) return;
+        if(dirty->count){
+            // Shapes drawn in pieces (triangles, outlines) mark their bounds first, so the pieces stop here
+            ks_rect_t* last = &dirty->rects[dirty->count-1];
+            if(left >= last->x && right < last->x+last->w && top >= last->y && bottom < last->y+last->h) return;
+        }
+        if(dirty->count == dirty->capacity){
+            int capacity = KSMax(32, dirty->capacity*2);
+            ks_rect_t* rects = (ks_rect_t*)realloc(dirty->rects, capacity*sizeof(ks_rect_t));
+            if(!rects){
+                // Can't grow, so fall back to the whole sprite
+                if(!dirty->capacity) return;
+                dirty->rects[0].x = dirty->rects[0].y = 0;
+                dirty->rects[0].w = sprite->w;
+                dirty->rects[0].h = sprite->h;
+                dirty->count = 1;
+                return;
+            }
+            dirty->rects = rects;
+            dirty->capacity = capacity;
+        }
+        ks_rect_t* rect = &dirty->rects[dirty->count++];
+        rect->x = left;
+        rect->y = top;
+        rect->w = right-left+1;
+        rect->h = bottom-top+1;
+    }
+    
+    static inline void KSDirtyFree(ks_dirty_t* dirty){
+        free(dirty->rects);
+        dirty->rects = 0;
+        dirty->count = dirty->capacity = 0;
+    }
     
     bool KSLoad(ksprite_t* sprite, char* filepath){
         sprite->pixels = (uint32_t*)stbi_load(filepath, &sprite->w, &sprite->h, 0, 4);
+        sprite->rows = 0;
+        sprite->dirty = 0;
         if(!sprite->pixels){
             return false;
         }
@@ -50,6 +143,7 @@ extern "C"{
                 *r = true_red;
             }
         }
+        KSClassifyRows(sprite);
         return true;
     }
     
@@ -57,19 +151,22 @@ extern "C"{
         sprite->w = w;
         sprite->h = h;
         sprite->pixels = (uint32_t*)malloc(w*h*sizeof(uint32_t));
+        sprite->rows = 0;
+        sprite->dirty = 0;
     }
     
     static inline void KSFree(ksprite_t* sprite) {
         free(sprite->pixels);
+        free(sprite->rows);
+        sprite->rows = 0;
     }
     
     void KSCreateFromSprite(ksprite_t* sprite, ksprite_t* source, int left, int top, int right, int bottom) {
         KSCreate(sprite, right-left, bottom-top);
         for(int y = 0; y < sprite->h; ++y){
-            for(int x = 0; x < sprite->w; ++x){
-                sprite->pixels[y*sprite->w+x] = source->pixels[(y+top)*source->w + x+left];
-            }
+            memcpy(sprite->pixels + y*sprite->w, source->pixels + (y+top)*source->w + left, sprite->w*sizeof(uint32_t));
         }
+        KSClassifyRows(sprite);
     }
     
     static inline uint32_t KSGetPixel(ksprite_t* source, int x, int y){
@@ -114,6 +211,7 @@ extern "C"{
                 }
             }
         }
+        if(sprite->rows) KSClassifyRows(sprite);
     }
     
     void KSColorKey(ksprite_t* sprite, uint32_t color_before, uint32_t color_after) {
@@ -124,123 +222,754 @@ extern "C"{
                 }
             }
         }
+        if(sprite->rows) KSClassifyRows(sprite);
+    }
+    
+    // SIMD kernels. Solid fills, blends and tinted blits all go through the ks_* function pointers
+    // below, which point at the widest kernels this CPU has. They start out pointing at stubs that
+    // check the CPU on the first call and swap every pointer over, so the check only happens once.
+    // Setting KS_SIMD=scalar/sse2/avx2/avx512 in the environment caps the kernels used, which is
+    // handy for benchmarking them against each other.
+    // Fills of at least KS_STREAM_BYTES use non-temporal stores: a 4K framebuffer doesn't fit in the
+    // cache anyway, so it's quicker to write it straight to memory than to evict everything else first.
+    // Blending is 8 bit fixed point: out = (source*alpha + dest*(255-alpha))/255, rounded, with the /255
+    // done as (t + (t>>8) + 128)>>8 style multiply-shifts. The destination alpha uses the same formula
+    // with a source channel of 255, so it ends up as dest_alpha + (255-dest_alpha)*alpha.
+#ifndef KS_STREAM_BYTES
+#define KS_STREAM_BYTES (4*1024*1024)
+#endif
+    
+    typedef void (*ks_fill_t)(uint32_t* dest, size_t count, uint32_t pixel, int stream);
+    typedef void (*ks_blend_t)(uint32_t* dest, const uint32_t* source, size_t count);
+    typedef void (*ks_blend_solid_t)(uint32_t* dest, size_t count, uint32_t pixel);
+    typedef void (*ks_tint_t)(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour);
+    typedef void (*ks_lerp_rows_t)(uint32_t* dest, const uint32_t* a, const uint32_t* b, size_t count, uint32_t f);
+    typedef void (*ks_bilinear_row_t)(uint32_t* dest, const uint32_t* source, size_t count, int32_t u, int32_t step);
+    
+    static inline uint32_t KSBlend32(uint32_t source, uint32_t dest){
+        // Red and blue, then green and alpha, two channels at a time in 16 bit fields
+        uint32_t alpha = source>>24;
+        uint32_t s = source | 0xff000000;
+        uint32_t rb = (s & 0xff00ff)*alpha + (dest & 0xff00ff)*(255-alpha) + 0x800080;
+        uint32_t ga = ((s>>8) & 0xff00ff)*alpha + ((dest>>8) & 0xff00ff)*(255-alpha) + 0x800080;
+        rb = ((rb + ((rb>>8) & 0xff00ff))>>8) & 0xff00ff;
+        ga = ((ga + ((ga>>8) & 0xff00ff))>>8) & 0xff00ff;
+        return rb | ga<<8;
+    }
+    
+    // Multiplies the source colour by colour channel by channel, keeping the source alpha
+    static inline uint32_t KSTint32(uint32_t source, uint32_t colour){
+        uint32_t m = colour | 0xff000000;
+        uint32_t result = 0;
+        for(int shift = 0; shift < 32; shift += 8){
+            uint32_t t = ((source>>shift) & 0xff)*((m>>shift) & 0xff) + 128;
+            result |= ((t + (t>>8))>>8)<<shift;
+        }
+        return result;
+    }
+    
+    static void KSFillScalar(uint32_t* dest, size_t count, uint32_t pixel, int stream){
+        (void)stream;
+        for(size_t i = 0; i < count; ++i){
+            dest[i] = pixel;
+        }
+    }
+    
+    static void KSBlendScalar(uint32_t* dest, const uint32_t* source, size_t count){
+        for(size_t i = 0; i < count; ++i){
+            dest[i] = KSBlend32(source[i], dest[i]);
+        }
+    }
+    
+    static void KSBlendSolidScalar(uint32_t* dest, size_t count, uint32_t pixel){
+        for(size_t i = 0; i < count; ++i){
+            dest[i] = KSBlend32(pixel, dest[i]);
+        }
+    }
+    
+    static void KSTintScalar(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour){
+        for(size_t i = 0; i < count; ++i){
+            dest[i] = KSTint32(source[i], colour);
+        }
+    }
+    
+    // a*(256-f) + b*f >> 8 on every channel, f is 0 to 255
+    static inline uint32_t KSLerp32(uint32_t a, uint32_t b, uint32_t f){
+        uint32_t rb = ((a & 0xff00ff)*(256-f) + (b & 0xff00ff)*f)>>8;
+        uint32_t ga = ((a>>8) & 0xff00ff)*(256-f) + ((b>>8) & 0xff00ff)*f;
+        return (rb & 0xff00ff) | (ga & 0xff00ff00);
+    }
+    
+    static void KSLerpRowsScalar(uint32_t* dest, const uint32_t* a, const uint32_t* b, size_t count, uint32_t f){
+        for(size_t i = 0; i < count; ++i){
+            dest[i] = KSLerp32(a[i], b[i], f);
+        }
+    }
+    
+    // Steps through source in 16.16 fixed point, blending each pixel with the one to its right
+    static void KSBilinearRowScalar(uint32_t* dest, const uint32_t* source, size_t count, int32_t u, int32_t step){
+        for(size_t i = 0; i < count; ++i, u += step){
+            const uint32_t* p = source + (u>>16);
+            dest[i] = KSLerp32(p[0], p[1], (u>>8) & 0xff);
+        }
+    }
+    
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define KS_SIMD_X86
+#include <immintrin.h>
+    
+    // SSE2, 4 pixels at a time
+    
+    __attribute__((target("sse2")))
+    static inline __m128i KSLerpSSE2(__m128i s, __m128i d, __m128i a){
+        // (s*a + d*(255-a))/255 rounded, on eight 16 bit channels
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+        t = _mm_add_epi16(t, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+    
+    __attribute__((target("sse2")))
+    static inline __m128i KSBlendSSE2(__m128i s, __m128i d){
+        __m128i zero = _mm_setzero_si128();
+        __m128i opaque = _mm_set1_epi64x(0x00ff000000000000LL);
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xff), 0xff);
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xff), 0xff);
+        __m128i lo = KSLerpSSE2(_mm_or_si128(s_lo, opaque), _mm_unpacklo_epi8(d, zero), a_lo);
+        __m128i hi = KSLerpSSE2(_mm_or_si128(s_hi, opaque), _mm_unpackhi_epi8(d, zero), a_hi);
+        return _mm_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("sse2")))
+    static inline __m128i KSTintSSE2(__m128i s, __m128i m){
+        // m is the colour with an alpha of 255, already unpacked to 16 bits
+        __m128i zero = _mm_setzero_si128();
+        __m128i lo = KSLerpSSE2(_mm_unpacklo_epi8(s, zero), zero, m);
+        __m128i hi = KSLerpSSE2(_mm_unpackhi_epi8(s, zero), zero, m);
+        return _mm_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSFillSSE2(uint32_t* dest, size_t count, uint32_t pixel, int stream){
+        for(; count && ((uintptr_t)dest & 15); --count){
+            *dest++ = pixel;
+        }
+        __m128i v = _mm_set1_epi32((int)pixel);
+        __m128i* d = (__m128i*)dest;
+        if(stream){
+            for(; count >= 16; count -= 16, d += 4){
+                _mm_stream_si128(d, v);
+                _mm_stream_si128(d+1, v);
+                _mm_stream_si128(d+2, v);
+                _mm_stream_si128(d+3, v);
+            }
+            _mm_sfence();
+        }
+        else{
+            for(; count >= 16; count -= 16, d += 4){
+                _mm_store_si128(d, v);
+                _mm_store_si128(d+1, v);
+                _mm_store_si128(d+2, v);
+                _mm_store_si128(d+3, v);
+            }
+        }
+        for(; count >= 4; count -= 4){
+            _mm_store_si128(d++, v);
+        }
+        dest = (uint32_t*)d;
+        while(count--){
+            *dest++ = pixel;
+        }
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSBlendSSE2Span(uint32_t* dest, const uint32_t* source, size_t count){
+        for(; count >= 4; count -= 4, dest += 4, source += 4){
+            __m128i s = _mm_loadu_si128((const __m128i*)source);
+            __m128i d = _mm_loadu_si128((const __m128i*)dest);
+            _mm_storeu_si128((__m128i*)dest, KSBlendSSE2(s, d));
+        }
+        KSBlendScalar(dest, source, count);
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSBlendSolidSSE2(uint32_t* dest, size_t count, uint32_t pixel){
+        __m128i s = _mm_set1_epi32((int)pixel);
+        for(; count >= 4; count -= 4, dest += 4){
+            __m128i d = _mm_loadu_si128((const __m128i*)dest);
+            _mm_storeu_si128((__m128i*)dest, KSBlendSSE2(s, d));
+        }
+        KSBlendSolidScalar(dest, count, pixel);
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSTintSSE2Span(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour){
+        __m128i m = _mm_unpacklo_epi8(_mm_set1_epi32((int)(colour | 0xff000000)), _mm_setzero_si128());
+        for(; count >= 4; count -= 4, dest += 4, source += 4){
+            __m128i s = _mm_loadu_si128((const __m128i*)source);
+            _mm_storeu_si128((__m128i*)dest, KSTintSSE2(s, m));
+        }
+        KSTintScalar(dest, source, count, colour);
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSLerpRowsSSE2(uint32_t* dest, const uint32_t* a, const uint32_t* b, size_t count, uint32_t f){
+        __m128i zero = _mm_setzero_si128();
+        __m128i fa = _mm_set1_epi16((short)(256-f));
+        __m128i fb = _mm_set1_epi16((short)f);
+        for(; count >= 4; count -= 4, dest += 4, a += 4, b += 4){
+            __m128i va = _mm_loadu_si128((const __m128i*)a);
+            __m128i vb = _mm_loadu_si128((const __m128i*)b);
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), fa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), fb));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), fa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), fb));
+            _mm_storeu_si128((__m128i*)dest, _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+        KSLerpRowsScalar(dest, a, b, count, f);
+    }
+    
+    __attribute__((target("sse2")))
+    static inline __m128i KSLerp16SSE2(__m128i a, __m128i b, __m128i f){
+        // a*(256-f) + b*f >> 8 on eight 16 bit channels
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(_mm_set1_epi16(256), f)), _mm_mullo_epi16(b, f));
+        return _mm_srli_epi16(t, 8);
+    }
+    
+    __attribute__((target("sse2")))
+    static void KSBilinearRowSSE2(uint32_t* dest, const uint32_t* source, size_t count, int32_t u, int32_t step){
+        // Four destination pixels at a time. Each one loads its left and right source pixels with one
+        // 64 bit load, the weights come from the 16.16 positions kept in a vector alongside u.
+        __m128i zero = _mm_setzero_si128();
+        __m128i uvec = _mm_add_epi32(_mm_set1_epi32(u), _mm_set_epi32(3*step, 2*step, step, 0));
+        __m128i ustep = _mm_set1_epi32(4*step);
+        for(; count >= 4; count -= 4, dest += 4, u += 4*step){
+            __m128i f = _mm_and_si128(_mm_srli_epi32(uvec, 8), _mm_set1_epi32(0xff));
+            uvec = _mm_add_epi32(uvec, ustep);
+            f = _mm_packs_epi32(f, f);
+            f = _mm_unpacklo_epi16(f, f);
+            __m128i f01 = _mm_unpacklo_epi32(f, f);
+            __m128i f23 = _mm_unpackhi_epi32(f, f);
+            __m128i p0 = _mm_loadl_epi64((const __m128i*)(source + (u>>16)));
+            __m128i p1 = _mm_loadl_epi64((const __m128i*)(source + ((u+step)>>16)));
+            __m128i p2 = _mm_loadl_epi64((const __m128i*)(source + ((u+2*step)>>16)));
+            __m128i p3 = _mm_loadl_epi64((const __m128i*)(source + ((u+3*step)>>16)));
+            // Left pixels in the low half, right pixels in the high half
+            __m128i lr01 = _mm_unpacklo_epi32(p0, p1);
+            __m128i lr23 = _mm_unpacklo_epi32(p2, p3);
+            __m128i r01 = KSLerp16SSE2(_mm_unpacklo_epi8(lr01, zero), _mm_unpackhi_epi8(lr01, zero), f01);
+            __m128i r23 = KSLerp16SSE2(_mm_unpacklo_epi8(lr23, zero), _mm_unpackhi_epi8(lr23, zero), f23);
+            _mm_storeu_si128((__m128i*)dest, _mm_packus_epi16(r01, r23));
+        }
+        KSBilinearRowScalar(dest, source, count, u, step);
+    }
+    
+    // AVX2, 8 pixels at a time. The unpacks and packs work within 128 bit halves, which is fine
+    // because every pixel is packed back into the half it was unpacked from.
+    
+    __attribute__((target("avx2")))
+    static inline __m256i KSLerpAVX2(__m256i s, __m256i d, __m256i a){
+        __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+        t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    }
+    
+    __attribute__((target("avx2")))
+    static inline __m256i KSBlendAVX2(__m256i s, __m256i d){
+        __m256i zero = _mm256_setzero_si256();
+        __m256i opaque = _mm256_set1_epi64x(0x00ff000000000000LL);
+        __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+        __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+        __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xff), 0xff);
+        __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xff), 0xff);
+        __m256i lo = KSLerpAVX2(_mm256_or_si256(s_lo, opaque), _mm256_unpacklo_epi8(d, zero), a_lo);
+        __m256i hi = KSLerpAVX2(_mm256_or_si256(s_hi, opaque), _mm256_unpackhi_epi8(d, zero), a_hi);
+        return _mm256_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("avx2")))
+    static inline __m256i KSTintAVX2(__m256i s, __m256i m){
+        __m256i zero = _mm256_setzero_si256();
+        __m256i lo = KSLerpAVX2(_mm256_unpacklo_epi8(s, zero), zero, m);
+        __m256i hi = KSLerpAVX2(_mm256_unpackhi_epi8(s, zero), zero, m);
+        return _mm256_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("avx2")))
+    static void KSFillAVX2(uint32_t* dest, size_t count, uint32_t pixel, int stream){
+        // Eight -1s then eight 0s, loading at ks_fill_mask+8-n gives a mask for the first n lanes
+        static const int32_t ks_fill_mask[16] = {-1,-1,-1,-1,-1,-1,-1,-1, 0,0,0,0,0,0,0,0};
+        for(; count && ((uintptr_t)dest & 31); --count){
+            *dest++ = pixel;
+        }
+        __m256i v = _mm256_set1_epi32((int)pixel);
+        __m256i* d = (__m256i*)dest;
+        if(stream){
+            for(; count >= 32; count -= 32, d += 4){
+                _mm256_stream_si256(d, v);
+                _mm256_stream_si256(d+1, v);
+                _mm256_stream_si256(d+2, v);
+                _mm256_stream_si256(d+3, v);
+            }
+            _mm_sfence();
+        }
+        else{
+            for(; count >= 32; count -= 32, d += 4){
+                _mm256_store_si256(d, v);
+                _mm256_store_si256(d+1, v);
+                _mm256_store_si256(d+2, v);
+                _mm256_store_si256(d+3, v);
+            }
+        }
+        for(; count >= 8; count -= 8){
+            _mm256_store_si256(d++, v);
+        }
+        if(count){
+            __m256i mask = _mm256_loadu_si256((const __m256i*)(ks_fill_mask + 8 - count));
+            _mm256_maskstore_epi32((int*)d, mask, v);
+        }
+    }
+    
+    __attribute__((target("avx2")))
+    static void KSBlendAVX2Span(uint32_t* dest, const uint32_t* source, size_t count){
+        for(; count >= 8; count -= 8, dest += 8, source += 8){
+            __m256i s = _mm256_loadu_si256((const __m256i*)source);
+            __m256i d = _mm256_loadu_si256((const __m256i*)dest);
+            _mm256_storeu_si256((__m256i*)dest, KSBlendAVX2(s, d));
+        }
+        KSBlendScalar(dest, source, count);
+    }
+    
+    __attribute__((target("avx2")))
+    static void KSBlendSolidAVX2(uint32_t* dest, size_t count, uint32_t pixel){
+        __m256i s = _mm256_set1_epi32((int)pixel);
+        for(; count >= 8; count -= 8, dest += 8){
+            __m256i d = _mm256_loadu_si256((const __m256i*)dest);
+            _mm256_storeu_si256((__m256i*)dest, KSBlendAVX2(s, d));
+        }
+        KSBlendSolidScalar(dest, count, pixel);
+    }
+    
+    __attribute__((target("avx2")))
+    static void KSTintAVX2Span(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour){
+        __m256i m = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)(colour | 0xff000000)), _mm256_setzero_si256());
+        for(; count >= 8; count -= 8, dest += 8, source += 8){
+            __m256i s = _mm256_loadu_si256((const __m256i*)source);
+            _mm256_storeu_si256((__m256i*)dest, KSTintAVX2(s, m));
+        }
+        KSTintScalar(dest, source, count, colour);
+    }
+    
+    // AVX-512, 16 pixels at a time, with masked loads and stores for the ends of spans
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static inline __m512i KSLerpAVX512(__m512i s, __m512i d, __m512i a){
+        __m512i t = _mm512_add_epi16(_mm512_mullo_epi16(s, a), _mm512_mullo_epi16(d, _mm512_sub_epi16(_mm512_set1_epi16(255), a)));
+        t = _mm512_add_epi16(t, _mm512_set1_epi16(128));
+        return _mm512_srli_epi16(_mm512_add_epi16(t, _mm512_srli_epi16(t, 8)), 8);
+    }
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static inline __m512i KSBlendAVX512(__m512i s, __m512i d){
+        __m512i zero = _mm512_setzero_si512();
+        __m512i opaque = _mm512_set1_epi64(0x00ff000000000000LL);
+        __m512i s_lo = _mm512_unpacklo_epi8(s, zero);
+        __m512i s_hi = _mm512_unpackhi_epi8(s, zero);
+        __m512i a_lo = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(s_lo, 0xff), 0xff);
+        __m512i a_hi = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(s_hi, 0xff), 0xff);
+        __m512i lo = KSLerpAVX512(_mm512_or_si512(s_lo, opaque), _mm512_unpacklo_epi8(d, zero), a_lo);
+        __m512i hi = KSLerpAVX512(_mm512_or_si512(s_hi, opaque), _mm512_unpackhi_epi8(d, zero), a_hi);
+        return _mm512_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static inline __m512i KSTintAVX512(__m512i s, __m512i m){
+        __m512i zero = _mm512_setzero_si512();
+        __m512i lo = KSLerpAVX512(_mm512_unpacklo_epi8(s, zero), zero, m);
+        __m512i hi = KSLerpAVX512(_mm512_unpackhi_epi8(s, zero), zero, m);
+        return _mm512_packus_epi16(lo, hi);
+    }
+    
+    __attribute__((target("avx512f")))
+    static void KSFillAVX512(uint32_t* dest, size_t count, uint32_t pixel, int stream){
+        __m512i v = _mm512_set1_epi32((int)pixel);
+        size_t head = ((64 - ((uintptr_t)dest & 63)) & 63) / 4;
+        if(head){
+            head = KSMin(head, count);
+            _mm512_mask_storeu_epi32(dest, (__mmask16)((1u<<head)-1), v);
+            dest += head;
+            count -= head;
+        }
+        __m512i* d = (__m512i*)dest;
+        if(stream){
+            for(; count >= 64; count -= 64, d += 4){
+                _mm512_stream_si512(d, v);
+                _mm512_stream_si512(d+1, v);
+                _mm512_stream_si512(d+2, v);
+                _mm512_stream_si512(d+3, v);
+            }
+            _mm_sfence();
+        }
+        else{
+            for(; count >= 64; count -= 64, d += 4){
+                _mm512_store_si512(d, v);
+                _mm512_store_si512(d+1, v);
+                _mm512_store_si512(d+2, v);
+                _mm512_store_si512(d+3, v);
+            }
+        }
+        for(; count >= 16; count -= 16){
+            _mm512_store_si512(d++, v);
+        }
+        if(count){
+            _mm512_mask_storeu_epi32(d, (__mmask16)((1u<<count)-1), v);
+        }
+    }
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static void KSBlendAVX512Span(uint32_t* dest, const uint32_t* source, size_t count){
+        for(; count; dest += 16, source += 16){
+            __mmask16 mask = count >= 16 ? 0xffff : (__mmask16)((1u<<count)-1);
+            __m512i s = _mm512_maskz_loadu_epi32(mask, source);
+            __m512i d = _mm512_maskz_loadu_epi32(mask, dest);
+            _mm512_mask_storeu_epi32(dest, mask, KSBlendAVX512(s, d));
+            count -= KSMin(count, 16);
+        }
+    }
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static void KSBlendSolidAVX512(uint32_t* dest, size_t count, uint32_t pixel){
+        __m512i s = _mm512_set1_epi32((int)pixel);
+        for(; count; dest += 16){
+            __mmask16 mask = count >= 16 ? 0xffff : (__mmask16)((1u<<count)-1);
+            __m512i d = _mm512_maskz_loadu_epi32(mask, dest);
+            _mm512_mask_storeu_epi32(dest, mask, KSBlendAVX512(s, d));
+            count -= KSMin(count, 16);
+        }
+    }
+    
+    __attribute__((target("avx512f,avx512bw")))
+    static void KSTintAVX512Span(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour){
+        __m512i m = _mm512_unpacklo_epi8(_mm512_set1_epi32((int)(colour | 0xff000000)), _mm512_setzero_si512());
+        for(; count; dest += 16, source += 16){
+            __mmask16 mask = count >= 16 ? 0xffff : (__mmask16)((1u<<count)-1);
+            __m512i s = _mm512_maskz_loadu_epi32(mask, source);
+            _mm512_mask_storeu_epi32(dest, mask, KSTintAVX512(s, m));
+            count -= KSMin(count, 16);
+        }
+    }
+#endif
+    
+    static void KSFillResolve(uint32_t* dest, size_t count, uint32_t pixel, int stream);
+    static void KSBlendResolve(uint32_t* dest, const uint32_t* source, size_t count);
+    static void KSBlendSolidResolve(uint32_t* dest, size_t count, uint32_t pixel);
+    static void KSTintResolve(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour);
+    static void KSLerpRowsResolve(uint32_t* dest, const uint32_t* a, const uint32_t* b, size_t count, uint32_t f);
+    static void KSBilinearRowResolve(uint32_t* dest, const uint32_t* source, size_t count, int32_t u, int32_t step);
+    static ks_fill_t ks_fill = KSFillResolve;
+    static ks_blend_t ks_blend = KSBlendResolve;
+    static ks_blend_solid_t ks_blend_solid = KSBlendSolidResolve;
+    static ks_tint_t ks_tint = KSTintResolve;
+    static ks_lerp_rows_t ks_lerp_rows = KSLerpRowsResolve;
+    static ks_bilinear_row_t ks_bilinear_row = KSBilinearRowResolve;
+    static const char* ks_simd_name = "scalar";
+    
+    static void KSPickKernels(){
+        ks_fill_t fill = KSFillScalar;
+        ks_blend_t blend = KSBlendScalar;
+        ks_blend_solid_t blend_solid = KSBlendSolidScalar;
+        ks_tint_t tint = KSTintScalar;
+        ks_lerp_rows_t lerp_rows = KSLerpRowsScalar;
+        ks_bilinear_row_t bilinear_row = KSBilinearRowScalar;
+        const char* name = "scalar";
+#ifdef KS_SIMD_X86
+        const char* forced = getenv("KS_SIMD");
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("sse2") && (!forced || strcmp(forced, "scalar"))){
+            fill = KSFillSSE2;
+            blend = KSBlendSSE2Span;
+            blend_solid = KSBlendSolidSSE2;
+            tint = KSTintSSE2Span;
+            lerp_rows = KSLerpRowsSSE2;
+            bilinear_row = KSBilinearRowSSE2;
+            name = "sse2";
+        }
+        if(__builtin_cpu_supports("avx2") && (!forced || !strcmp(forced, "avx2") || !strcmp(forced, "avx512"))){
+            fill = KSFillAVX2;
+            blend = KSBlendAVX2Span;
+            blend_solid = KSBlendSolidAVX2;
+            tint = KSTintAVX2Span;
+            name = "avx2";
+        }
+        if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && (!forced || !strcmp(forced, "avx512"))){
+            fill = KSFillAVX512;
+            blend = KSBlendAVX512Span;
+            blend_solid = KSBlendSolidAVX512;
+            tint = KSTintAVX512Span;
+            name = "avx512";
+        }
+#endif
+        // Threads racing through here all store the same values
+        ks_simd_name = name;
+        ks_fill = fill;
+        ks_blend = blend;
+        ks_blend_solid = blend_solid;
+        ks_tint = tint;
+        ks_lerp_rows = lerp_rows;
+        ks_bilinear_row = bilinear_row;
+    }
+    
+    static void KSFillResolve(uint32_t* dest, size_t count, uint32_t pixel, int stream){
+        KSPickKernels();
+        ks_fill(dest, count, pixel, stream);
+    }
+    
+    static void KSBlendResolve(uint32_t* dest, const uint32_t* source, size_t count){
+        KSPickKernels();
+        ks_blend(dest, source, count);
+    }
+    
+    static void KSBlendSolidResolve(uint32_t* dest, size_t count, uint32_t pixel){
+        KSPickKernels();
+        ks_blend_solid(dest, count, pixel);
+    }
+    
+    static void KSTintResolve(uint32_t* dest, const uint32_t* source, size_t count, uint32_t colour){
+        KSPickKernels();
+        ks_tint(dest, source, count, colour);
+    }
+    
+    static void KSLerpRowsResolve(uint32_t* dest, const uint32_t* a, const uint32_t* b, size_t count, uint32_t f){
+        KSPickKernels();
+        ks_lerp_rows(dest, a, b, count, f);
+    }
+    
+    static void KSBilinearRowResolve(uint32_t* dest, const uint32_t* source, size_t count, int32_t u, int32_t step){
+        KSPickKernels();
+        ks_bilinear_row(dest, source, count, u, step);
+    }
+    
+    // Which kernels are in use, "scalar" until the first fill or blend has happened
+    static inline const char* KSKernelName(){
+        return ks_simd_name;
+    }
+    
+    static inline void KSFillSpan(uint32_t* dest, size_t count, uint32_t pixel){
+        ks_fill(dest, count, pixel, count*sizeof(uint32_t) >= KS_STREAM_BYTES);
     }
     
     void KSBlendPixel(ksprite_t* dest, int x, int y, uint32_t pixel){
         if(x < 0 || x > dest->w-1 || y < 0 || y > dest->h-1) return;
-        uint8_t* dest_pixel = (uint8_t*)(dest->pixels + y*dest->w + x);
-        float alpha = (float)(pixel>>24) / 255.f;
-        float one_minus_alpha = 1.f - alpha;
-        *dest_pixel = (uint8_t)(pixel) * alpha + (*dest_pixel) * one_minus_alpha;
-        ++dest_pixel;
-        *dest_pixel = (uint8_t)(pixel>>8) * alpha + (*dest_pixel) * one_minus_alpha;
-        ++dest_pixel;
-        *dest_pixel = (uint8_t)(pixel>>16) * alpha + (*dest_pixel) * one_minus_alpha;
-        ++dest_pixel;
-        *dest_pixel += (255 - *dest_pixel) * alpha;
+        uint32_t* dest_pixel = dest->pixels + y*dest->w + x;
+        *dest_pixel = KSBlend32(pixel, *dest_pixel);
     }
     
     static inline void KSBlit(ksprite_t* source, ksprite_t* dest, int x, int y){
+        KPROF_FUNCTION();
         int left = x;
         int top = y;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
         int bottom_clip = KSMax(0, top + source->h - dest->h);
+        int width = source->w - left_clip - right_clip;
+        if(width <= 0) return;
         for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
-            for(int sourcex = left_clip; sourcex < source->w - right_clip; ++sourcex){
-                KSSetPixel(dest, left+sourcex, top+sourcey, *(source->pixels + sourcey*source->w + sourcex));
-            }
+            memcpy(dest->pixels + (top+sourcey)*dest->w + left+left_clip, source->pixels + sourcey*source->w + left_clip, width*sizeof(uint32_t));
         }
     }
     
     static inline void KSBlitBlend(ksprite_t* source, ksprite_t* dest, int x, int y){
+        KPROF_FUNCTION();
         int left = x;
         int top = y;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
         int bottom_clip = KSMax(0, top + source->h - dest->h);
+        int width = source->w - left_clip - right_clip;
+        if(width <= 0) return;
         for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
-            for(int sourcex = left_clip; sourcex < source->w - right_clip; ++sourcex){
-                KSBlendPixel(dest, left+sourcex, top+sourcey, *(source->pixels + sourcey*source->w + sourcex));
+            int row_class = KSRowClass(source, sourcey);
+            uint32_t* dest_row = dest->pixels + (top+sourcey)*dest->w + left+left_clip;
+            uint32_t* source_row = source->pixels + sourcey*source->w + left_clip;
+            if(row_class & KS_ROW_TRANSPARENT) continue;
+            if(row_class & KS_ROW_OPAQUE){
+                memcpy(dest_row, source_row, width*sizeof(uint32_t));
+            }
+            else{
+                ks_blend(dest_row, source_row, width);
             }
         }
     }
     
-    static inline void KSBlitScaled(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy){
+    // Scaled blits work backwards from the destination. The destination rectangle is clipped once, then
+    // each destination pixel steps through the source in 16.16 fixed point, so the cost depends on the
+    // pixels drawn, fractional scales don't leave gaps and negative scales mirror the sprite.
+    typedef struct{
+        int left, top, right, bottom; // clipped destination rectangle, right and bottom exclusive
+        int32_t u, v; // source position of the top left destination pixel's centre, 16.16
+        int32_t ustep, vstep;
+    } ks_scale_t;
+    
+    // offset is added to the source position, -0.5 makes bilinear samples line up with pixel centres
+    static bool KSScaleSetup(ks_scale_t* scale, ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy, double offset){
+        if(scalex == 0 || scaley == 0 || sprite->w == 0 || sprite->h == 0) return false;
         int left = x - originx*scalex;
         int top = y - originy*scaley;
-        for(int sy = 0; sy < sprite->h; sy++){
-            for(int sx = 0; sx < sprite->w; sx++){
-                uint32_t source_pixel = KSGetPixel(sprite, sx, sy);
-                int scaled_sourcex = sx*scalex;
-                int scaled_sourcey = sy*scaley;
-                for(int oy = KSMin(0,scaley); oy < KSMax(scaley,0); oy++){
-                    for(int ox = KSMin(0,scalex); ox < KSMax(scalex,0); ox++){
-                        KSSetPixel(target, left + scaled_sourcex + ox, top + scaled_sourcey + oy, source_pixel);
-                    }
+        double x0 = left + KSMin(0., sprite->w*(double)scalex);
+        double x1 = left + KSMax(0., sprite->w*(double)scalex);
+        double y0 = top + KSMin(0., sprite->h*(double)scaley);
+        double y1 = top + KSMax(0., sprite->h*(double)scaley);
+        // A destination pixel is drawn if its centre is inside the scaled sprite
+        scale->left = KSMax(0, (int)ceil(x0 - 0.5));
+        scale->right = KSMin(target->w, (int)ceil(x1 - 0.5));
+        scale->top = KSMax(0, (int)ceil(y0 - 0.5));
+        scale->bottom = KSMin(target->h, (int)ceil(y1 - 0.5));
+        if(scale->left >= scale->right || scale->top >= scale->bottom) return false;
+        scale->u = (int32_t)floor(((scale->left + 0.5 - left)/scalex + offset)*65536.);
+        scale->v = (int32_t)floor(((scale->top + 0.5 - top)/scaley + offset)*65536.);
+        scale->ustep = (int32_t)(65536./scalex);
+        scale->vstep = (int32_t)(65536./scaley);
+        return true;
+    }
+    
+    // Scratch rows of up to this many entries are kept on the stack, only wider ones are allocated. It has to be the
+    // stack rather than a shared static buffer, kero_raster draws on several threads at once.
+#ifndef KS_SCRATCH_PIXELS
+#define KS_SCRATCH_PIXELS 4096 // 16KB, enough for a 4K wide target
+#endif
+    
+    static void KSBlitScaledInternal(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy, int alpha10){
+        KPROF_FUNCTION();
+        ks_scale_t scale;
+        if(!KSScaleSetup(&scale, sprite, target, x, y, scalex, scaley, originx, originy, 0)) return;
+        KSMarkDirty(target, scale.left, scale.top, scale.right-1, scale.bottom-1);
+        int width = scale.right - scale.left;
+        // Source column for each destination column, worked out once for every row
+        int32_t stack_columns[KS_SCRATCH_PIXELS];
+        int32_t* columns = width <= KS_SCRATCH_PIXELS ? stack_columns : (int32_t*)malloc(width*sizeof(int32_t));
+        if(!columns) return;
+        int32_t u = scale.u;
+        for(int i = 0; i < width; ++i, u += scale.ustep){
+            columns[i] = KSMax(0, KSMin(sprite->w-1, u>>16));
+        }
+        int previous_sy = -1;
+        for(int desty = scale.top; desty < scale.bottom; ++desty){
+            int32_t v = scale.v + (desty - scale.top)*scale.vstep;
+            int sy = KSMax(0, KSMin(sprite->h-1, v>>16));
+            uint32_t* dest_row = target->pixels + desty*target->w + scale.left;
+            uint32_t* source_row = sprite->pixels + sy*sprite->w;
+            if(alpha10){
+                if(KSRowClass(sprite, sy) & KS_ROW_TRANSPARENT) continue;
+                for(int i = 0; i < width; ++i){
+                    uint32_t pixel = source_row[columns[i]];
+                    if(pixel>>24) dest_row[i] = pixel;
                 }
             }
+            else if(sy == previous_sy){
+                // Scaling up repeats source rows, so copy the row we just drew
+                memcpy(dest_row, dest_row - target->w, width*sizeof(uint32_t));
+            }
+            else{
+                for(int i = 0; i < width; ++i){
+                    dest_row[i] = source_row[columns[i]];
+                }
+            }
+            previous_sy = sy;
         }
+        if(columns != stack_columns) free(columns);
+    }
+    
+    static inline void KSBlitScaled(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy){
+        KSBlitScaledInternal(sprite, target, x, y, scalex, scaley, originx, originy, 0);
     }
     
     static inline void KSBlitScaledAlpha10(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy){
-        int left = x - originx*scalex;
-        int top = y - originy*scaley;
-        for(int sy = 0; sy < sprite->h; sy++){
-            for(int sx = 0; sx < sprite->w; sx++){
-                uint32_t source_pixel = KSGetPixel(sprite, sx, sy);
-                int scaled_sourcex = sx*scalex;
-                int scaled_sourcey = sy*scaley;
-                for(int oy = KSMin(0,scaley); oy < KSMax(scaley,0); oy++){
-                    for(int ox = KSMin(0,scalex); ox < KSMax(scalex,0); ox++){
-                        KSSetPixelAlpha10(target, left + scaled_sourcex + ox, top + scaled_sourcey + oy, source_pixel);
-                    }
-                }
-            }
-        }
+        KSBlitScaledInternal(sprite, target, x, y, scalex, scaley, originx, originy, 1);
     }
     
+    // Every scaled blit clips now, this is kept so older code still compiles
     void KSBlitScaledSafe(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy){
-        int left = x - originx*scalex;
-        int top = y - originy*scaley;
-        for(int sy = 0; sy < sprite->h; sy++){
-            for(int sx = 0; sx < sprite->w; sx++){
-                uint32_t source_pixel = KSGetPixel(sprite, sx, sy);
-                int scaled_sourcex = sx*scalex;
-                int scaled_sourcey = sy*scaley;
-                for(int oy = KSMin(0,scaley); oy < KSMax(scaley,0); oy++){
-                    for(int ox = KSMin(0,scalex); ox < KSMax(scalex,0); ox++){
-                        KSSetPixelSafe(target, left + scaled_sourcex + ox, top + scaled_sourcey + oy, source_pixel);
-                    }
+        KSBlitScaledInternal(sprite, target, x, y, scalex, scaley, originx, originy, 0);
+    }
+    
+    // Like KSBlitScaled but filtered. Each source row pair is blended vertically into a padded row
+    // buffer with ks_lerp_rows, then ks_bilinear_row blends horizontally along it. The filtered
+    // pixels, alpha included, replace what was in target.
+    void KSBlitScaledBilinear(ksprite_t* sprite, ksprite_t* target, int x, int y, float scalex, float scaley, int originx, int originy){
+        KPROF_FUNCTION();
+        ks_scale_t scale;
+        if(!KSScaleSetup(&scale, sprite, target, x, y, scalex, scaley, originx, originy, -0.5)) return;
+        KSMarkDirty(target, scale.left, scale.top, scale.right-1, scale.bottom-1);
+        // Two copies of the edge pixel on each side, so the kernels never need to clamp
+        uint32_t stack_row[KS_SCRATCH_PIXELS];
+        uint32_t* row = sprite->w+4 <= KS_SCRATCH_PIXELS ? stack_row : (uint32_t*)malloc((sprite->w+4)*sizeof(uint32_t));
+        if(!row) return;
+        int previous_r0 = -1, previous_r1 = -1;
+        uint32_t previous_f = 0;
+        for(int desty = scale.top; desty < scale.bottom; ++desty){
+            int32_t v = scale.v + (desty - scale.top)*scale.vstep;
+            int r0 = KSMax(0, KSMin(sprite->h-1, v>>16));
+            int r1 = KSMax(0, KSMin(sprite->h-1, (v>>16)+1));
+            uint32_t f = (v>>8) & 0xff;
+            if(r0 == r1) f = 0;
+            if(r0 != previous_r0 || r1 != previous_r1 || f != previous_f){
+                if(f){
+                    ks_lerp_rows(row+2, sprite->pixels + r0*sprite->w, sprite->pixels + r1*sprite->w, sprite->w, f);
+                }
+                else{
+                    memcpy(row+2, sprite->pixels + r0*sprite->w, sprite->w*sizeof(uint32_t));
                 }
+                row[0] = row[1] = row[2];
+                row[sprite->w+2] = row[sprite->w+3] = row[sprite->w+1];
+                previous_r0 = r0;
+                previous_r1 = r1;
+                previous_f = f;
             }
+            ks_bilinear_row(target->pixels + desty*target->w + scale.left, row, scale.right - scale.left, scale.u + 2*65536, scale.ustep);
         }
+        if(row != stack_row) free(row);
     }
     
     void KSBlitAlpha10(ksprite_t* source, ksprite_t* dest, int x, int y){
+        KPROF_FUNCTION();
         int left = x;
         int top = y;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
         int bottom_clip = KSMax(0, top + source->h - dest->h);
+        int width = source->w - left_clip - right_clip;
+        if(width <= 0) return;
         for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
-            for(int sourcex = left_clip; sourcex < source->w - right_clip; ++sourcex){
-                KSSetPixelAlpha10(dest, left+sourcex, top+sourcey, source->pixels[sourcey*source->w + sourcex]);
+            int row_class = KSRowClass(source, sourcey);
+            uint32_t* dest_row = dest->pixels + (top+sourcey)*dest->w + left+left_clip;
+            uint32_t* source_row = source->pixels + sourcey*source->w + left_clip;
+            if(row_class & KS_ROW_TRANSPARENT) continue;
+            if(row_class & KS_ROW_SOLID){
+                memcpy(dest_row, source_row, width*sizeof(uint32_t));
+                continue;
+            }
+            for(int i = 0; i < width; ++i){
+                if(source_row[i]>>24) dest_row[i] = source_row[i];
             }
         }
     }
     
     void KSBlitAlpha10Flip(ksprite_t* source, ksprite_t* dest, int x, int y){
+        KPROF_FUNCTION();
         int left = x;
         int top = y;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
         int bottom_clip = KSMax(0, top + source->h - dest->h);
         for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
+            if(KSRowClass(source, sourcey) & KS_ROW_TRANSPARENT) continue;
             for(int sourcex = left_clip; sourcex < source->w - right_clip; ++sourcex){
                 KSSetPixelAlpha10(dest, left+sourcex, top+sourcey, source->pixels[sourcey*source->w + (source->w-right_clip-sourcex-1)]);
             }
@@ -248,27 +977,26 @@ extern "C"{
     }
     
     void KSBlitColored(ksprite_t* source, ksprite_t* dest, int x, int y, int originx, int originy, uint32_t colour){
+        KPROF_FUNCTION();
         int left = x - originx;
         int top = y - originy;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
         int bottom_clip = KSMax(0, top + source->h - dest->h);
+        int width = source->w - left_clip - right_clip;
+        if(width <= 0) return;
         for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
-            for(int sourcex = left_clip; sourcex < source->w - right_clip; ++sourcex){
-                uint32_t source_pixel = source->pixels[sourcey*source->w + sourcex];
-                float bratio = ((uint8_t)source_pixel)/255.f;
-                float gratio = ((uint8_t)(source_pixel>>8))/255.f;
-                float rratio = ((uint8_t)(source_pixel>>16))/255.f;
-                uint8_t a = (uint8_t)(source_pixel>>24);
-                KSSetPixel(dest, left+sourcex, top+sourcey, (uint32_t)(bratio*((uint8_t)colour)) | (uint32_t)(gratio*((uint8_t)(colour>>8)))<<8 | (uint32_t)(rratio*((uint8_t)(colour>>16)))<<16 | a<<24);
-            }
+            ks_tint(dest->pixels + (top+sourcey)*dest->w + left+left_clip, source->pixels + sourcey*source->w + left_clip, width, colour);
         }
     }
     
     void KSBlitColoredAlpha10(ksprite_t* source, ksprite_t* dest, int x, int y, int originx, int originy, uint32_t colour){
+        KPROF_FUNCTION();
         int left = x - originx;
         int top = y - originy;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
         int left_clip = KSMax(0, -left);
         int right_clip = KSMax(0, left + source->w - dest->w);
         int top_clip = KSMax(0, -top);
@@ -285,24 +1013,154 @@ extern "C"{
         }
     }
     
+    // Run-length encoded sprites, for images that are mostly transparent like full-screen wall layers.
+    // Only visible pixels are stored. Each row is a list of runs, and the gaps between runs are
+    // transparent. Opaque runs (alpha 255) are copied whole, and blend runs hold the partly
+    // transparent pixels, so a blit only costs as much as the pixels it actually draws.
+    // Build one from a loaded sprite with KSRLECreate. The source sprite can be freed afterwards.
+#define KS_RUN_OPAQUE 0
+#define KS_RUN_BLEND 1
+    
+    typedef struct{
+        uint16_t x, length;
+        uint8_t kind;
+        uint32_t offset; // index of the run's first pixel in pixels
+    } ks_run_t;
+    
+    typedef struct{
+        int w, h;
+        uint32_t* pixels;
+        ks_run_t* runs;
+        uint32_t* row_runs; // runs for row y are runs[row_runs[y]] up to runs[row_runs[y+1]]
+    } ksprite_rle_t;
+    
+    static inline int KSRunKind(uint32_t pixel){
+        return pixel>>24 == 0xff ? KS_RUN_OPAQUE : KS_RUN_BLEND;
+    }
+    
+    // Returns false if the sprite is too wide for 16 bit runs or an allocation fails
+    bool KSRLECreate(ksprite_rle_t* rle, ksprite_t* source){
+        memset(rle, 0, sizeof(*rle));
+        if(source->w > 0xffff) return false;
+        // First pass counts, second pass fills in
+        size_t num_runs = 0, num_pixels = 0;
+        for(int pass = 0; pass < 2; ++pass){
+            num_runs = 0;
+            num_pixels = 0;
+            for(int y = 0; y < source->h; ++y){
+                uint32_t* row = source->pixels + y*source->w;
+                if(pass) rle->row_runs[y] = num_runs;
+                int x = 0;
+                while(x < source->w){
+                    if(row[x]>>24 == 0){
+                        ++x;
+                        continue;
+                    }
+                    int kind = KSRunKind(row[x]);
+                    int start = x;
+                    while(x < source->w && row[x]>>24 && KSRunKind(row[x]) == kind && x-start < 0xffff){
+                        ++x;
+                    }
+                    if(pass){
+                        ks_run_t* run = rle->runs + num_runs;
+                        run->x = start;
+                        run->length = x-start;
+                        run->kind = kind;
+                        run->offset = num_pixels;
+                        memcpy(rle->pixels + num_pixels, row + start, (x-start)*sizeof(uint32_t));
+                    }
+                    ++num_runs;
+                    num_pixels += x-start;
+                }
+            }
+            if(!pass){
+                rle->w = source->w;
+                rle->h = source->h;
+                rle->pixels = (uint32_t*)malloc(KSMax(num_pixels, 1)*sizeof(uint32_t));
+                rle->runs = (ks_run_t*)malloc(KSMax(num_runs, 1)*sizeof(ks_run_t));
+                rle->row_runs = (uint32_t*)malloc((source->h+1)*sizeof(uint32_t));
+                if(!rle->pixels || !rle->runs || !rle->row_runs){
+                    free(rle->pixels);
+                    free(rle->runs);
+                    free(rle->row_runs);
+                    memset(rle, 0, sizeof(*rle));
+                    return false;
+                }
+            }
+        }
+        rle->row_runs[rle->h] = num_runs;
+        return true;
+    }
+    
+    void KSRLEFree(ksprite_rle_t* rle){
+        free(rle->pixels);
+        free(rle->runs);
+        free(rle->row_runs);
+        memset(rle, 0, sizeof(*rle));
+    }
+    
+    // Draws every visible pixel as is, like KSBlitAlpha10. If blend is set, partly transparent
+    // pixels are blended like KSBlitBlend instead.
+    static inline void KSRLEBlitInternal(ksprite_rle_t* source, ksprite_t* dest, int x, int y, int blend){
+        KPROF_FUNCTION();
+        int left = x;
+        int top = y;
+        KSMarkDirty(dest, left, top, left+source->w-1, top+source->h-1);
+        int left_clip = KSMax(0, -left);
+        int right = source->w - KSMax(0, left + source->w - dest->w);
+        int top_clip = KSMax(0, -top);
+        int bottom_clip = KSMax(0, top + source->h - dest->h);
+        if(right <= left_clip) return;
+        for(int sourcey = top_clip; sourcey < source->h - bottom_clip; ++sourcey){
+            uint32_t* dest_row = dest->pixels + (top+sourcey)*dest->w + left;
+            ks_run_t* run = source->runs + source->row_runs[sourcey];
+            ks_run_t* last = source->runs + source->row_runs[sourcey+1];
+            for(; run < last && run->x < right; ++run){
+                int start = KSMax(run->x, left_clip);
+                int end = KSMin(run->x + run->length, right);
+                if(end <= start) continue;
+                uint32_t* pixels = source->pixels + run->offset + (start - run->x);
+                if(blend && run->kind == KS_RUN_BLEND){
+                    ks_blend(dest_row + start, pixels, end-start);
+                }
+                else{
+                    memcpy(dest_row + start, pixels, (end-start)*sizeof(uint32_t));
+                }
+            }
+        }
+    }
+    
+    void KSRLEBlitAlpha10(ksprite_rle_t* source, ksprite_t* dest, int x, int y){
+        KSRLEBlitInternal(source, dest, x, y, 0);
+    }
+    
+    void KSRLEBlitBlend(ksprite_rle_t* source, ksprite_t* dest, int x, int y){
+        KSRLEBlitInternal(source, dest, x, y, 1);
+    }
+    
     static inline void KSClear(ksprite_t* s) {
+        KPROF_FUNCTION();
+        KSMarkDirty(s, 0, 0, s->w-1, s->h-1);
         memset(s->pixels, 0, sizeof(s->pixels[0]) * s->w * s->h);
     }
     
     void KSSetAllPixelComponents(ksprite_t* sprite, uint8_t component){
+        KPROF_FUNCTION();
+        KSMarkDirty(sprite, 0, 0, sprite->w-1, sprite->h-1);
         memset(sprite->pixels, component, sprite->w*sprite->h*4);
     }
     
     void KSSetAllPixels(ksprite_t* sprite, uint32_t pixel){
-        for(int i = 0; i < sprite->h*sprite->w; ++i){
-            *(sprite->pixels + i) = pixel;
-        }
+        KPROF_FUNCTION();
+        KSMarkDirty(sprite, 0, 0, sprite->w-1, sprite->h-1);
+        KSFillSpan(sprite->pixels, (size_t)sprite->w*sprite->h, pixel);
     }
     
     static inline void KSDrawLineVertical(ksprite_t* dest, int x, int y0, int y1, uint32_t pixel) {
         if(y0 > y1){
             KSSwap(int, y0, y1);
         }
+        KSMarkDirty(dest, x, y0, x, y1);
         for(; y0 <= y1; ++y0){
             KSSetPixel(dest, x, y0, pixel);
         }
@@ -314,6 +1172,7 @@ extern "C"{
         }
         y0 = Min(dest->h-1, Max(0, y0));
         y1 = Min(dest->h-1, Max(0, y1));
+        KSMarkDirty(dest, x, y0, x, y1);
         for(; y0 <= y1; ++y0){
             KSSetPixel(dest, x, y0, pixel);
         }
@@ -321,6 +1180,8 @@ extern "C"{
     
     // Got this from https://github.com/miloyip/line/blob/master/line_bresenham.c
     void KSDrawLine(ksprite_t* dest, int x0, int y0, int x1, int y1, uint32_t pixel){
+        KPROF_FUNCTION();
+        KSMarkDirty(dest, x0, y0, x1, y1);
         int dx = KSAbsolute(x1 - x0);
         int dy = KSAbsolute(y1 - y0);
         if(dx == 0){
@@ -337,6 +1198,8 @@ extern "C"{
     }
     
     void KSDrawLinef(ksprite_t* dest, float x0, float y0, float x1, float y1, uint32_t pixel){
+        KPROF_FUNCTION();
+        KSMarkDirty(dest, (int)KSMin(x0, x1)-1, (int)KSMin(y0, y1)-1, (int)KSMax(x0, x1)+1, (int)KSMax(y0, y1)+1);
         float length = KSLineLength(x0, y0, x1, y1);
         float dx = (x1-x0)/length;
         float dy = (y1-y0)/length;
@@ -346,11 +1209,13 @@ extern "C"{
     }
     
     void KSDrawRect(ksprite_t* dest, int x1, int y1, int x2, int y2, uint32_t pixel){
+        KPROF_FUNCTION();
         int left = KSMax(0, KSMin(x1, x2));
         int right = KSMin(dest->w-1, KSMax(x1, x2));
         int top = KSMax(0, KSMin(y1, y2));
         int bottom = KSMin(dest->h-1, KSMax(y1, y2));
         if(left > dest->w-1 || right < 0 || top > dest->h-1 || bottom < 0) return;
+        KSMarkDirty(dest, left, top, right, bottom);
         KSDrawLine(dest, left, top, right, top, pixel);
         KSDrawLine(dest, left, bottom, right, bottom, pixel);
         KSDrawLine(dest, left, top, left, bottom, pixel);
@@ -364,9 +1229,8 @@ extern "C"{
         if(right < 0 || left > dest->w-1)return;
         left = KSMax(0, left);
         right = KSMin(dest->w-1, right);
-        for(int x = left; x <= right; ++x){
-            KSSetPixel(dest, x, y, pixel);
-        }
+        KSMarkDirty(dest, left, y, right, y);
+        KSFillSpan(dest->pixels + y*dest->w + left, right-left+1, pixel);
     }
     
     static inline void KSScanLineAlpha(ksprite_t* dest, int y, int x0, int x1, uint32_t pixel){
@@ -376,30 +1240,45 @@ extern "C"{
         if(right < 0 || left > dest->w-1)return;
         left = KSMax(0, left);
         right = KSMin(dest->w-1, right);
-        for(int x = left; x <= right; ++x){
-            KSBlendPixel(dest, x, y, pixel);
-        }
+        KSMarkDirty(dest, left, y, right, y);
+        ks_blend_solid(dest->pixels + y*dest->w + left, right-left+1, pixel);
     }
     
     static inline void KSDrawRectFilled(ksprite_t* dest, int x1, int y1, int x2, int y2, uint32_t pixel){
+        KPROF_FUNCTION();
         int left = KSMax(0, KSMin(x1, x2));
         int right = KSMin(dest->w-1, KSMax(x1, x2));
         int top = KSMax(0, KSMin(y1, y2));
         int bottom = KSMin(dest->h-1, KSMax(y1, y2));
         if(left > dest->w-1 || right < 0 || top > dest->h-1 || bottom < 0) return;
+        KSMarkDirty(dest, left, top, right, bottom);
+        if(left == 0 && right == dest->w-1){
+            // Full width rows are contiguous, so fill them as one span
+            KSFillSpan(dest->pixels + top*dest->w, (size_t)dest->w*(bottom-top+1), pixel);
+            return;
+        }
+        // Decide on streaming from the whole rectangle, not the individual rows
+        int width = right-left+1;
+        int stream = (size_t)width*(bottom-top+1)*sizeof(uint32_t) >= KS_STREAM_BYTES;
         for(int y = top; y < bottom+1; ++y){
-            KSScanLine(dest, y, left, right, pixel);
+            ks_fill(dest->pixels + y*dest->w + left, width, pixel, stream);
         }
     }
     
     static inline void KSDrawRectFilledAlpha(ksprite_t* dest, int x1, int y1, int x2, int y2, uint32_t pixel){
+        KPROF_FUNCTION();
         int left = KSMax(0, KSMin(x1, x2));
         int right = KSMin(dest->w-1, KSMax(x1, x2));
         int top = KSMax(0, KSMin(y1, y2));
         int bottom = KSMin(dest->h-1, KSMax(y1, y2));
         if(left > dest->w-1 || right < 0 || top > dest->h-1 || bottom < 0) return;
+        KSMarkDirty(dest, left, top, right, bottom);
+        if(left == 0 && right == dest->w-1){
+            ks_blend_solid(dest->pixels + top*dest->w, (size_t)dest->w*(bottom-top+1), pixel);
+            return;
+        }
         for(int y = top; y < bottom+1; ++y){
-            KSScanLineAlpha(dest, y, left, right, pixel);
+            ks_blend_solid(dest->pixels + y*dest->w + left, right-left+1, pixel);
         }
     }
     
@@ -458,6 +1337,8 @@ extern "C"{
     }*/
     
     void KSDrawTriangle(ksprite_t* dest, float x0, float y0, float x1, float y1, float x2, float y2, uint32_t pixel){
+        KPROF_FUNCTION();
+        KSMarkDirty(dest, (int)KSMin(x0, KSMin(x1, x2))-1, (int)KSMin(y0, KSMin(y1, y2))-1, (int)KSMax(x0, KSMax(x1, x2))+1, (int)KSMax(y0, KSMax(y1, y2))+1);
         // Sort vertices vertically so v0y <= v1y <= v2y
         if(y0 > y1){
             KSSwap(float, x0, x1);
@@ -488,6 +1369,7 @@ extern "C"{
     }
     
     void KSToGreyScale(ksprite_t* sprite) {
+        KPROF_FUNCTION();
         uint8_t *pixel_it = (uint8_t*)sprite->pixels;
         uint8_t* last_pixel = pixel_it + sprite->w*sprite->h*4;
         uint32_t r, g, b, grey;
@@ -523,6 +1405,8 @@ extern "C"{
     }
     
     void KSBlitMasked(ksprite_t* source, ksprite_t* dest, KMask* mask, int spritex, int spritey, int maskx, int masky, void(*PixelFunc)(ksprite_t*, int, int, uint32_t)){
+        KPROF_FUNCTION();
+        KSMarkDirty(dest, spritex, spritey, spritex+source->w-1, spritey+source->h-1);
         int left_clip = KSMax(0, KSMax(-spritex, -maskx));
         int right_clip = KSMax(0, KSMax(spritex+source->w-dest->w, maskx+mask->w-dest->w));
         int top_clip = KSMax(0, KSMax(-spritey, -masky));
@@ -537,10 +1421,12 @@ extern "C"{
     }
     
     void KSBlitMask(KMask* mask, ksprite_t* dest, int destx, int desty, void(*PixelFunc)(ksprite_t*, int, int, uint32_t)){
+        KPROF_FUNCTION();
         int left = KSMax(0, destx);
         int right = KSMin(dest->w-1, destx + mask->w-1);
         int top = KSMax(0, desty);
         int bottom = KSMin(dest->h-1, desty + mask->h-1);
+        KSMarkDirty(dest, left, top, right, bottom);
         for(int y = top; y < bottom; ++y){
             for(int x = left; x < right; ++x){
                 uint32_t pixel  = mask->pixels[(y-top)*mask->w + (x-left)];
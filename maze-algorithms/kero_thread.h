@@ -0,0 +1,130 @@
+/*
+Kero Thread is the small set of threading calls that maze.h, kero_raster.h and kero_video.h share: threads, mutexes, condition variables, an int that several threads can add to, and the number of CPUs.
+
+On Linux (or with KERO_PLATFORM_HEADLESS) it's pthreads, link with -lpthread. On Windows/Mac it's SDL2, same as Kero Platform.
+*/
+
+#ifndef KERO_THREAD_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include <stdbool.h>
+
+    /*
+     Usage
+
+    static kt_thread_result_t Worker(void* data) {
+        ...
+        return 0;
+    }
+
+    kt_thread_t thread;
+    if(!KTThreadStart(&thread, Worker, data, "worker")) ...
+    KTThreadJoin(thread);
+    */
+
+#if defined(__linux__) || defined(KERO_PLATFORM_HEADLESS)
+
+#include <pthread.h>
+#include <unistd.h>
+    typedef pthread_t kt_thread_t;
+    typedef pthread_mutex_t kt_mutex_t;
+    typedef pthread_cond_t kt_cond_t;
+    typedef volatile int kt_atomic_t;
+    typedef void* kt_thread_result_t;
+#define KTAtomicAdd(a, v) __atomic_fetch_add((a), (v), __ATOMIC_RELAXED)
+#define KTAtomicSet(a, v) __atomic_store_n((a), (v), __ATOMIC_RELAXED)
+#define KTLock(m) pthread_mutex_lock(&(m))
+#define KTUnlock(m) pthread_mutex_unlock(&(m))
+#define KTCondWait(c, m) pthread_cond_wait(&(c), &(m))
+#define KTCondSignal(c) pthread_cond_signal(&(c))
+#define KTCondBroadcast(c) pthread_cond_broadcast(&(c))
+
+    // name is only used by SDL
+    static inline bool KTThreadStart(kt_thread_t* thread, kt_thread_result_t (*function)(void*), void* data, const char* name) {
+        (void)name;
+        return pthread_create(thread, 0, function, data) == 0;
+    }
+
+    static inline void KTThreadJoin(kt_thread_t thread) {
+        pthread_join(thread, 0);
+    }
+
+    static inline void KTMutexInit(kt_mutex_t* mutex) {
+        pthread_mutex_init(mutex, 0);
+    }
+
+    static inline void KTMutexDestroy(kt_mutex_t* mutex) {
+        pthread_mutex_destroy(mutex);
+    }
+
+    static inline void KTCondInit(kt_cond_t* cond) {
+        pthread_cond_init(cond, 0);
+    }
+
+    static inline void KTCondDestroy(kt_cond_t* cond) {
+        pthread_cond_destroy(cond);
+    }
+
+    static inline int KTCPUCount() {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? (int)count : 1;
+    }
+
+#else
+
+#include <SDL2/SDL.h>
+    typedef SDL_Thread* kt_thread_t;
+    typedef SDL_mutex* kt_mutex_t;
+    typedef SDL_cond* kt_cond_t;
+    typedef SDL_atomic_t kt_atomic_t;
+    typedef int kt_thread_result_t;
+#define KTAtomicAdd(a, v) SDL_AtomicAdd((a), (v))
+#define KTAtomicSet(a, v) SDL_AtomicSet((a), (v))
+#define KTLock(m) SDL_LockMutex(m)
+#define KTUnlock(m) SDL_UnlockMutex(m)
+#define KTCondWait(c, m) SDL_CondWait((c), (m))
+#define KTCondSignal(c) SDL_CondSignal(c)
+#define KTCondBroadcast(c) SDL_CondBroadcast(c)
+
+    static inline bool KTThreadStart(kt_thread_t* thread, kt_thread_result_t (*function)(void*), void* data, const char* name) {
+        *thread = SDL_CreateThread(function, name, data);
+        return *thread != 0;
+    }
+
+    static inline void KTThreadJoin(kt_thread_t thread) {
+        SDL_WaitThread(thread, 0);
+    }
+
+    static inline void KTMutexInit(kt_mutex_t* mutex) {
+        *mutex = SDL_CreateMutex();
+    }
+
+    static inline void KTMutexDestroy(kt_mutex_t* mutex) {
+        SDL_DestroyMutex(*mutex);
+    }
+
+    static inline void KTCondInit(kt_cond_t* cond) {
+        *cond = SDL_CreateCond();
+    }
+
+    static inline void KTCondDestroy(kt_cond_t* cond) {
+        SDL_DestroyCond(*cond);
+    }
+
+    static inline int KTCPUCount() {
+        return SDL_GetCPUCount();
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#define KERO_THREAD_H
+#endif
@@ -0,0 +1,386 @@
+/*
+Kero Video records the frames Kero Platform flips to a file or a pipe, as raw BGRA or as Y4M, which ffmpeg and most players read directly.
+
+Each finished frame is copied into one of a pool of buffers and a background thread converts and writes it, so a slow disk or encoder never holds up drawing. If every buffer is still waiting to be written when a frame arrives, that frame is dropped rather than waited for. Drops are counted, printed on stderr as they happen and summed up when recording stops.
+
+Include kero_platform.h first. On Linux link against pthreads (-lpthread). On Windows/Mac the writer is an SDL2 thread.
+*/
+
+#ifndef KERO_VIDEO_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kero_profile.h"
+#include "kero_thread.h"
+
+    // Half a second of frames at 60fps
+#ifndef KV_DEFAULT_BUFFERS
+#define KV_DEFAULT_BUFFERS 30
+#endif
+
+    typedef enum {
+        KV_RAW_BGRA, KV_Y4M
+    } kv_format_t;
+
+    typedef struct {
+        uint64_t frames_written;
+        uint64_t frames_dropped;
+        bool write_failed;
+    } kv_stats_t;
+
+    //------------------------------------------------------------
+
+    /*
+     Usage
+
+    KVRecordStart("maze.y4m", KV_Y4M, 60, 0);
+    ...KPFlip as normal...
+    KVRecordStop();
+    */
+
+    bool KVRecordStart(const char* const path, kv_format_t format, int fps, int num_buffers);
+    /*
+    Starts recording every frame passed to KPFlip/KPFlipRects (it takes over KPSetFrameCallback). Returns false if it's already recording, path can't be opened or the writer thread can't be started.
+    path is a file, "-" for stdout, or a command to pipe into after a |, e.g. "|ffmpeg -y -i - maze.mp4".
+    KV_Y4M is 4:2:0 BT.601 with fps in the header. KV_RAW_BGRA is the frame buffer as it is, which ffmpeg reads with -f rawvideo -pixel_format bgr0 -video_size WxH -framerate fps -i ...
+    The video is the size of the first frame, and the buffers are allocated then. If they can't be, recording stops with a message on stderr. Later frames of another size (after a resize) are cropped or padded with black to fit.
+    num_buffers is how many frames can be waiting to be written before frames are dropped, 0 for KV_DEFAULT_BUFFERS. Each is a whole frame, 3.5MB at 1280x720.
+    Recording is stopped automatically at exit.
+    Headless there's no frame limit, so frames usually arrive faster than they can be written. Set one with KPSetTargetFramerate if every frame is wanted.
+    */
+
+    void KVRecordFrame(const uint32_t* pixels, int w, int h, uint64_t frame, void* user);
+    /*
+    The frame callback KVRecordStart installs. Call it yourself to record frames that don't go through KPFlip.
+    */
+
+    kv_stats_t KVRecordStats();
+    /*
+    How many frames have been written and dropped so far.
+    */
+
+    void KVRecordStop();
+    /*
+    Writes the frames still waiting, closes the file and prints how many frames were written and dropped on stderr.
+    */
+
+    //------------------------------------------------------------
+    // Writer thread
+
+#if _WIN32
+#define KVOpenPipe(command) _popen((command), "wb")
+#define KVClosePipe(file) _pclose(file)
+#else
+#define KVOpenPipe(command) popen((command), "w")
+#define KVClosePipe(file) pclose(file)
+#endif
+
+    // Buffers move from free to queued when a frame is copied in and back when it's been written. Both are rings of
+    // buffer indices, each only ever holds num_buffers at once.
+    static struct {
+        bool recording;
+        bool stopping;
+        FILE* file;
+        bool is_pipe;
+        kv_format_t format;
+        int fps;
+        int w, h; // Of the video, set by the first frame
+        int num_buffers;
+        uint32_t** buffers;
+        int* free_ring;
+        int* queued_ring;
+        unsigned free_head, free_tail;
+        unsigned queued_head, queued_tail;
+        uint8_t* encoded;
+        kt_thread_t thread;
+        kt_mutex_t mutex;
+        kt_cond_t wake;
+        kv_stats_t stats;
+        uint64_t drop_run_start, drop_run_length; // Reported once the run ends, not per frame
+    } kv_recorder;
+
+    // BT.601 studio range, the default every Y4M reader assumes
+    static void KVEncodeY4M(const uint32_t* pixels, int w, int h, uint8_t* out) {
+        uint8_t* y_plane = out;
+        int chroma_w = (w+1)/2;
+        int chroma_h = (h+1)/2;
+        uint8_t* u_plane = out + w*h;
+        uint8_t* v_plane = u_plane + chroma_w*chroma_h;
+        for(int y = 0; y < h; ++y) {
+            const uint32_t* row = pixels + y*w;
+            for(int x = 0; x < w; ++x) {
+                int r = (row[x] >> 16) & 0xff;
+                int g = (row[x] >> 8) & 0xff;
+                int b = row[x] & 0xff;
+                y_plane[y*w + x] = (uint8_t)(((66*r + 129*g + 25*b + 128) >> 8) + 16);
+            }
+        }
+        // Chroma from the average of each 2x2 block, the last row/column is repeated for odd sizes
+        for(int cy = 0; cy < chroma_h; ++cy) {
+            const uint32_t* row0 = pixels + 2*cy*w;
+            const uint32_t* row1 = 2*cy+1 < h ? row0 + w : row0;
+            for(int cx = 0; cx < chroma_w; ++cx) {
+                int x0 = 2*cx;
+                int x1 = x0+1 < w ? x0+1 : x0;
+                uint32_t p[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+                int r = 0, g = 0, b = 0;
+                for(int i = 0; i < 4; ++i) {
+                    r += (p[i] >> 16) & 0xff;
+                    g += (p[i] >> 8) & 0xff;
+                    b += p[i] & 0xff;
+                }
+                r = (r+2) >> 2;
+                g = (g+2) >> 2;
+                b = (b+2) >> 2;
+                u_plane[cy*chroma_w + cx] = (uint8_t)(((-38*r - 74*g + 112*b + 128) >> 8) + 128);
+                v_plane[cy*chroma_w + cx] = (uint8_t)(((112*r - 94*g - 18*b + 128) >> 8) + 128);
+            }
+        }
+    }
+
+    static bool KVWriteFrame(const uint32_t* pixels) {
+        KPROF_FUNCTION();
+        int w = kv_recorder.w;
+        int h = kv_recorder.h;
+        if(kv_recorder.format == KV_RAW_BGRA) {
+            return fwrite(pixels, sizeof(uint32_t), (size_t)w*h, kv_recorder.file) == (size_t)w*h;
+        }
+        size_t size = (size_t)w*h + 2*(size_t)((w+1)/2)*((h+1)/2);
+        KVEncodeY4M(pixels, w, h, kv_recorder.encoded);
+        return fputs("FRAME\n", kv_recorder.file) >= 0 && fwrite(kv_recorder.encoded, 1, size, kv_recorder.file) == size;
+    }
+
+    static kt_thread_result_t KVWriterThread(void* data) {
+        (void)data;
+        KPROF_THREAD_NAME("kero video");
+        KTLock(kv_recorder.mutex);
+        for(;;) {
+            while(kv_recorder.queued_head == kv_recorder.queued_tail && !kv_recorder.stopping) {
+                KTCondWait(kv_recorder.wake, kv_recorder.mutex);
+            }
+            // Stopping still writes everything queued first
+            if(kv_recorder.queued_head == kv_recorder.queued_tail) break;
+            int buffer = kv_recorder.queued_ring[kv_recorder.queued_head++ % kv_recorder.num_buffers];
+            bool failed = kv_recorder.stats.write_failed;
+            KTUnlock(kv_recorder.mutex);
+            bool written = !failed && KVWriteFrame(kv_recorder.buffers[buffer]);
+            KTLock(kv_recorder.mutex);
+            if(written) {
+                ++kv_recorder.stats.frames_written;
+            }
+            else {
+                // Keep taking frames so drawing doesn't start dropping them, but stop writing after the first failure
+                if(!failed) {
+                    fprintf(stderr, "kero_video: writing frame failed, no more frames will be written\n");
+                }
+                kv_recorder.stats.write_failed = true;
+            }
+            kv_recorder.free_ring[kv_recorder.free_tail++ % kv_recorder.num_buffers] = buffer;
+        }
+        KTUnlock(kv_recorder.mutex);
+        return 0;
+    }
+
+    static void KVCloseFile() {
+        if(kv_recorder.is_pipe) {
+            KVClosePipe(kv_recorder.file);
+        }
+        else if(kv_recorder.file == stdout) {
+            fflush(stdout);
+        }
+        else {
+            fclose(kv_recorder.file);
+        }
+        kv_recorder.file = 0;
+    }
+    
+    static void KVFreeBuffers() {
+        if(kv_recorder.buffers) {
+            for(int i = 0; i < kv_recorder.num_buffers; ++i) {
+                free(kv_recorder.buffers[i]);
+            }
+        }
+        free(kv_recorder.buffers);
+        free(kv_recorder.free_ring);
+        free(kv_recorder.queued_ring);
+        free(kv_recorder.encoded);
+        kv_recorder.buffers = 0;
+        kv_recorder.free_ring = 0;
+        kv_recorder.queued_ring = 0;
+        kv_recorder.encoded = 0;
+    }
+    
+    void KVRecordFrame(const uint32_t* pixels, int w, int h, uint64_t frame, void* user) {
+        KPROF_FUNCTION();
+        (void)user;
+        if(!kv_recorder.recording) return;
+        if(!kv_recorder.w) {
+            // The size is only known now, so the header and buffers wait for the first frame
+            kv_recorder.w = w;
+            kv_recorder.h = h;
+            bool allocated = true;
+            for(int i = 0; i < kv_recorder.num_buffers; ++i) {
+                kv_recorder.buffers[i] = (uint32_t*)malloc(sizeof(uint32_t)*w*h);
+                allocated = allocated && kv_recorder.buffers[i];
+            }
+            kv_recorder.encoded = (uint8_t*)malloc((size_t)w*h + 2*(size_t)((w+1)/2)*((h+1)/2));
+            if(!allocated || !kv_recorder.encoded) {
+                fprintf(stderr, "kero_video: out of memory for %d %dx%d frame buffers, recording stopped\n", kv_recorder.num_buffers, w, h);
+                KVRecordStop();
+                return;
+            }
+            if(kv_recorder.format == KV_Y4M) {
+                fprintf(kv_recorder.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, kv_recorder.fps);
+            }
+        }
+        KTLock(kv_recorder.mutex);
+        bool have_buffer = kv_recorder.free_head != kv_recorder.free_tail;
+        int buffer = have_buffer ? kv_recorder.free_ring[kv_recorder.free_head++ % kv_recorder.num_buffers] : 0;
+        KTUnlock(kv_recorder.mutex);
+        if(!have_buffer) {
+            if(!kv_recorder.drop_run_length++) {
+                kv_recorder.drop_run_start = frame;
+            }
+            ++kv_recorder.stats.frames_dropped;
+            return;
+        }
+        if(kv_recorder.drop_run_length) {
+            fprintf(stderr, "kero_video: dropped %llu frames from frame %llu, the writer can't keep up\n",
+                    (unsigned long long)kv_recorder.drop_run_length, (unsigned long long)kv_recorder.drop_run_start);
+            kv_recorder.drop_run_length = 0;
+        }
+        // Copied outside the lock, the writer can't see this buffer until it's queued
+        uint32_t* out = kv_recorder.buffers[buffer];
+        if(w == kv_recorder.w && h == kv_recorder.h) {
+            memcpy(out, pixels, sizeof(uint32_t)*w*h);
+        }
+        else {
+            int copy_w = w < kv_recorder.w ? w : kv_recorder.w;
+            int copy_h = h < kv_recorder.h ? h : kv_recorder.h;
+            for(int y = 0; y < kv_recorder.h; ++y) {
+                uint32_t* row = out + y*kv_recorder.w;
+                int copied = 0;
+                if(y < copy_h) {
+                    memcpy(row, pixels + y*w, sizeof(uint32_t)*copy_w);
+                    copied = copy_w;
+                }
+                memset(row + copied, 0, sizeof(uint32_t)*(kv_recorder.w - copied));
+            }
+        }
+        KTLock(kv_recorder.mutex);
+        kv_recorder.queued_ring[kv_recorder.queued_tail++ % kv_recorder.num_buffers] = buffer;
+        KTCondSignal(kv_recorder.wake);
+        KTUnlock(kv_recorder.mutex);
+    }
+
+    bool KVRecordStart(const char* const path, kv_format_t format, int fps, int num_buffers) {
+        static bool registered = false;
+        if(kv_recorder.recording) return false;
+        if(num_buffers <= 0) {
+            num_buffers = KV_DEFAULT_BUFFERS;
+        }
+        FILE* file;
+        bool is_pipe = false;
+        if(path[0] == '|') {
+            file = KVOpenPipe(path+1);
+            is_pipe = true;
+        }
+        else if(!strcmp(path, "-")) {
+            file = stdout;
+        }
+        else {
+            file = fopen(path, "wb");
+        }
+        if(!file) {
+            fprintf(stderr, "kero_video: can't open %s\n", path);
+            return false;
+        }
+        memset(&kv_recorder.stats, 0, sizeof(kv_recorder.stats));
+        kv_recorder.file = file;
+        kv_recorder.is_pipe = is_pipe;
+        kv_recorder.format = format;
+        kv_recorder.fps = fps > 0 ? fps : 60;
+        kv_recorder.w = kv_recorder.h = 0;
+        kv_recorder.num_buffers = num_buffers;
+        kv_recorder.buffers = (uint32_t**)calloc(num_buffers, sizeof(uint32_t*));
+        kv_recorder.free_ring = (int*)malloc(num_buffers*sizeof(int));
+        kv_recorder.queued_ring = (int*)malloc(num_buffers*sizeof(int));
+        if(!kv_recorder.buffers || !kv_recorder.free_ring || !kv_recorder.queued_ring) {
+            fprintf(stderr, "kero_video: out of memory for %d buffers\n", num_buffers);
+            KVFreeBuffers();
+            KVCloseFile();
+            return false;
+        }
+        for(int i = 0; i < num_buffers; ++i) {
+            kv_recorder.free_ring[i] = i;
+        }
+        kv_recorder.free_head = 0;
+        kv_recorder.free_tail = num_buffers;
+        kv_recorder.queued_head = kv_recorder.queued_tail = 0;
+        kv_recorder.drop_run_length = 0;
+        kv_recorder.stopping = false;
+        KTMutexInit(&kv_recorder.mutex);
+        KTCondInit(&kv_recorder.wake);
+        if(!KTThreadStart(&kv_recorder.thread, KVWriterThread, 0, "kero video")) {
+            KTMutexDestroy(&kv_recorder.mutex);
+            KTCondDestroy(&kv_recorder.wake);
+            fprintf(stderr, "kero_video: can't start the writer thread\n");
+            KVFreeBuffers();
+            KVCloseFile();
+            return false;
+        }
+        kv_recorder.recording = true;
+        if(!registered) {
+            // main.c and friends exit() straight from the event loop
+            atexit(KVRecordStop);
+            registered = true;
+        }
+        KPSetFrameCallback(KVRecordFrame, 0);
+        return true;
+    }
+
+    kv_stats_t KVRecordStats() {
+        if(!kv_recorder.recording) return kv_recorder.stats;
+        KTLock(kv_recorder.mutex);
+        kv_stats_t stats = kv_recorder.stats;
+        KTUnlock(kv_recorder.mutex);
+        return stats;
+    }
+
+    void KVRecordStop() {
+        if(!kv_recorder.recording) return;
+        KPSetFrameCallback(0, 0);
+        KTLock(kv_recorder.mutex);
+        kv_recorder.stopping = true;
+        KTCondSignal(kv_recorder.wake);
+        KTUnlock(kv_recorder.mutex);
+        KTThreadJoin(kv_recorder.thread);
+        KTMutexDestroy(&kv_recorder.mutex);
+        KTCondDestroy(&kv_recorder.wake);
+        kv_recorder.recording = false;
+        if(kv_recorder.drop_run_length) {
+            fprintf(stderr, "kero_video: dropped %llu frames from frame %llu, the writer can't keep up\n",
+                    (unsigned long long)kv_recorder.drop_run_length, (unsigned long long)kv_recorder.drop_run_start);
+            kv_recorder.drop_run_length = 0;
+        }
+        KVCloseFile();
+        KVFreeBuffers();
+        fprintf(stderr, "kero_video: wrote %llu frames, dropped %llu\n",
+                (unsigned long long)kv_recorder.stats.frames_written, (unsigned long long)kv_recorder.stats.frames_dropped);
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#define KERO_VIDEO_H
+#endif
@@ -1,32 +1,49 @@
 #include "kero_math.h"
 #include "kero_platform.h"
+#include "kero_video.h"
 #include "kero_sprite.h"
+#include "kero_hud.h"
+#include "maze.h"
+#include "maze_render.h"
 #include <time.h>
 
-ksprite_t frame_buffer;
+// kp_frame_buffer has the same layout as ksprite_t, so this stays right through resizes
+ksprite_t* frame_buffer = (ksprite_t*)&kp_frame_buffer;
+
+// H shows frame times in the top right corner, MAZE_HUD=1 starts with them showing. See kero_hud.h
+bool show_hud = false;
+
+// Call just before each flip
+static void MazeHUD() {
+    KHRecordFrame();
+    if(show_hud) {
+        KHDraw(frame_buffer, frame_buffer->w - KH_WIDTH - 8, 8);
+    }
+}
 
 int main(int argc, char* argv[]) {
     srand(time(0));
     
     KPInit(1280, 720, "Mazes Article");
     
-    frame_buffer.pixels = kp_frame_buffer.pixels;
-    frame_buffer.w = kp_frame_buffer.w;
-    frame_buffer.h = kp_frame_buffer.h;
+    // MAZE_RECORD=maze.y4m ./a.out records every frame, a path ending in .raw gets raw BGRA instead. See kero_video.h
+    const char* record = getenv("MAZE_RECORD");
+    if(record) {
+        size_t length = strlen(record);
+        kv_format_t format = length > 4 && !strcmp(record + length-4, ".raw") ? KV_RAW_BGRA : KV_Y4M;
+        KVRecordStart(record, format, 60, 0);
+        // Headless frames aren't limited and come far faster than they can be written, so most would be dropped
+        if(kp_headless) {
+            KPSetTargetFramerate(60);
+        }
+    }
+    show_hud = getenv("MAZE_HUD") != 0;
     
     // Start of article code
     
-    typedef struct {
-        int width, height;
-        uint8_t* cells;
-    } maze_t;
-    
-# define MAZE_UP 1
-# define MAZE_RIGHT 2
-# define MAZE_DOWN 4
-# define MAZE_LEFT 8
-# define NUM_DIRECTIONS 4
-#define CELL_VISITED 128
+    // maze_t and the MAZE_UP/RIGHT/DOWN/LEFT and CELL_VISITED flags are in maze.h
+    // MazeCount lines only do anything when built with -DMAZE_COUNTERS
+    // MazeDraw (maze_render.h) draws the walls the same as a KSDrawLine for each cell without MAZE_UP/MAZE_RIGHT
     
     // Recursive Backtracker
 #if 0
@@ -40,32 +57,28 @@ int main(int argc, char* argv[]) {
     // Step 1: Select a random point
     cell_stack[0] = rand() % maze.width*maze.height;
     maze.cells[cell_stack[0]] |= CELL_VISITED;
+    MazeCount(maze_counters, rng_calls, 1);
     
     // Step 2: Move and connect to a random unvisited neighbouring cell. Repeat until the current cell has no unvisited neighbours.
     do {
         int x = cell_stack[cell_stack_top]%maze.width;
         int y = cell_stack[cell_stack_top]/maze.width;
         // Draw the maze
-        KSSetAllPixels(&frame_buffer, 0xffffffff);
+        KSSetAllPixels(frame_buffer, 0xffffffff);
         int size = 10;
-        KSDrawRectFilled(&frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff00ff00);
-        for(int y = 0; y < maze.height; ++y) {
-            for(int x = 0; x < maze.width; ++x) {
-                if( !(maze.cells[x + y*maze.width] & MAZE_UP) ) {
-                    KSDrawLine(&frame_buffer, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
-                }
-                if( !(maze.cells[x + y*maze.width] & MAZE_RIGHT) ) {
-                    KSDrawLine(&frame_buffer, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
-                }
-            }
-        }
+        KSDrawRectFilled(frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff00ff00);
+        MazeDraw(frame_buffer, &maze, 0, 0, size, 0xff000000);
+        MazeHUD();
         KPFlip();
+        MazeCountersLive(&maze_counters);
         
         while( (y < maze.height-1 && !(maze.cells[x + (y+1)*maze.width] & CELL_VISITED) ) || (y > 0 && !(maze.cells[x + (y-1)*maze.width] & CELL_VISITED) ) || (x < maze.width-1 && !(maze.cells[x+1 + y*maze.width] & CELL_VISITED) ) || (x > 0 && !(maze.cells[x-1 + y*maze.width] & CELL_VISITED) ) ) {
             int direction = rand();
             bool connected = false;
+            MazeCount(maze_counters, rng_calls, 1);
             for(int neighbour_checks = 0; neighbour_checks < NUM_DIRECTIONS && !connected; ++neighbour_checks) {
                 direction = (direction+1)%4;
+                MazeCount(maze_counters, neighbour_probes, 1);
                 switch(direction) {
                     
                     case 0: { // Up
@@ -104,30 +117,27 @@ int main(int argc, char* argv[]) {
                         }
                     }break;
                 }
+                MazeCount(maze_counters, failed_directions, !connected);
             }
             if(connected) {
                 cell_stack[++cell_stack_top] = x + y*maze.width;
                 maze.cells[x + y*maze.width] |= CELL_VISITED;
+                MazeCount(maze_counters, cells_carved, 1);
+                MazeCountMax(maze_counters, max_depth, cell_stack_top+1);
                 // Draw the maze
-                KSSetAllPixels(&frame_buffer, 0xffffffff);
+                KSSetAllPixels(frame_buffer, 0xffffffff);
                 int size = 10;
-                KSDrawRectFilled(&frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff00ff00);
-                for(int y = 0; y < maze.height; ++y) {
-                    for(int x = 0; x < maze.width; ++x) {
-                        if( !(maze.cells[x + y*maze.width] & MAZE_UP) ) {
-                            KSDrawLine(&frame_buffer, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
-                        }
-                        if( !(maze.cells[x + y*maze.width] & MAZE_RIGHT) ) {
-                            KSDrawLine(&frame_buffer, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
-                        }
-                    }
-                }
+                KSDrawRectFilled(frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff00ff00);
+                MazeDraw(frame_buffer, &maze, 0, 0, size, 0xff000000);
+                MazeHUD();
                 KPFlip();
+                MazeCountersLive(&maze_counters);
             }
         }
         
         // Step 3: Backtrack to each previously visited cell in order until one with an unvisited neighbour is found. Go to step 2.
         // Step 4: When you return to the first cell, every cell has been visited. End.
+        MazeCount(maze_counters, backtracks, 1);
     } while(--cell_stack_top > 0);
     
     free(cell_stack);
@@ -147,6 +157,7 @@ int main(int argc, char* argv[]) {
     // Step 1: Select a random point, mark as visited and add it to the list of visited cells.
     visited_cells[0] = rand() % (maze.width*maze.height);
     maze.cells[visited_cells[0]] |= CELL_VISITED;
+    MazeCount(maze_counters, rng_calls, 1);
     
     // Step 2: Until the list of visited cells is empty. . .
     while(num_visited_cells > 0) {
@@ -154,6 +165,7 @@ int main(int argc, char* argv[]) {
         // Step 3: Select a random cell from the list of visited cells.
         int selected = rand()%num_visited_cells;
         int cell = visited_cells[selected];
+        MazeCount(maze_counters, rng_calls, 1);
         int x = cell%maze.width;
         int y = cell/maze.width;
         
@@ -163,13 +175,16 @@ int main(int argc, char* argv[]) {
             for(int i = selected; i < num_visited_cells; ++i) {
                 visited_cells[i] = visited_cells[i+1];
             }
+            MazeCount(maze_counters, backtracks, 1);
         }
         // Step 5: Connect to a random unvisited neighbour of the current cell, mark that neighbour as visited and add it to the list. Go to (2)
         else {
             int direction = rand();
             bool connected = false;
+            MazeCount(maze_counters, rng_calls, 1);
             for(int neighbour_checks = 0; neighbour_checks < NUM_DIRECTIONS && !connected; ++neighbour_checks) {
                 direction = (direction+1)%4;
+                MazeCount(maze_counters, neighbour_probes, 1);
                 switch(direction) {
                     
                     case 0: { // Up
@@ -208,29 +223,25 @@ int main(int argc, char* argv[]) {
                         }
                     }break;
                 }
+                MazeCount(maze_counters, failed_directions, !connected);
             }
             visited_cells[num_visited_cells++] = x + y*maze.width;
             maze.cells[x + y*maze.width] |= CELL_VISITED;
+            MazeCount(maze_counters, cells_carved, 1);
+            MazeCountMax(maze_counters, max_depth, num_visited_cells);
             
             // Draw the maze
-            KSSetAllPixels(&frame_buffer, 0xffffffff);
+            KSSetAllPixels(frame_buffer, 0xffffffff);
             int size = 10;
             for(int i = 0; i < num_visited_cells; ++i) {
                 int x = visited_cells[i]%maze.width;
                 int y = visited_cells[i]/maze.width;
-                KSDrawRectFilled(&frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff888888);
-            }
-            for(int y = 0; y < maze.height; ++y) {
-                for(int x = 0; x < maze.width; ++x) {
-                    if( !(maze.cells[x + y*maze.width] & MAZE_UP) ) {
-                        KSDrawLine(&frame_buffer, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
-                    }
-                    if( !(maze.cells[x + y*maze.width] & MAZE_RIGHT) ) {
-                        KSDrawLine(&frame_buffer, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
-                    }
-                }
+                KSDrawRectFilled(frame_buffer, x*size, y*size, (x+1)*size, (y+1)*size, 0xff888888);
             }
+            MazeDraw(frame_buffer, &maze, 0, 0, size, 0xff000000);
+            MazeHUD();
             KPFlip();
+            MazeCountersLive(&maze_counters);
         }
     }
     
@@ -240,47 +251,59 @@ int main(int argc, char* argv[]) {
 #endif
     
     // Draw the maze
-    KSSetAllPixels(&frame_buffer, 0xffffffff);
+    KSSetAllPixels(frame_buffer, 0xffffffff);
     int size = 10;
-    for(int y = 0; y < maze.height; ++y) {
-        for(int x = 0; x < maze.width; ++x) {
-            if( !(maze.cells[x + y*maze.width] & MAZE_UP) ) {
-                KSDrawLine(&frame_buffer, x*size, (y+1)*size, (x+1)*size, (y+1)*size, 0xff000000);
-            }
-            if( !(maze.cells[x + y*maze.width] & MAZE_RIGHT) ) {
-                KSDrawLine(&frame_buffer, (x+1)*size, y*size, (x+1)*size, (y+1)*size, 0xff000000);
-            }
-        }
-    }
+    MazeDraw(frame_buffer, &maze, 0, 0, size, 0xff000000);
+    MazeHUD();
     KPFlip();
     
     // End of article code
     
+#ifdef MAZE_COUNTERS
+    fprintf(stderr, "\n");
+    MazeCountersJSON(stdout, &maze_counters);
+    printf("\n");
+    fflush(stdout);
+#endif
+    
+    // Nothing changes from here on, so only send what gets drawn (nothing, unless the window is resized)
+    ks_dirty_t dirty = {0};
+    frame_buffer->dirty = &dirty;
+    
     bool game_running = true;
     while(game_running) {
-        while(KPEventsQueued()) {
-            kp_event_t* e = KPNextEvent();
+        kp_event_t events[64];
+        int num_events = KPDrainEvents(events, 64);
+        for(int i = 0; i < num_events; ++i) {
+            kp_event_t* e = &events[i];
             switch(e->type) {
                 case KPEVENT_KEY_PRESS:{
                     switch(e->key) {
                         case KEY_ESCAPE:{
                             exit(0);
                         }break;
+                        case KEY_H:{
+                            show_hud = !show_hud;
+                            if(!show_hud) {
+                                // Draw the maze again where the overlay was
+                                KSSetAllPixels(frame_buffer, 0xffffffff);
+                                MazeDraw(frame_buffer, &maze, 0, 0, size, 0xff000000);
+                            }
+                        }break;
                     }
                 }break;
                 case KPEVENT_RESIZE:{
-                    frame_buffer.pixels = kp_frame_buffer.pixels;
-                    frame_buffer.w = kp_frame_buffer.w;
-                    frame_buffer.h = kp_frame_buffer.h;
+                    KSMarkDirty(frame_buffer, 0, 0, frame_buffer->w-1, frame_buffer->h-1);
                 }break;
                 case KPEVENT_QUIT:{
                     exit(0);
                 }break;
             }
-            KPFreeEvent(e);
         }
         
-        KPFlip();
+        MazeHUD();
+        KPFlipRects((kp_rect_t*)dirty.rects, dirty.count);
+        dirty.count = 0;
     }
     
     return 0;
@@ -0,0 +1,1463 @@
+/*
+Maze is the non-visual version of the article algorithms. Each generator runs on a maze_t and keeps all of its state in a maze_generator_t so it can be stepped one carve at a time or run to completion.
+
+Maze also has a batch API for generating lots of small mazes quickly. Every worker thread owns an arena which is reset between jobs, so once the arenas have grown to fit the largest job no more heap calls are made.
+
+Giant grids can be allocated with MazeAllocLarge, which can back them with 2MB huge pages and spread or bind them across NUMA nodes. Long runs can be checkpointed to a file and resumed after a crash, giving exactly the same maze as an uninterrupted run.
+
+Binary Tree and Sidewinder visit every cell in the same order no matter what they carve, so several mazes of the same size can be generated in lock step, one maze per SIMD lane. The batch API does this automatically for runs of MAZE_LANES identical-size jobs.
+*/
+
+#ifndef MAZE_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "kero_profile.h"
+#include "kero_thread.h"
+
+    typedef struct {
+        int width, height;
+        uint8_t* cells;
+    } maze_t;
+
+#define MAZE_UP 1
+#define MAZE_RIGHT 2
+#define MAZE_DOWN 4
+#define MAZE_LEFT 8
+#define NUM_DIRECTIONS 4
+#define CELL_VISITED 128
+
+    typedef enum {
+        MAZE_RECURSIVE_BACKTRACKER, MAZE_PRIMS, MAZE_BINARY_TREE, MAZE_SIDEWINDER, MAZE_NUM_ALGORITHMS
+    } maze_algorithm_t;
+
+    // Define MAZE_COUNTERS before including to count what the generators do. Without it the counters stay at 0 and cost nothing.
+    typedef struct {
+        uint64_t cells_carved;
+        uint64_t neighbour_probes; // Directions tried when looking for an unvisited neighbour
+        uint64_t failed_directions; // Directions tried that were off the grid or already visited
+        uint64_t backtracks; // Cells popped off the stack (Recursive Backtracker) or removed from the list (Prim's)
+        uint64_t rng_calls;
+        int64_t max_depth; // Largest stack/list size
+    } maze_counters_t;
+
+#ifdef MAZE_COUNTERS
+#define MazeCount(counters, field, n) ((counters).field += (n))
+#define MazeCountMax(counters, field, value) do { if((int64_t)(value) > (counters).field) (counters).field = (value); } while(0)
+#else
+#define MazeCount(counters, field, n) ((void)0)
+#define MazeCountMax(counters, field, value) ((void)0)
+#endif
+
+    typedef struct {
+        maze_t* maze;
+        maze_algorithm_t algorithm;
+        uint64_t rng;
+        int64_t* cells; // Recursive Backtracker: the cell stack. Prim's: the list of visited cells.
+        int64_t num_cells;
+        int64_t cursor; // Binary Tree/Sidewinder: the next cell to visit
+        int run_start; // Sidewinder: x of the first cell in the current run
+        uint64_t* dirty_cells; // Checkpointing: one bit per MAZE_CHECKPOINT_PAGE bytes of maze cells/scratch changed since the last checkpoint. 0 when not checkpointing.
+        uint64_t* dirty_scratch;
+        int64_t num_dirty;
+        maze_counters_t counters;
+    } maze_generator_t;
+
+    // Flags for MazeAllocLarge. Ignored on platforms other than Linux.
+    typedef enum {
+        MAZE_MEMORY_DEFAULT = 0,
+        MAZE_MEMORY_HUGE_PAGES = 1, // Transparent huge pages (madvise)
+        MAZE_MEMORY_EXPLICIT_HUGE_PAGES = 2, // Reserved huge pages (MAP_HUGETLB), falls back to transparent huge pages if none are free
+        MAZE_MEMORY_INTERLEAVE = 4, // Spread pages over every NUMA node
+        MAZE_MEMORY_BIND = 8 // Keep pages on one NUMA node
+    } maze_memory_flags_t;
+
+    typedef struct {
+        uint8_t* memory;
+        size_t capacity, used;
+        unsigned memory_flags;
+        int node;
+    } maze_arena_t;
+
+    typedef struct {
+        int width, height;
+        maze_algorithm_t algorithm;
+        uint64_t seed;
+    } maze_job_t;
+
+    typedef struct maze_checkpoint_s maze_checkpoint_t;
+
+    typedef void (*maze_job_callback_t)(const maze_job_t* job, int job_index, const maze_t* maze, void* user);
+
+    //------------------------------------------------------------
+
+    /*
+     Usage
+
+    Include this file. On Linux link against pthreads (-lpthread). On Windows/Mac the batch API uses SDL2 threads, same as Kero Platform.
+    */
+
+    uint64_t MazeRandom(uint64_t* rng);
+    /*
+    Returns the next number from a xorshift64* generator. Used instead of rand() so that every generator has its own state and the same seed always gives the same maze.
+    */
+
+    void MazeGeneratorInit(maze_generator_t* generator, maze_t* maze, maze_algorithm_t algorithm, uint64_t seed, int64_t* scratch);
+    /*
+    maze->cells must be cleared to 0 before calling.
+    scratch must have room for maze->width*maze->height cells, MazeScratchSize() bytes.
+    Picks the random starting cell and marks it as visited.
+    */
+
+    bool MazeGeneratorStep(maze_generator_t* generator);
+    /*
+    Carves at most one passage (or backtracks/removes one cell from the list).
+    Returns false when the maze is finished.
+    */
+
+    void MazeGenerate(maze_t* maze, maze_algorithm_t algorithm, uint64_t seed, int64_t* scratch);
+    /*
+    Runs a generator to completion. With MAZE_COUNTERS its counts are added to the global maze_counters, so don't call from several threads at once (the batch API keeps its own counts).
+    */
+
+    void MazeCountersAdd(maze_counters_t* total, const maze_counters_t* counters);
+    /*
+    Adds the counts together, max_depth is the larger of the two.
+    */
+
+    void MazeCountersJSON(FILE* file, const maze_counters_t* counters);
+    /*
+    Writes the counters as a JSON object.
+    */
+
+    void MazeCountersLive(const maze_counters_t* counters);
+    /*
+    Rewrites a one line summary on stderr. Call once per frame in visual runs.
+    Does nothing unless MAZE_COUNTERS is defined.
+    */
+
+    void MazeGenerateLanes(maze_t* mazes, maze_algorithm_t algorithm, const uint64_t* seeds, uint8_t* scratch);
+    /*
+    Generates MAZE_LANES mazes of the same size at once. Only MAZE_BINARY_TREE and MAZE_SIDEWINDER.
+    mazes[0].width/height is used for every maze, each maze needs its own cells (they don't need to be cleared).
+    scratch must have room for MazeLanesScratchSize() bytes and be 64 byte aligned.
+    Gives exactly the same mazes as calling MazeGenerate with each seed.
+    */
+
+    void* MazeAllocLarge(size_t size, unsigned flags, int node);
+    /*
+    Returns size bytes of zeroed memory, or 0 on failure. Use instead of calloc for big maze cells and generator scratch.
+    flags is a combination of maze_memory_flags_t. node is the NUMA node for MAZE_MEMORY_BIND.
+    MAZE_MEMORY_DEFAULT is the same as calloc.
+    */
+
+    void MazeFreeLarge(void* memory, size_t size, unsigned flags);
+    /*
+    size and flags must be the same as the MazeAllocLarge call.
+    */
+
+    int MazeNumaNodes();
+    /*
+    Returns the number of NUMA nodes, 1 on machines without NUMA or platforms other than Linux.
+    */
+
+    bool MazeBindThreadToNode(int node);
+    /*
+    Restricts the calling thread to the CPUs of a NUMA node.
+    */
+
+    void MazeArenaReset(maze_arena_t* arena, size_t size);
+    /*
+    Frees everything allocated from the arena and makes sure it has room for at least size bytes. Only touches the heap when the arena has to grow.
+    Set arena->memory_flags/node before the first reset to grow the arena with MazeAllocLarge flags.
+    */
+
+    void* MazeArenaAlloc(maze_arena_t* arena, size_t size);
+    /*
+    Returns 64 byte aligned memory from the arena or 0 if the arena is full.
+    */
+
+    void MazeArenaFree(maze_arena_t* arena);
+
+    bool MazeGenerateInArena(maze_t* maze, const maze_job_t* job, maze_arena_t* arena, maze_counters_t* counters);
+    /*
+    Resets the arena, then allocates both the cells and the scratch memory from it and generates the maze. The cells are valid until the arena is next reset.
+    counters can be 0, otherwise the generator's counts are added to it.
+    */
+
+    bool MazeBatchInit(int num_threads, unsigned memory_flags);
+    /*
+    Starts the worker threads. num_threads includes the calling thread. 0 uses one thread per CPU. Jobs are shared between the workers that actually start, so fewer than asked for isn't an error, it only returns false if the workers can't be allocated.
+    memory_flags are used for the worker arenas. With MAZE_MEMORY_BIND the workers are spread over the NUMA nodes, each pinned to its node's CPUs with its arena bound to the same node.
+    */
+
+    void MazeBatchRun(const maze_job_t* jobs, int num_jobs, maze_job_callback_t callback, void* user);
+    /*
+    Generates every job and returns once they are all done. callback is called once per job from whichever thread generated it, the maze is only valid for the duration of the call so copy out anything you need.
+    Calls MazeBatchInit(0, MAZE_MEMORY_DEFAULT) first if it hasn't been called.
+    */
+
+    void MazeBatchShutdown();
+    /*
+    Stops the worker threads and frees their arenas.
+    */
+
+    void MazeBatchCounters(maze_counters_t* counters);
+    /*
+    Sets counters to the totals for every job run since MazeBatchInit.
+    */
+
+    bool MazeCheckpointStart(maze_checkpoint_t* checkpoint, maze_generator_t* generator, uint64_t seed, const char* path, size_t budget, int interval);
+    /*
+    Creates a new checkpoint file for a generator. Call straight after MazeGeneratorInit.
+    A checkpoint is taken every interval seconds, or sooner once budget bytes of cells/scratch have changed. 0 for either uses the default.
+    Taking one copies at most budget bytes (plus the pages one step changes) on the calling thread, and a background thread writes it. If the disk can't keep up, stepping waits for the last checkpoint to be written rather than letting the next one grow past the budget.
+    */
+
+    bool MazeCheckpointReadJob(const char* path, maze_job_t* job);
+    /*
+    Reads the size, algorithm and seed from a checkpoint file so you can allocate the maze before resuming.
+    */
+
+    bool MazeCheckpointResume(maze_checkpoint_t* checkpoint, maze_generator_t* generator, maze_t* maze, int64_t* scratch, const char* path, size_t budget, int interval);
+    /*
+    Restores the generator from the last complete checkpoint in the file and carries on appending to it. A checkpoint that was only partly written when the process died is thrown away.
+    maze must be the size from MazeCheckpointReadJob with its cells cleared to 0. scratch is the same as for MazeGeneratorInit.
+    */
+
+    bool MazeCheckpointStep(maze_checkpoint_t* checkpoint);
+    /*
+    Same as MazeGeneratorStep, taking a checkpoint when one is due.
+    */
+
+    bool MazeCheckpointFinish(maze_checkpoint_t* checkpoint);
+    /*
+    Writes a final checkpoint, waits for it to reach the disk and closes the file. Returns false if any write failed.
+    */
+
+    /*
+    Example checkpoint code:
+
+    maze_job_t job;
+    if(MazeCheckpointReadJob("maze.ckpt", &job)) {
+        (allocate maze and scratch for job.width*job.height)
+        MazeCheckpointResume(&checkpoint, &generator, &maze, scratch, "maze.ckpt", 0, 0);
+    }
+    else {
+        MazeGeneratorInit(&generator, &maze, job.algorithm, job.seed, scratch);
+        MazeCheckpointStart(&checkpoint, &generator, job.seed, "maze.ckpt", 0, 0);
+    }
+    while(MazeCheckpointStep(&checkpoint));
+    MazeCheckpointFinish(&checkpoint);
+    */
+
+    /*
+    Example batch code:
+
+    void Consume(const maze_job_t* job, int job_index, const maze_t* maze, void* user) {
+        memcpy(((uint8_t**)user)[job_index], maze->cells, maze->width*maze->height);
+    }
+
+    maze_job_t jobs[1000];
+    for(int i = 0; i < 1000; ++i) {
+        jobs[i] = (maze_job_t){ 32, 32, MAZE_RECURSIVE_BACKTRACKER, i };
+    }
+    MazeBatchRun(jobs, 1000, Consume, outputs);
+    */
+
+    //------------------------------------------------------------
+
+#define MAZE_ARENA_ALIGNMENT 64
+#define MAZE_LANES 8
+#define MAZE_BATCH_CHUNK MAZE_LANES
+
+    static inline size_t MazeScratchSize(int width, int height) {
+        return (size_t)width*height*sizeof(int64_t);
+    }
+
+    static inline size_t MazeLanesScratchSize(int width, int height) {
+        return (size_t)width*height*MAZE_LANES;
+    }
+
+    static inline bool MazeLanesSupported(maze_algorithm_t algorithm) {
+        return algorithm == MAZE_BINARY_TREE || algorithm == MAZE_SIDEWINDER;
+    }
+
+    uint64_t MazeRandom(uint64_t* rng) {
+        uint64_t x = *rng;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *rng = x;
+        return x * 0x2545F4914F6CDD1DULL;
+    }
+
+    // splitmix64, so that neighbouring seeds (0, 1, 2...) give unrelated mazes and a seed of 0 still works
+    static inline uint64_t MazeSeed(uint64_t seed) {
+        uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        return z ? z : 1;
+    }
+
+#define MAZE_CHECKPOINT_PAGE 4096
+
+    static inline void MazeMarkDirty(uint64_t* dirty, int64_t* num_dirty, int64_t byte) {
+        int64_t page = byte / MAZE_CHECKPOINT_PAGE;
+        uint64_t bit = 1ULL << (page & 63);
+        if(!(dirty[page >> 6] & bit)) {
+            dirty[page >> 6] |= bit;
+            ++*num_dirty;
+        }
+    }
+
+    // Record that a cell/scratch entry changed, for checkpointing
+    static inline void MazeTouchCell(maze_generator_t* generator, int64_t cell) {
+        if(generator->dirty_cells && cell < (int64_t)generator->maze->width*generator->maze->height) {
+            MazeMarkDirty(generator->dirty_cells, &generator->num_dirty, cell);
+        }
+    }
+
+    static inline void MazeTouchScratch(maze_generator_t* generator, int64_t index) {
+        if(generator->dirty_scratch) {
+            MazeMarkDirty(generator->dirty_scratch, &generator->num_dirty, index*(int64_t)sizeof(int64_t));
+        }
+    }
+
+    // Connect to a random unvisited neighbour. Same direction order as the article code: pick a random direction, then try the others in turn.
+    // Returns the neighbour's index or -1 if every neighbour has been visited.
+    static inline int64_t MazeCarveRandom(maze_t* maze, int64_t cell, uint64_t* rng, maze_counters_t* counters) {
+        int x = (int)(cell%maze->width);
+        int y = (int)(cell/maze->width);
+        unsigned direction = (unsigned)(MazeRandom(rng)>>32);
+        MazeCount(*counters, rng_calls, 1);
+        for(int neighbour_checks = 0; neighbour_checks < NUM_DIRECTIONS; ++neighbour_checks) {
+            direction = (direction+1)%4;
+            MazeCount(*counters, neighbour_probes, 1);
+            switch(direction) {
+
+                case 0: { // Up
+                    if( y < maze->height-1 && !(maze->cells[cell + maze->width] & CELL_VISITED) ) {
+                        maze->cells[cell] |= MAZE_UP;
+                        cell += maze->width;
+                        maze->cells[cell] |= MAZE_DOWN | CELL_VISITED;
+                        return cell;
+                    }
+                }break;
+
+                case 1: { // Down
+                    if( y > 0 && !(maze->cells[cell - maze->width] & CELL_VISITED) ) {
+                        maze->cells[cell] |= MAZE_DOWN;
+                        cell -= maze->width;
+                        maze->cells[cell] |= MAZE_UP | CELL_VISITED;
+                        return cell;
+                    }
+                }break;
+
+                case 2: { // Right
+                    if( x < maze->width-1 && !(maze->cells[cell+1] & CELL_VISITED) ) {
+                        maze->cells[cell] |= MAZE_RIGHT;
+                        ++cell;
+                        maze->cells[cell] |= MAZE_LEFT | CELL_VISITED;
+                        return cell;
+                    }
+                }break;
+
+                case 3: { // Left
+                    if( x > 0 && !(maze->cells[cell-1] & CELL_VISITED) ) {
+                        maze->cells[cell] |= MAZE_LEFT;
+                        --cell;
+                        maze->cells[cell] |= MAZE_RIGHT | CELL_VISITED;
+                        return cell;
+                    }
+                }break;
+            }
+            MazeCount(*counters, failed_directions, 1);
+        }
+        (void)counters;
+        return -1;
+    }
+
+    void MazeGeneratorInit(maze_generator_t* generator, maze_t* maze, maze_algorithm_t algorithm, uint64_t seed, int64_t* scratch) {
+        generator->maze = maze;
+        generator->algorithm = algorithm;
+        generator->rng = MazeSeed(seed);
+        generator->cells = scratch;
+        generator->cursor = 0;
+        generator->run_start = 0;
+        generator->dirty_cells = generator->dirty_scratch = 0;
+        generator->num_dirty = 0;
+        memset(&generator->counters, 0, sizeof(generator->counters));
+        if(MazeLanesSupported(algorithm)) {
+            // No starting cell, these walk the grid from cell 0. num_cells is only used to say we aren't finished.
+            generator->num_cells = 1;
+            return;
+        }
+        generator->cells[0] = MazeRandom(&generator->rng) % ((uint64_t)maze->width*maze->height);
+        generator->num_cells = 1;
+        MazeCount(generator->counters, rng_calls, 1);
+        MazeCountMax(generator->counters, max_depth, 1);
+        maze->cells[generator->cells[0]] |= CELL_VISITED;
+    }
+
+    bool MazeGeneratorStep(maze_generator_t* generator) {
+        KPROF_FUNCTION();
+        if(generator->num_cells == 0) return false;
+        switch(generator->algorithm) {
+
+            case MAZE_RECURSIVE_BACKTRACKER: {
+                // Move to a random unvisited neighbour, or backtrack if there are none
+                int64_t next = MazeCarveRandom(generator->maze, generator->cells[generator->num_cells-1], &generator->rng, &generator->counters);
+                if(next >= 0) {
+                    MazeTouchCell(generator, generator->cells[generator->num_cells-1]);
+                    MazeTouchCell(generator, next);
+                    MazeTouchScratch(generator, generator->num_cells);
+                    generator->cells[generator->num_cells++] = next;
+                    MazeCount(generator->counters, cells_carved, 1);
+                    MazeCountMax(generator->counters, max_depth, generator->num_cells);
+                }
+                else {
+                    --generator->num_cells;
+                    MazeCount(generator->counters, backtracks, 1);
+                }
+            }break;
+
+            case MAZE_PRIMS: {
+                // Connect a random visited cell to a random unvisited neighbour, or remove it from the list if there are none.
+                // Removal swaps in the last cell instead of shuffling the list down, the order doesn't matter since selection is random.
+                int64_t selected = MazeRandom(&generator->rng) % generator->num_cells;
+                MazeCount(generator->counters, rng_calls, 1);
+                int64_t next = MazeCarveRandom(generator->maze, generator->cells[selected], &generator->rng, &generator->counters);
+                if(next >= 0) {
+                    MazeTouchCell(generator, generator->cells[selected]);
+                    MazeTouchCell(generator, next);
+                    MazeTouchScratch(generator, generator->num_cells);
+                    generator->cells[generator->num_cells++] = next;
+                    MazeCount(generator->counters, cells_carved, 1);
+                    MazeCountMax(generator->counters, max_depth, generator->num_cells);
+                }
+                else {
+                    MazeTouchScratch(generator, selected);
+                    generator->cells[selected] = generator->cells[--generator->num_cells];
+                    MazeCount(generator->counters, backtracks, 1);
+                }
+            }break;
+
+            case MAZE_BINARY_TREE: {
+                // Connect each cell to either its up or right neighbour.
+                // One random number per cell even when there's no choice, so the lanes version stays in step.
+                maze_t* maze = generator->maze;
+                int64_t cell = generator->cursor;
+                int x = (int)(cell%maze->width);
+                int y = (int)(cell/maze->width);
+                uint64_t r = MazeRandom(&generator->rng);
+                bool up = y < maze->height-1;
+                bool right = x < maze->width-1;
+                MazeCount(generator->counters, rng_calls, 1);
+                MazeCount(generator->counters, cells_carved, up || right);
+                if(up && right) {
+                    up = r>>63;
+                    right = !up;
+                }
+                maze->cells[cell] |= CELL_VISITED;
+                if(up) {
+                    maze->cells[cell] |= MAZE_UP;
+                    maze->cells[cell + maze->width] |= MAZE_DOWN;
+                }
+                else if(right) {
+                    maze->cells[cell] |= MAZE_RIGHT;
+                    maze->cells[cell+1] |= MAZE_LEFT;
+                }
+                MazeTouchCell(generator, cell);
+                MazeTouchCell(generator, cell+1);
+                MazeTouchCell(generator, cell + maze->width);
+                if(++generator->cursor == (int64_t)maze->width*maze->height) {
+                    generator->num_cells = 0;
+                }
+            }break;
+
+            case MAZE_SIDEWINDER: {
+                // Extend the current run right, or close it by connecting a random cell in the run up. The top row is one long run.
+                maze_t* maze = generator->maze;
+                int64_t cell = generator->cursor;
+                int x = (int)(cell%maze->width);
+                int y = (int)(cell/maze->width);
+                uint64_t r = MazeRandom(&generator->rng);
+                MazeCount(generator->counters, rng_calls, 1);
+                MazeCount(generator->counters, cells_carved, y < maze->height-1 || x < maze->width-1);
+                maze->cells[cell] |= CELL_VISITED;
+                if(y == maze->height-1) {
+                    if(x < maze->width-1) {
+                        maze->cells[cell] |= MAZE_RIGHT;
+                        maze->cells[cell+1] |= MAZE_LEFT;
+                    }
+                }
+                else if(x == maze->width-1 || r>>63) {
+                    int64_t up = (int64_t)y*maze->width + generator->run_start + (uint32_t)r % (x - generator->run_start + 1);
+                    maze->cells[up] |= MAZE_UP;
+                    maze->cells[up + maze->width] |= MAZE_DOWN;
+                    generator->run_start = x+1;
+                    MazeTouchCell(generator, up);
+                    MazeTouchCell(generator, up + maze->width);
+                }
+                else {
+                    maze->cells[cell] |= MAZE_RIGHT;
+                    maze->cells[cell+1] |= MAZE_LEFT;
+                }
+                MazeTouchCell(generator, cell);
+                MazeTouchCell(generator, cell+1);
+                if(x == maze->width-1) {
+                    generator->run_start = 0;
+                }
+                if(++generator->cursor == (int64_t)maze->width*maze->height) {
+                    generator->num_cells = 0;
+                }
+            }break;
+
+            default: {
+                generator->num_cells = 0;
+            }break;
+        }
+        return generator->num_cells > 0;
+    }
+
+    maze_counters_t maze_counters;
+
+    static void MazeGenerateCounted(maze_t* maze, maze_algorithm_t algorithm, uint64_t seed, int64_t* scratch, maze_counters_t* counters) {
+        maze_generator_t generator;
+        MazeGeneratorInit(&generator, maze, algorithm, seed, scratch);
+        while(MazeGeneratorStep(&generator));
+#ifdef MAZE_COUNTERS
+        if(counters) {
+            MazeCountersAdd(counters, &generator.counters);
+        }
+#else
+        (void)counters;
+#endif
+    }
+
+    void MazeGenerate(maze_t* maze, maze_algorithm_t algorithm, uint64_t seed, int64_t* scratch) {
+        KPROF_FUNCTION();
+        MazeGenerateCounted(maze, algorithm, seed, scratch, &maze_counters);
+    }
+
+    //------------------------------------------------------------
+    // Counters
+
+    void MazeCountersAdd(maze_counters_t* total, const maze_counters_t* counters) {
+        total->cells_carved += counters->cells_carved;
+        total->neighbour_probes += counters->neighbour_probes;
+        total->failed_directions += counters->failed_directions;
+        total->backtracks += counters->backtracks;
+        total->rng_calls += counters->rng_calls;
+        if(counters->max_depth > total->max_depth) {
+            total->max_depth = counters->max_depth;
+        }
+    }
+
+    void MazeCountersJSON(FILE* file, const maze_counters_t* counters) {
+        fprintf(file, "{\"cells_carved\": %llu, \"neighbour_probes\": %llu, \"failed_directions\": %llu, \"backtracks\": %llu, \"rng_calls\": %llu, \"max_depth\": %lld}",
+                (unsigned long long)counters->cells_carved, (unsigned long long)counters->neighbour_probes, (unsigned long long)counters->failed_directions,
+                (unsigned long long)counters->backtracks, (unsigned long long)counters->rng_calls, (long long)counters->max_depth);
+    }
+
+    void MazeCountersLive(const maze_counters_t* counters) {
+#ifdef MAZE_COUNTERS
+        fprintf(stderr, "\rcarved %llu  probes %llu  failed %llu  backtracks %llu  rng %llu  depth %lld ",
+                (unsigned long long)counters->cells_carved, (unsigned long long)counters->neighbour_probes, (unsigned long long)counters->failed_directions,
+                (unsigned long long)counters->backtracks, (unsigned long long)counters->rng_calls, (long long)counters->max_depth);
+#else
+        (void)counters;
+#endif
+    }
+
+    //------------------------------------------------------------
+    // Lanes
+
+#if defined(__GNUC__)
+
+    // Cells are interleaved so cell i of every maze sits in one vector: lanes[i][maze]
+    typedef uint64_t maze_lanes64_t __attribute__((vector_size(MAZE_LANES*sizeof(uint64_t))));
+    typedef uint8_t maze_lanes8_t __attribute__((vector_size(MAZE_LANES)));
+
+    // Let the compiler build SSE2/AVX2/AVX-512 versions and pick one at load time
+#if defined(__x86_64__) && !defined(__clang__)
+#define MAZE_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MAZE_TARGET_CLONES
+#endif
+
+    // Same as MazeRandom for each lane. Vectors are passed by pointer so the AVX-512 clone doesn't change the function's ABI.
+    static inline void MazeRandomLanes(maze_lanes64_t* rng, maze_lanes64_t* result) {
+        maze_lanes64_t x = *rng;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *rng = x;
+        *result = x * 0x2545F4914F6CDD1DULL;
+    }
+
+    MAZE_TARGET_CLONES
+    void MazeGenerateLanes(maze_t* mazes, maze_algorithm_t algorithm, const uint64_t* seeds, uint8_t* scratch) {
+        KPROF_FUNCTION();
+        int width = mazes[0].width;
+        int height = mazes[0].height;
+        int64_t num_cells = (int64_t)width*height;
+        maze_lanes8_t* lanes = (maze_lanes8_t*)scratch;
+        maze_lanes64_t rng;
+        int run_start[MAZE_LANES] = {0};
+        for(int lane = 0; lane < MAZE_LANES; ++lane) {
+            rng[lane] = MazeSeed(seeds[lane]);
+        }
+        memset(lanes, 0, num_cells*sizeof(maze_lanes8_t));
+
+        for(int y = 0; y < height; ++y) {
+            for(int x = 0; x < width; ++x) {
+                int64_t cell = x + (int64_t)y*width;
+                maze_lanes64_t r;
+                MazeRandomLanes(&rng, &r);
+                maze_lanes8_t bit = __builtin_convertvector(r >> 63, maze_lanes8_t);
+                maze_lanes8_t not_bit = 1 - bit;
+                lanes[cell] |= CELL_VISITED;
+
+                if(algorithm == MAZE_BINARY_TREE) {
+                    if(y < height-1 && x < width-1) {
+                        lanes[cell] |= bit*MAZE_UP | not_bit*MAZE_RIGHT;
+                        lanes[cell + width] |= bit*MAZE_DOWN;
+                        lanes[cell+1] |= not_bit*MAZE_LEFT;
+                    }
+                    else if(y < height-1) {
+                        lanes[cell] |= MAZE_UP;
+                        lanes[cell + width] |= MAZE_DOWN;
+                    }
+                    else if(x < width-1) {
+                        lanes[cell] |= MAZE_RIGHT;
+                        lanes[cell+1] |= MAZE_LEFT;
+                    }
+                }
+                else {
+                    if(y == height-1) {
+                        if(x < width-1) {
+                            lanes[cell] |= MAZE_RIGHT;
+                            lanes[cell+1] |= MAZE_LEFT;
+                        }
+                    }
+                    else if(x < width-1) {
+                        lanes[cell] |= not_bit*MAZE_RIGHT;
+                        lanes[cell+1] |= not_bit*MAZE_LEFT;
+                    }
+                    if(y < height-1) {
+                        // Closing a run lands on a different cell in each lane so this part is scalar
+                        for(int lane = 0; lane < MAZE_LANES; ++lane) {
+                            if(x == width-1 || bit[lane]) {
+                                int64_t up = (int64_t)y*width + run_start[lane] + (uint32_t)r[lane] % (x - run_start[lane] + 1);
+                                lanes[up][lane] |= MAZE_UP;
+                                lanes[up + width][lane] |= MAZE_DOWN;
+                                run_start[lane] = x+1;
+                            }
+                        }
+                    }
+                    if(x == width-1) {
+                        memset(run_start, 0, sizeof(run_start));
+                    }
+                }
+            }
+        }
+
+        for(int lane = 0; lane < MAZE_LANES; ++lane) {
+            uint8_t* cells = mazes[lane].cells;
+            for(int64_t i = 0; i < num_cells; ++i) {
+                cells[i] = lanes[i][lane];
+            }
+        }
+    }
+
+#else
+
+    // No vector extensions, generate the lanes one after another
+    void MazeGenerateLanes(maze_t* mazes, maze_algorithm_t algorithm, const uint64_t* seeds, uint8_t* scratch) {
+        KPROF_FUNCTION();
+        (void)scratch;
+        for(int lane = 0; lane < MAZE_LANES; ++lane) {
+            mazes[lane].width = mazes[0].width;
+            mazes[lane].height = mazes[0].height;
+            memset(mazes[lane].cells, 0, (size_t)mazes[0].width*mazes[0].height);
+            MazeGenerate(&mazes[lane], algorithm, seeds[lane], 0);
+        }
+    }
+
+#endif
+
+    //------------------------------------------------------------
+    // Memory
+
+#if defined(__linux__)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAZE_HUGE_PAGE_SIZE (2*1024*1024)
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+    // From linux/mempolicy.h, which isn't always installed
+#define MAZE_MPOL_BIND 2
+#define MAZE_MPOL_INTERLEAVE 3
+#define MAZE_MAX_NODES 1024
+
+    int MazeNumaNodes() {
+        static int num_nodes = 0;
+        if(!num_nodes) {
+            char path[64];
+            do {
+                sprintf(path, "/sys/devices/system/node/node%d", num_nodes);
+            } while(num_nodes < MAZE_MAX_NODES && access(path, F_OK) == 0 && ++num_nodes);
+            if(!num_nodes) {
+                num_nodes = 1;
+            }
+        }
+        return num_nodes;
+    }
+
+    bool MazeBindThreadToNode(int node) {
+        // The node's cpulist looks like "0-3,8-11"
+        char path[64];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if(!file) return false;
+        unsigned long mask[MAZE_MAX_NODES/(8*sizeof(unsigned long))] = {0};
+        int first, last;
+        char separator;
+        while(fscanf(file, "%d", &first) == 1) {
+            last = first;
+            if(fscanf(file, "%c", &separator) == 1 && separator == '-') {
+                if(fscanf(file, "%d", &last) != 1) break;
+                if(fscanf(file, "%c", &separator) != 1) separator = 0;
+            }
+            for(int cpu = first; cpu <= last && cpu < MAZE_MAX_NODES; ++cpu) {
+                mask[cpu/(8*sizeof(unsigned long))] |= 1UL << (cpu%(8*sizeof(unsigned long)));
+            }
+            if(separator != ',') break;
+        }
+        fclose(file);
+        // pid 0 is the calling thread
+        return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0;
+    }
+
+    static inline size_t MazeLargeSize(size_t size, unsigned flags) {
+        if(flags & (MAZE_MEMORY_HUGE_PAGES | MAZE_MEMORY_EXPLICIT_HUGE_PAGES)) {
+            return (size + MAZE_HUGE_PAGE_SIZE-1) & ~(size_t)(MAZE_HUGE_PAGE_SIZE-1);
+        }
+        return size;
+    }
+
+    void* MazeAllocLarge(size_t size, unsigned flags, int node) {
+        if(flags == MAZE_MEMORY_DEFAULT) {
+            return calloc(1, size);
+        }
+        size = MazeLargeSize(size, flags);
+        uint8_t* memory = (uint8_t*)MAP_FAILED;
+        if(flags & MAZE_MEMORY_EXPLICIT_HUGE_PAGES) {
+            memory = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        }
+        if(memory == MAP_FAILED) {
+            if(flags & (MAZE_MEMORY_HUGE_PAGES | MAZE_MEMORY_EXPLICIT_HUGE_PAGES)) {
+                // Map an extra huge page and trim both ends so the memory starts on a huge page boundary, otherwise the kernel can't use huge pages for the first and last pieces
+                uint8_t* mapped = (uint8_t*)mmap(0, size + MAZE_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(mapped == MAP_FAILED) return 0;
+                memory = (uint8_t*)(((uintptr_t)mapped + MAZE_HUGE_PAGE_SIZE-1) & ~(uintptr_t)(MAZE_HUGE_PAGE_SIZE-1));
+                if(memory > mapped) {
+                    munmap(mapped, memory - mapped);
+                }
+                if(mapped + MAZE_HUGE_PAGE_SIZE > memory) {
+                    munmap(memory + size, mapped + MAZE_HUGE_PAGE_SIZE - memory);
+                }
+                madvise(memory, size, MADV_HUGEPAGE);
+            }
+            else {
+                memory = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(memory == MAP_FAILED) return 0;
+            }
+        }
+        // Set the policy before anything touches the pages, they're placed on first touch
+        if(flags & (MAZE_MEMORY_INTERLEAVE | MAZE_MEMORY_BIND)) {
+            unsigned long nodes[MAZE_MAX_NODES/(8*sizeof(unsigned long))] = {0};
+            int mode = MAZE_MPOL_BIND;
+            if(flags & MAZE_MEMORY_INTERLEAVE) {
+                mode = MAZE_MPOL_INTERLEAVE;
+                for(int i = 0; i < MazeNumaNodes(); ++i) {
+                    nodes[i/(8*sizeof(unsigned long))] |= 1UL << (i%(8*sizeof(unsigned long)));
+                }
+            }
+            else {
+                node = node < 0 ? 0 : node % MAZE_MAX_NODES;
+                nodes[node/(8*sizeof(unsigned long))] |= 1UL << (node%(8*sizeof(unsigned long)));
+            }
+            // Fails harmlessly on kernels without NUMA support
+            syscall(SYS_mbind, memory, size, mode, nodes, (unsigned long)MAZE_MAX_NODES, 0);
+        }
+        return memory;
+    }
+
+    void MazeFreeLarge(void* memory, size_t size, unsigned flags) {
+        if(!memory) return;
+        if(flags == MAZE_MEMORY_DEFAULT) {
+            free(memory);
+            return;
+        }
+        munmap(memory, MazeLargeSize(size, flags));
+    }
+
+#else
+
+    int MazeNumaNodes() {
+        return 1;
+    }
+
+    bool MazeBindThreadToNode(int node) {
+        (void)node;
+        return false;
+    }
+
+    void* MazeAllocLarge(size_t size, unsigned flags, int node) {
+        (void)flags;
+        (void)node;
+        return calloc(1, size);
+    }
+
+    void MazeFreeLarge(void* memory, size_t size, unsigned flags) {
+        (void)size;
+        (void)flags;
+        free(memory);
+    }
+
+#endif
+
+    //------------------------------------------------------------
+    // Arena
+
+    void MazeArenaReset(maze_arena_t* arena, size_t size) {
+        arena->used = 0;
+        if(arena->capacity >= size) return;
+        size_t capacity = arena->capacity ? arena->capacity : 4096;
+        while(capacity < size) {
+            capacity *= 2;
+        }
+        MazeFreeLarge(arena->memory, arena->capacity + MAZE_ARENA_ALIGNMENT, arena->memory_flags);
+        // Over-allocate so the start can be aligned to a cache line
+        arena->memory = (uint8_t*)MazeAllocLarge(capacity + MAZE_ARENA_ALIGNMENT, arena->memory_flags, arena->node);
+        arena->capacity = arena->memory ? capacity : 0;
+    }
+
+    void* MazeArenaAlloc(maze_arena_t* arena, size_t size) {
+        if(!arena->memory) return 0;
+        uintptr_t base = ((uintptr_t)arena->memory + MAZE_ARENA_ALIGNMENT-1) & ~(uintptr_t)(MAZE_ARENA_ALIGNMENT-1);
+        size_t start = (arena->used + MAZE_ARENA_ALIGNMENT-1) & ~(size_t)(MAZE_ARENA_ALIGNMENT-1);
+        if(start + size > arena->capacity) return 0;
+        arena->used = start + size;
+        return (void*)(base + start);
+    }
+
+    void MazeArenaFree(maze_arena_t* arena) {
+        MazeFreeLarge(arena->memory, arena->capacity + MAZE_ARENA_ALIGNMENT, arena->memory_flags);
+        arena->memory = 0;
+        arena->capacity = arena->used = 0;
+    }
+
+    bool MazeGenerateInArena(maze_t* maze, const maze_job_t* job, maze_arena_t* arena, maze_counters_t* counters) {
+        KPROF_FUNCTION();
+        size_t num_cells = (size_t)job->width*job->height;
+        if(num_cells == 0) return false;
+        size_t cells_size = (num_cells + MAZE_ARENA_ALIGNMENT-1) & ~(size_t)(MAZE_ARENA_ALIGNMENT-1);
+        MazeArenaReset(arena, cells_size + MazeScratchSize(job->width, job->height));
+        maze->width = job->width;
+        maze->height = job->height;
+        maze->cells = (uint8_t*)MazeArenaAlloc(arena, num_cells);
+        int64_t* scratch = (int64_t*)MazeArenaAlloc(arena, MazeScratchSize(job->width, job->height));
+        if(!maze->cells || !scratch) return false;
+        memset(maze->cells, 0, num_cells);
+        MazeGenerateCounted(maze, job->algorithm, job->seed, scratch, counters);
+        return true;
+    }
+
+    //------------------------------------------------------------
+    // Batch
+
+    // Padded to a cache line so that workers bumping their arenas don't share lines
+    typedef union {
+        struct {
+            kt_thread_t thread;
+            maze_arena_t arena;
+            maze_counters_t counters;
+            int index;
+        };
+        uint8_t padding[2*MAZE_ARENA_ALIGNMENT];
+    } maze_worker_t;
+
+    static struct {
+        int num_threads;
+        maze_worker_t* workers;
+        kt_mutex_t mutex;
+        kt_cond_t start, done;
+        unsigned generation;
+        int num_finished;
+        bool quit;
+        const maze_job_t* jobs;
+        int num_jobs;
+        kt_atomic_t next_job;
+        maze_job_callback_t callback;
+        void* user;
+    } maze_batch;
+
+    // A chunk can go through MazeGenerateLanes if it's full and every job has the same size and algorithm
+    static bool MazeBatchLanes(maze_worker_t* worker, const maze_job_t* jobs) {
+        for(int i = 0; i < MAZE_LANES; ++i) {
+            if(!MazeLanesSupported(jobs[i].algorithm) || jobs[i].algorithm != jobs[0].algorithm || jobs[i].width != jobs[0].width || jobs[i].height != jobs[0].height) return false;
+        }
+        if(jobs[0].width <= 0 || jobs[0].height <= 0) return false;
+        size_t num_cells = (size_t)jobs[0].width*jobs[0].height;
+        size_t cells_size = (num_cells + MAZE_ARENA_ALIGNMENT-1) & ~(size_t)(MAZE_ARENA_ALIGNMENT-1);
+        MazeArenaReset(&worker->arena, (MAZE_LANES+1)*cells_size + MazeLanesScratchSize(jobs[0].width, jobs[0].height));
+        maze_t mazes[MAZE_LANES];
+        uint64_t seeds[MAZE_LANES];
+        for(int i = 0; i < MAZE_LANES; ++i) {
+            mazes[i].width = jobs[0].width;
+            mazes[i].height = jobs[0].height;
+            mazes[i].cells = (uint8_t*)MazeArenaAlloc(&worker->arena, num_cells);
+            seeds[i] = jobs[i].seed;
+        }
+        uint8_t* scratch = (uint8_t*)MazeArenaAlloc(&worker->arena, MazeLanesScratchSize(jobs[0].width, jobs[0].height));
+        if(!scratch) return false;
+        MazeGenerateLanes(mazes, jobs[0].algorithm, seeds, scratch);
+        // Every lane draws one random number per cell and carves a spanning tree
+        MazeCount(worker->counters, rng_calls, MAZE_LANES*num_cells);
+        MazeCount(worker->counters, cells_carved, MAZE_LANES*(num_cells-1));
+        if(maze_batch.callback) {
+            for(int i = 0; i < MAZE_LANES; ++i) {
+                maze_batch.callback(&jobs[i], (int)(&jobs[i] - maze_batch.jobs), &mazes[i], maze_batch.user);
+            }
+        }
+        return true;
+    }
+
+    static void MazeBatchWork(maze_worker_t* worker) {
+        maze_t maze;
+        for(;;) {
+            int first = KTAtomicAdd(&maze_batch.next_job, MAZE_BATCH_CHUNK);
+            if(first >= maze_batch.num_jobs) break;
+            int last = first + MAZE_BATCH_CHUNK < maze_batch.num_jobs ? first + MAZE_BATCH_CHUNK : maze_batch.num_jobs;
+            if(last - first == MAZE_LANES && MazeBatchLanes(worker, &maze_batch.jobs[first])) continue;
+            for(int i = first; i < last; ++i) {
+                if(MazeGenerateInArena(&maze, &maze_batch.jobs[i], &worker->arena, &worker->counters) && maze_batch.callback) {
+                    maze_batch.callback(&maze_batch.jobs[i], i, &maze, maze_batch.user);
+                }
+            }
+        }
+    }
+
+    static kt_thread_result_t MazeBatchThread(void* data) {
+        maze_worker_t* worker = (maze_worker_t*)data;
+        KPROF_THREAD_NAME("maze batch");
+        if(worker->arena.memory_flags & MAZE_MEMORY_BIND) {
+            MazeBindThreadToNode(worker->arena.node);
+        }
+        unsigned seen = 0;
+        for(;;) {
+            KTLock(maze_batch.mutex);
+            while(maze_batch.generation == seen && !maze_batch.quit) {
+                KTCondWait(maze_batch.start, maze_batch.mutex);
+            }
+            seen = maze_batch.generation;
+            bool quit = maze_batch.quit;
+            KTUnlock(maze_batch.mutex);
+            if(quit) break;
+            MazeBatchWork(worker);
+            KTLock(maze_batch.mutex);
+            if(++maze_batch.num_finished == maze_batch.num_threads-1) {
+                KTCondBroadcast(maze_batch.done);
+            }
+            KTUnlock(maze_batch.mutex);
+        }
+        return 0;
+    }
+
+    bool MazeBatchInit(int num_threads, unsigned memory_flags) {
+        if(maze_batch.workers) return true;
+        if(num_threads <= 0) {
+            num_threads = KTCPUCount();
+        }
+        maze_batch.workers = (maze_worker_t*)calloc(num_threads, sizeof(maze_worker_t));
+        if(!maze_batch.workers) return false;
+        maze_batch.num_threads = num_threads;
+        maze_batch.generation = 0;
+        maze_batch.quit = false;
+        KTMutexInit(&maze_batch.mutex);
+        KTCondInit(&maze_batch.start);
+        KTCondInit(&maze_batch.done);
+        for(int i = 0; i < num_threads; ++i) {
+            maze_batch.workers[i].arena.memory_flags = memory_flags;
+            maze_batch.workers[i].arena.node = i % MazeNumaNodes();
+        }
+        // Worker 0 is the thread calling MazeBatchRun. It isn't pinned so its arena can't be bound either.
+        maze_batch.workers[0].arena.memory_flags &= ~MAZE_MEMORY_BIND;
+        for(int i = 1; i < num_threads; ++i) {
+            maze_batch.workers[i].index = i;
+            if(!KTThreadStart(&maze_batch.workers[i].thread, MazeBatchThread, &maze_batch.workers[i], "maze worker")) {
+                // Workers only count finishes against num_threads once a run starts, so it can still shrink here
+                maze_batch.num_threads = i;
+                break;
+            }
+        }
+        return true;
+    }
+
+    void MazeBatchRun(const maze_job_t* jobs, int num_jobs, maze_job_callback_t callback, void* user) {
+        KPROF_FUNCTION();
+        if(!maze_batch.workers && !MazeBatchInit(0, MAZE_MEMORY_DEFAULT)) return;
+        KTLock(maze_batch.mutex);
+        maze_batch.jobs = jobs;
+        maze_batch.num_jobs = num_jobs;
+        maze_batch.callback = callback;
+        maze_batch.user = user;
+        maze_batch.num_finished = 0;
+        KTAtomicSet(&maze_batch.next_job, 0);
+        ++maze_batch.generation;
+        KTCondBroadcast(maze_batch.start);
+        KTUnlock(maze_batch.mutex);
+
+        MazeBatchWork(&maze_batch.workers[0]);
+
+        KTLock(maze_batch.mutex);
+        while(maze_batch.num_finished < maze_batch.num_threads-1) {
+            KTCondWait(maze_batch.done, maze_batch.mutex);
+        }
+        KTUnlock(maze_batch.mutex);
+    }
+
+    void MazeBatchCounters(maze_counters_t* counters) {
+        memset(counters, 0, sizeof(*counters));
+        for(int i = 0; i < maze_batch.num_threads && maze_batch.workers; ++i) {
+            MazeCountersAdd(counters, &maze_batch.workers[i].counters);
+        }
+    }
+
+    void MazeBatchShutdown() {
+        if(!maze_batch.workers) return;
+        KTLock(maze_batch.mutex);
+        maze_batch.quit = true;
+        KTCondBroadcast(maze_batch.start);
+        KTUnlock(maze_batch.mutex);
+        for(int i = 0; i < maze_batch.num_threads; ++i) {
+            if(i > 0) {
+                KTThreadJoin(maze_batch.workers[i].thread);
+            }
+            MazeArenaFree(&maze_batch.workers[i].arena);
+        }
+        KTMutexDestroy(&maze_batch.mutex);
+        KTCondDestroy(&maze_batch.start);
+        KTCondDestroy(&maze_batch.done);
+        free(maze_batch.workers);
+        maze_batch.workers = 0;
+    }
+
+    //------------------------------------------------------------
+    // Checkpoint
+
+    /*
+    File layout: a maze_checkpoint_header_t followed by any number of records. Each record is a maze_checkpoint_record_t, then every changed page as a uint64_t page index followed by MAZE_CHECKPOINT_PAGE bytes (cell pages first, then scratch pages), then a hash of the whole record and MAZE_CHECKPOINT_END.
+    Replaying the records in order over cleared cells gives the generator state at the last one.
+    */
+
+#define MAZE_CHECKPOINT_MAGIC 0x54504b43455a414dULL // "MAZECKPT"
+#define MAZE_CHECKPOINT_RECORD 0x4d5a5243 // "CRZM"
+#define MAZE_CHECKPOINT_END 0x4d5a4e45 // "ENZM"
+#define MAZE_CHECKPOINT_VERSION 1
+#define MAZE_CHECKPOINT_BUDGET (16*1024*1024)
+#define MAZE_CHECKPOINT_INTERVAL 60
+#define MAZE_CHECKPOINT_CHECK_STEPS 4096
+
+    // 64 bit file offsets, long is 32 bits on Windows
+#if defined(_WIN32)
+#include <io.h>
+#define MazeTell(file) _ftelli64(file)
+#define MazeSeek(file, offset) _fseeki64((file), (offset), SEEK_SET)
+#define MazeTruncate(file, size) (_chsize_s(_fileno(file), (size)) == 0)
+#else
+#include <unistd.h>
+#define MazeTell(file) ftello(file)
+#define MazeSeek(file, offset) fseeko((file), (off_t)(offset), SEEK_SET)
+#define MazeTruncate(file, size) (ftruncate(fileno(file), (off_t)(size)) == 0)
+#endif
+
+    typedef struct {
+        uint64_t magic;
+        uint32_t version;
+        int32_t width, height, algorithm;
+        uint64_t seed;
+    } maze_checkpoint_header_t;
+
+    typedef struct {
+        uint32_t magic, padding;
+        uint64_t size; // Bytes in the whole record, including this and the hash/end
+        uint64_t rng;
+        int64_t num_cells, cursor, run_start;
+        uint64_t num_cell_pages, num_scratch_pages;
+    } maze_checkpoint_record_t;
+
+    typedef struct {
+        uint64_t hash;
+        uint32_t magic, padding;
+    } maze_checkpoint_end_t;
+
+    struct maze_checkpoint_s {
+        maze_generator_t* generator;
+        FILE* file;
+        size_t budget;
+        int interval;
+        time_t last_time;
+        uint64_t steps;
+        uint8_t* buffer;
+        size_t buffer_size, buffer_capacity;
+        kt_thread_t thread;
+        kt_mutex_t mutex;
+        kt_cond_t cond;
+        bool writing, quit, failed;
+    };
+
+    static uint64_t MazeHash(const uint8_t* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        size_t i = 0;
+        for(; i+8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data+i, 8);
+            hash = (hash ^ word) * 0x100000001b3ULL;
+        }
+        for(; i < size; ++i) {
+            hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    static inline int64_t MazeCheckpointPages(int64_t bytes) {
+        return (bytes + MAZE_CHECKPOINT_PAGE-1) / MAZE_CHECKPOINT_PAGE;
+    }
+
+    static kt_thread_result_t MazeCheckpointThread(void* data) {
+        maze_checkpoint_t* checkpoint = (maze_checkpoint_t*)data;
+        for(;;) {
+            KTLock(checkpoint->mutex);
+            while(!checkpoint->writing && !checkpoint->quit) {
+                KTCondWait(checkpoint->cond, checkpoint->mutex);
+            }
+            bool quit = checkpoint->quit && !checkpoint->writing;
+            KTUnlock(checkpoint->mutex);
+            if(quit) break;
+
+            // The generating thread doesn't touch the buffer while writing is set
+            maze_checkpoint_end_t* end = (maze_checkpoint_end_t*)(checkpoint->buffer + checkpoint->buffer_size - sizeof(maze_checkpoint_end_t));
+            end->hash = MazeHash(checkpoint->buffer, checkpoint->buffer_size - sizeof(maze_checkpoint_end_t));
+            end->magic = MAZE_CHECKPOINT_END;
+            end->padding = 0;
+            bool failed = fwrite(checkpoint->buffer, checkpoint->buffer_size, 1, checkpoint->file) != 1 || fflush(checkpoint->file) != 0;
+#if defined(__linux__)
+            failed = failed || fsync(fileno(checkpoint->file)) != 0;
+#endif
+
+            KTLock(checkpoint->mutex);
+            checkpoint->failed = checkpoint->failed || failed;
+            checkpoint->writing = false;
+            KTCondBroadcast(checkpoint->cond);
+            KTUnlock(checkpoint->mutex);
+        }
+        return 0;
+    }
+
+    // Copy the changed pages into the buffer and hand it to the writer thread
+    static void MazeCheckpointTake(maze_checkpoint_t* checkpoint) {
+        maze_generator_t* generator = checkpoint->generator;
+        int64_t cell_bytes = (int64_t)generator->maze->width*generator->maze->height;
+        int64_t scratch_bytes = cell_bytes*(int64_t)sizeof(int64_t);
+        size_t size = sizeof(maze_checkpoint_record_t) + generator->num_dirty*(sizeof(uint64_t) + MAZE_CHECKPOINT_PAGE) + sizeof(maze_checkpoint_end_t);
+        if(size > checkpoint->buffer_capacity) {
+            uint8_t* buffer = (uint8_t*)realloc(checkpoint->buffer, size);
+            if(!buffer) {
+                checkpoint->failed = true;
+                return;
+            }
+            checkpoint->buffer = buffer;
+            checkpoint->buffer_capacity = size;
+        }
+
+        maze_checkpoint_record_t* record = (maze_checkpoint_record_t*)checkpoint->buffer;
+        record->magic = MAZE_CHECKPOINT_RECORD;
+        record->padding = 0;
+        record->size = size;
+        record->rng = generator->rng;
+        record->num_cells = generator->num_cells;
+        record->cursor = generator->cursor;
+        record->run_start = generator->run_start;
+        uint8_t* it = checkpoint->buffer + sizeof(maze_checkpoint_record_t);
+        for(int pass = 0; pass < 2; ++pass) {
+            uint64_t* dirty = pass ? generator->dirty_scratch : generator->dirty_cells;
+            uint8_t* source = pass ? (uint8_t*)generator->cells : generator->maze->cells;
+            int64_t bytes = pass ? scratch_bytes : cell_bytes;
+            int64_t num_words = (MazeCheckpointPages(bytes) + 63) / 64;
+            uint64_t num_pages = 0;
+            for(int64_t word = 0; word < num_words; ++word) {
+                uint64_t bits = dirty[word];
+                if(!bits) continue;
+                dirty[word] = 0;
+                for(int bit = 0; bit < 64; ++bit) {
+                    if(!(bits & (1ULL << bit))) continue;
+                    uint64_t page = word*64 + bit;
+                    int64_t start = page*MAZE_CHECKPOINT_PAGE;
+                    int64_t length = bytes - start < MAZE_CHECKPOINT_PAGE ? bytes - start : MAZE_CHECKPOINT_PAGE;
+                    memcpy(it, &page, sizeof(page));
+                    it += sizeof(page);
+                    memcpy(it, source + start, length);
+                    memset(it + length, 0, MAZE_CHECKPOINT_PAGE - length);
+                    it += MAZE_CHECKPOINT_PAGE;
+                    ++num_pages;
+                }
+            }
+            if(pass) {
+                record->num_scratch_pages = num_pages;
+            }
+            else {
+                record->num_cell_pages = num_pages;
+            }
+        }
+        generator->num_dirty = 0;
+        checkpoint->buffer_size = size;
+        checkpoint->last_time = time(0);
+
+        KTLock(checkpoint->mutex);
+        checkpoint->writing = true;
+        KTCondBroadcast(checkpoint->cond);
+        KTUnlock(checkpoint->mutex);
+    }
+
+    static bool MazeCheckpointOpen(maze_checkpoint_t* checkpoint, maze_generator_t* generator, size_t budget, int interval) {
+        int64_t cell_bytes = (int64_t)generator->maze->width*generator->maze->height;
+        generator->dirty_cells = (uint64_t*)calloc((MazeCheckpointPages(cell_bytes) + 63) / 64, sizeof(uint64_t));
+        generator->dirty_scratch = (uint64_t*)calloc((MazeCheckpointPages(cell_bytes*(int64_t)sizeof(int64_t)) + 63) / 64, sizeof(uint64_t));
+        generator->num_dirty = 0;
+        if(!generator->dirty_cells || !generator->dirty_scratch) {
+            free(generator->dirty_cells);
+            free(generator->dirty_scratch);
+            generator->dirty_cells = generator->dirty_scratch = 0;
+            return false;
+        }
+        checkpoint->generator = generator;
+        checkpoint->budget = budget ? budget : MAZE_CHECKPOINT_BUDGET;
+        checkpoint->interval = interval ? interval : MAZE_CHECKPOINT_INTERVAL;
+        checkpoint->last_time = time(0);
+        checkpoint->steps = 0;
+        checkpoint->buffer = 0;
+        checkpoint->buffer_size = checkpoint->buffer_capacity = 0;
+        checkpoint->writing = checkpoint->quit = checkpoint->failed = false;
+        KTMutexInit(&checkpoint->mutex);
+        KTCondInit(&checkpoint->cond);
+        if(!KTThreadStart(&checkpoint->thread, MazeCheckpointThread, checkpoint, "maze checkpoint")) {
+            KTMutexDestroy(&checkpoint->mutex);
+            KTCondDestroy(&checkpoint->cond);
+            free(generator->dirty_cells);
+            free(generator->dirty_scratch);
+            generator->dirty_cells = generator->dirty_scratch = 0;
+            return false;
+        }
+        return true;
+    }
+
+    bool MazeCheckpointStart(maze_checkpoint_t* checkpoint, maze_generator_t* generator, uint64_t seed, const char* path, size_t budget, int interval) {
+        checkpoint->file = fopen(path, "wb");
+        if(!checkpoint->file) return false;
+        maze_checkpoint_header_t header = {0};
+        header.magic = MAZE_CHECKPOINT_MAGIC;
+        header.version = MAZE_CHECKPOINT_VERSION;
+        header.width = generator->maze->width;
+        header.height = generator->maze->height;
+        header.algorithm = generator->algorithm;
+        header.seed = seed;
+        if(fwrite(&header, sizeof(header), 1, checkpoint->file) != 1 || !MazeCheckpointOpen(checkpoint, generator, budget, interval)) {
+            fclose(checkpoint->file);
+            return false;
+        }
+        // MazeGeneratorInit has already visited the starting cell. Write it out straight away so there's always something to resume from.
+        if(!MazeLanesSupported(generator->algorithm)) {
+            MazeTouchCell(generator, generator->cells[0]);
+            MazeTouchScratch(generator, 0);
+        }
+        MazeCheckpointTake(checkpoint);
+        return true;
+    }
+
+    bool MazeCheckpointReadJob(const char* path, maze_job_t* job) {
+        FILE* file = fopen(path, "rb");
+        if(!file) return false;
+        maze_checkpoint_header_t header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == MAZE_CHECKPOINT_MAGIC && header.version == MAZE_CHECKPOINT_VERSION;
+        fclose(file);
+        if(!ok) return false;
+        job->width = header.width;
+        job->height = header.height;
+        job->algorithm = (maze_algorithm_t)header.algorithm;
+        job->seed = header.seed;
+        return true;
+    }
+
+    bool MazeCheckpointResume(maze_checkpoint_t* checkpoint, maze_generator_t* generator, maze_t* maze, int64_t* scratch, const char* path, size_t budget, int interval) {
+        maze_job_t job;
+        if(!MazeCheckpointReadJob(path, &job) || job.width != maze->width || job.height != maze->height) return false;
+        FILE* file = fopen(path, "r+b");
+        if(!file) return false;
+        MazeGeneratorInit(generator, maze, job.algorithm, job.seed, scratch);
+        // Init marked the start cell as visited but the records hold the real state
+        memset(maze->cells, 0, (size_t)maze->width*maze->height);
+        int64_t cell_bytes = (int64_t)maze->width*maze->height;
+        int64_t scratch_bytes = cell_bytes*(int64_t)sizeof(int64_t);
+        int64_t good = sizeof(maze_checkpoint_header_t);
+        bool restored = false;
+        uint8_t* buffer = 0;
+        MazeSeek(file, good);
+        for(;;) {
+            maze_checkpoint_record_t record;
+            if(fread(&record, sizeof(record), 1, file) != 1 || record.magic != MAZE_CHECKPOINT_RECORD) break;
+            uint64_t num_pages = record.num_cell_pages + record.num_scratch_pages;
+            if(record.size != sizeof(record) + num_pages*(sizeof(uint64_t) + MAZE_CHECKPOINT_PAGE) + sizeof(maze_checkpoint_end_t)) break;
+            uint8_t* grown = (uint8_t*)realloc(buffer, record.size);
+            if(!grown) break;
+            buffer = grown;
+            memcpy(buffer, &record, sizeof(record));
+            if(fread(buffer + sizeof(record), record.size - sizeof(record), 1, file) != 1) break;
+            maze_checkpoint_end_t* end = (maze_checkpoint_end_t*)(buffer + record.size - sizeof(maze_checkpoint_end_t));
+            if(end->magic != MAZE_CHECKPOINT_END || end->hash != MazeHash(buffer, record.size - sizeof(maze_checkpoint_end_t))) break;
+
+            // The hash only catches torn writes, so check every page number is in range before applying any of them
+            bool pages_valid = true;
+            for(uint64_t i = 0; i < num_pages; ++i) {
+                uint64_t page;
+                memcpy(&page, buffer + sizeof(record) + i*(sizeof(page) + MAZE_CHECKPOINT_PAGE), sizeof(page));
+                int64_t bytes = i >= record.num_cell_pages ? scratch_bytes : cell_bytes;
+                if(page >= (uint64_t)MazeCheckpointPages(bytes)) {
+                    pages_valid = false;
+                    break;
+                }
+            }
+            if(!pages_valid) break;
+
+            uint8_t* it = buffer + sizeof(record);
+            for(uint64_t i = 0; i < num_pages; ++i) {
+                bool is_scratch = i >= record.num_cell_pages;
+                uint8_t* dest = is_scratch ? (uint8_t*)scratch : maze->cells;
+                int64_t bytes = is_scratch ? scratch_bytes : cell_bytes;
+                uint64_t page;
+                memcpy(&page, it, sizeof(page));
+                it += sizeof(page);
+                int64_t start = page*MAZE_CHECKPOINT_PAGE;
+                if(start < bytes) {
+                    memcpy(dest + start, it, bytes - start < MAZE_CHECKPOINT_PAGE ? bytes - start : MAZE_CHECKPOINT_PAGE);
+                }
+                it += MAZE_CHECKPOINT_PAGE;
+            }
+            generator->rng = record.rng;
+            generator->num_cells = record.num_cells;
+            generator->cursor = record.cursor;
+            generator->run_start = (int)record.run_start;
+            good = MazeTell(file);
+            restored = true;
+        }
+        free(buffer);
+        if(!restored) {
+            fclose(file);
+            return false;
+        }
+        // Drop anything after the last complete record so new records follow on from it
+        fflush(file);
+        if(good < 0 || !MazeTruncate(file, good)) {
+            fclose(file);
+            return false;
+        }
+        MazeSeek(file, good);
+        checkpoint->file = file;
+        if(!MazeCheckpointOpen(checkpoint, generator, budget, interval)) {
+            fclose(file);
+            return false;
+        }
+        return true;
+    }
+
+    bool MazeCheckpointStep(maze_checkpoint_t* checkpoint) {
+        maze_generator_t* generator = checkpoint->generator;
+        bool running = MazeGeneratorStep(generator);
+        if(!running) return running;
+        // Checked every step, it's one compare, so a checkpoint never holds more than a step's worth of pages past the budget
+        bool full = generator->num_dirty*MAZE_CHECKPOINT_PAGE >= (int64_t)checkpoint->budget;
+        bool due = ++checkpoint->steps % MAZE_CHECKPOINT_CHECK_STEPS == 0 && time(0) - checkpoint->last_time >= checkpoint->interval;
+        if(full || due) {
+            KTLock(checkpoint->mutex);
+            if(full) {
+                // The disk is behind. Wait for it rather than letting the next checkpoint grow without limit
+                while(checkpoint->writing) {
+                    KTCondWait(checkpoint->cond, checkpoint->mutex);
+                }
+            }
+            // A checkpoint that's only due on time can wait until the last one has been written
+            bool writing = checkpoint->writing;
+            KTUnlock(checkpoint->mutex);
+            if(!writing) {
+                MazeCheckpointTake(checkpoint);
+            }
+        }
+        return running;
+    }
+
+    bool MazeCheckpointFinish(maze_checkpoint_t* checkpoint) {
+        KTLock(checkpoint->mutex);
+        while(checkpoint->writing) {
+            KTCondWait(checkpoint->cond, checkpoint->mutex);
+        }
+        KTUnlock(checkpoint->mutex);
+        MazeCheckpointTake(checkpoint);
+        KTLock(checkpoint->mutex);
+        checkpoint->quit = true;
+        KTCondBroadcast(checkpoint->cond);
+        KTUnlock(checkpoint->mutex);
+        KTThreadJoin(checkpoint->thread);
+        KTMutexDestroy(&checkpoint->mutex);
+        KTCondDestroy(&checkpoint->cond);
+        bool closed = fclose(checkpoint->file) == 0;
+        bool ok = !checkpoint->failed && closed;
+        free(checkpoint->buffer);
+        free(checkpoint->generator->dirty_cells);
+        free(checkpoint->generator->dirty_scratch);
+        checkpoint->generator->dirty_cells = checkpoint->generator->dirty_scratch = 0;
+        return ok;
+    }
+
+    //------------------------------------------------------------
+
+#ifdef __cplusplus
+}
+#endif
+
+#define MAZE_H
+#endif
@@ -0,0 +1,566 @@
+/*
+Maze render draws a maze_t into a ksprite_t the same way the article code does, just without drawing one Bresenham line per wall. Walls are always axis-aligned, so the maze is first turned into a list of wall runs, with neighbouring walls on the same line merged into one. Horizontal runs are then drawn with span fills and vertical runs with one store per row.
+
+MazeTilesDraw is the other way of drawing, it copies pre-rendered tiles for each of the 16 wall combinations a cell can have, so walls can be textured or styled any way you like at no extra cost per frame.
+
+For overviews of huge mazes, MazeDrawOverview packs the walls into one bit per wall unit and expands and scales that straight into pixels.
+
+Include kero_sprite.h and maze.h first.
+*/
+
+#ifndef MAZE_RENDER_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //------------------------------------------------------------
+
+#include "kero_profile.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+    // A straight run of walls, in cells. Horizontal runs go right from (x, y), vertical runs go down.
+    typedef struct {
+        int x, y, length;
+    } maze_wall_run_t;
+
+    typedef struct {
+        maze_wall_run_t* horizontal;
+        maze_wall_run_t* vertical;
+        int num_horizontal, num_vertical;
+        int horizontal_capacity, vertical_capacity;
+        int* column_starts; // Scratch for MazeWallsBuild: the row each column's open vertical run started on
+        uint64_t* column_walls; // and the previous row's vertical walls, one bit per column
+        int column_capacity;
+    } maze_walls_t;
+
+    void MazeWallsBuild(maze_walls_t* walls, const maze_t* maze);
+    /*
+    Fills walls with the merged wall runs of maze. walls should start zeroed, and it can be reused for any number of mazes, growing as needed.
+    Like the article code, a cell without MAZE_UP has a wall along its bottom edge and a cell without MAZE_RIGHT has one along its right edge.
+    */
+
+    void MazeWallsDraw(const maze_walls_t* walls, ksprite_t* dest, int left, int top, int cell_size, uint32_t colour);
+    /*
+    Draws the runs with the maze's top left corner at (left, top), clipped to dest. Gives the same pixels as the article's KSDrawLine loop.
+    */
+
+    void MazeWallsFree(maze_walls_t* walls);
+
+    void MazeDraw(ksprite_t* dest, const maze_t* maze, int left, int top, int cell_size, uint32_t colour);
+    /*
+    MazeWallsBuild then MazeWallsDraw, using walls kept between calls. Not thread safe, use your own maze_walls_t for that.
+    */
+
+    /*
+    Example:
+
+    KSSetAllPixels(&frame_buffer, 0xffffffff);
+    MazeDraw(&frame_buffer, &maze, 0, 0, 10, 0xff000000);
+    KPFlip();
+    */
+
+    // Tile atlas. A cell can only have 16 combinations of walls, so each combination is drawn once into a tile and the maze is
+    // drawn by copying tiles, one row of pixels at a time. Unlike MazeDraw every cell draws all four of its own walls inside
+    // its tile, so a wall between two cells is drawn by both and the outside of the maze gets a border.
+#define MAZE_TILES 16
+
+    typedef struct {
+        ksprite_t atlas; // cell_size wide, the tiles are stacked top to bottom so each one is contiguous
+        int cell_size;
+    } maze_tiles_t;
+
+    typedef void (*maze_tile_func_t)(ksprite_t* tile, int walls, void* user);
+    /*
+    Draws the tile for one wall combination, walls is a mix of MAZE_UP/RIGHT/DOWN/LEFT for the sides that are closed.
+    On screen MAZE_UP is the bottom of the cell and MAZE_DOWN the top, to match the article code.
+    */
+
+    typedef struct {
+        int wall_width;
+        uint32_t floor_colour, wall_colour;
+    } maze_tile_style_t;
+
+    void MazeTileSolid(ksprite_t* tile, int walls, void* style);
+    /*
+    A maze_tile_func_t for flat colours, style is a maze_tile_style_t*. Corner posts are always drawn so walls meet cleanly.
+    */
+
+    void MazeTilesCreate(maze_tiles_t* tiles, int cell_size, maze_tile_func_t DrawTile, void* user);
+    /*
+    Renders all 16 tiles with DrawTile. Use MazeTileSolid or your own function for textured walls, it's only called here so it can be as slow as it likes.
+    */
+
+    void MazeTilesDraw(const maze_tiles_t* tiles, ksprite_t* dest, const maze_t* maze, int left, int top);
+    /*
+    Draws the maze with its top left corner at (left, top), clipped to dest. Only visible cells are touched.
+    */
+
+    void MazeTilesFree(maze_tiles_t* tiles);
+
+    /*
+    Example:
+
+    maze_tile_style_t style = { 2, 0xffffffff, 0xff000000 };
+    maze_tiles_t tiles;
+    MazeTilesCreate(&tiles, 10, MazeTileSolid, &style);
+    MazeTilesDraw(&tiles, &frame_buffer, &maze, 0, 0);
+    */
+
+    // Overview rendering for big mazes. The maze is packed into a bitplane with one bit per wall unit: a (2*width+1) by
+    // (2*height+1) grid where cells are on odd rows and columns, corners on even ones and walls in between. The bitplane is
+    // then expanded to pixels and scaled up by a whole number, so every output pixel costs a few SIMD instructions instead
+    // of being part of a line.
+    typedef struct {
+        uint64_t* bits; // Rows of words_per_row words, bit c of a row is grid column c, set for walls and corners
+        int w, h, words_per_row;
+        size_t bits_capacity;
+        uint32_t* row; // Scratch for MazeBitplaneDraw, one expanded grid row
+        int row_capacity;
+    } maze_bitplane_t;
+
+    void MazeBitplaneBuild(maze_bitplane_t* plane, const maze_t* maze);
+    /*
+    Packs the walls of maze into plane, 32 cells at a time. plane should start zeroed and can be reused for any number of mazes.
+    As in the article code MAZE_UP is below a cell on screen and MAZE_DOWN above it.
+    */
+
+    void MazeBitplaneDraw(maze_bitplane_t* plane, ksprite_t* dest, int left, int top, int scale, uint32_t floor_colour, uint32_t wall_colour);
+    /*
+    Draws every grid unit as a scale by scale square with the grid's top left corner at (left, top), clipped to dest.
+    Only the visible part of the bitplane is expanded, and each grid row is expanded and scaled once then copied down.
+    */
+
+    void MazeBitplaneFree(maze_bitplane_t* plane);
+
+    void MazeDrawOverview(ksprite_t* dest, const maze_t* maze, int left, int top, int scale, uint32_t floor_colour, uint32_t wall_colour);
+    /*
+    MazeBitplaneBuild then MazeBitplaneDraw, using a bitplane kept between calls. Not thread safe, use your own maze_bitplane_t for that.
+    A 1000x1000 maze at scale 1 covers 2001x2001 pixels.
+    */
+
+    //------------------------------------------------------------
+
+    static inline void MazeWallsPush(maze_wall_run_t** runs, int* num_runs, int* capacity, int x, int y, int length) {
+        if(*num_runs == *capacity) {
+            *capacity = *capacity ? *capacity*2 : 256;
+            *runs = (maze_wall_run_t*)realloc(*runs, *capacity*sizeof(maze_wall_run_t));
+        }
+        (*runs)[(*num_runs)++] = (maze_wall_run_t){ x, y, length };
+    }
+
+    // Bit i is set if cells[i] doesn't have flag, for the count (up to 64) cells starting at cells
+    static inline uint64_t MazeWallMask(const uint8_t* cells, int count, uint8_t flag) {
+        uint64_t mask = 0;
+        int i = 0;
+#ifdef __SSE2__
+        __m128i bit = _mm_set1_epi8((char)flag);
+        for(; i+16 <= count; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(cells + i));
+            uint64_t open = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, bit), _mm_setzero_si128()));
+            mask |= open << i;
+        }
+#endif
+        for(; i < count; ++i) {
+            mask |= (uint64_t)!(cells[i] & flag) << i;
+        }
+        return mask;
+    }
+
+    // Index of the lowest set bit, bits must not be 0
+    static inline int MazeLowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && defined(_WIN64)
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return (int)index;
+#else
+        int index = 0;
+        while(!(bits & 1)) {
+            bits >>= 1;
+            ++index;
+        }
+        return index;
+#endif
+    }
+
+    void MazeWallsBuild(maze_walls_t* walls, const maze_t* maze) {
+        walls->num_horizontal = walls->num_vertical = 0;
+        int num_words = (maze->width + 63)/64;
+        if(walls->column_capacity < maze->width) {
+            walls->column_capacity = maze->width;
+            walls->column_starts = (int*)realloc(walls->column_starts, maze->width*sizeof(int));
+            walls->column_walls = (uint64_t*)realloc(walls->column_walls, num_words*sizeof(uint64_t));
+        }
+        memset(walls->column_walls, 0, num_words*sizeof(uint64_t));
+        // One pass in memory order, 64 cells at a time. Runs start where a wall bit turns on compared to the cell to the
+        // left (horizontal) or above (vertical) and end where it turns off, and the changes are found with count trailing
+        // zeros, so the work depends on the number of runs rather than the number of cells. The extra row at the end
+        // finishes off vertical runs that reach the bottom.
+        for(int y = 0; y <= maze->height; ++y) {
+            const uint8_t* row = maze->cells + (size_t)y*maze->width;
+            uint64_t carry = 0; // 1 if a horizontal run is still open from the previous word
+            int run_start = 0;
+            for(int word = 0; word < num_words; ++word) {
+                int base = word*64;
+                int count = KSMin(64, maze->width - base);
+                uint64_t valid = count == 64 ? ~0ull : (1ull<<count)-1;
+                uint64_t vertical = y < maze->height ? MazeWallMask(row + base, count, MAZE_RIGHT) : 0;
+                uint64_t ends = walls->column_walls[word] & ~vertical;
+                uint64_t starts = vertical & ~walls->column_walls[word];
+                walls->column_walls[word] = vertical;
+                for(; ends; ends &= ends-1) {
+                    int x = base + MazeLowestBit(ends);
+                    MazeWallsPush(&walls->vertical, &walls->num_vertical, &walls->vertical_capacity, x, walls->column_starts[x], y - walls->column_starts[x]);
+                }
+                for(; starts; starts &= starts-1) {
+                    walls->column_starts[base + MazeLowestBit(starts)] = y;
+                }
+                if(y == maze->height) continue;
+                uint64_t horizontal = MazeWallMask(row + base, count, MAZE_UP);
+                uint64_t shifted = horizontal<<1 | carry;
+                uint64_t changes = ((horizontal & ~shifted) | (~horizontal & shifted)) & valid;
+                // Starts and ends alternate, so each change flips between the two
+                for(; changes; changes &= changes-1) {
+                    int x = base + MazeLowestBit(changes);
+                    if(horizontal>>(x-base) & 1) {
+                        run_start = x;
+                    }
+                    else {
+                        MazeWallsPush(&walls->horizontal, &walls->num_horizontal, &walls->horizontal_capacity, run_start, y, x - run_start);
+                    }
+                }
+                carry = horizontal>>(count-1) & 1;
+            }
+            if(carry && y < maze->height) {
+                MazeWallsPush(&walls->horizontal, &walls->num_horizontal, &walls->horizontal_capacity, run_start, y, maze->width - run_start);
+            }
+        }
+    }
+
+    void MazeWallsDraw(const maze_walls_t* walls, ksprite_t* dest, int left, int top, int cell_size, uint32_t colour) {
+        KPROF_FUNCTION();
+        // Runs include both end pixels, like KSDrawLine
+        int dirty_left = dest->w, dirty_right = -1, dirty_top = dest->h, dirty_bottom = -1;
+        for(int i = 0; i < walls->num_horizontal; ++i) {
+            const maze_wall_run_t* run = walls->horizontal + i;
+            int y = top + (run->y+1)*cell_size;
+            int x0 = KSMax(0, left + run->x*cell_size);
+            int x1 = KSMin(dest->w-1, left + (run->x + run->length)*cell_size);
+            if(y < 0 || y > dest->h-1 || x0 > x1) continue;
+            dirty_left = KSMin(dirty_left, x0);
+            dirty_right = KSMax(dirty_right, x1);
+            dirty_top = KSMin(dirty_top, y);
+            dirty_bottom = KSMax(dirty_bottom, y);
+            uint32_t* pixel = dest->pixels + (size_t)y*dest->w + x0;
+            // Wall runs are short, so go straight to the fill kernel without checking whether to stream
+            ks_fill(pixel, x1 - x0 + 1, colour, 0);
+        }
+        for(int i = 0; i < walls->num_vertical; ++i) {
+            const maze_wall_run_t* run = walls->vertical + i;
+            int x = left + (run->x+1)*cell_size;
+            if(x < 0 || x > dest->w-1) continue;
+            int y0 = KSMax(0, top + run->y*cell_size);
+            int y1 = KSMin(dest->h-1, top + (run->y + run->length)*cell_size);
+            if(y0 > y1) continue;
+            dirty_left = KSMin(dirty_left, x);
+            dirty_right = KSMax(dirty_right, x);
+            dirty_top = KSMin(dirty_top, y0);
+            dirty_bottom = KSMax(dirty_bottom, y1);
+            uint32_t* pixel = dest->pixels + (size_t)y0*dest->w + x;
+            for(int y = y0; y <= y1; ++y, pixel += dest->w) {
+                *pixel = colour;
+            }
+        }
+        KSMarkDirty(dest, dirty_left, dirty_top, dirty_right, dirty_bottom);
+    }
+
+    void MazeWallsFree(maze_walls_t* walls) {
+        free(walls->horizontal);
+        free(walls->vertical);
+        free(walls->column_starts);
+        free(walls->column_walls);
+        memset(walls, 0, sizeof(*walls));
+    }
+
+    static maze_walls_t maze_draw_walls;
+
+    void MazeDraw(ksprite_t* dest, const maze_t* maze, int left, int top, int cell_size, uint32_t colour) {
+        KPROF_FUNCTION();
+        MazeWallsBuild(&maze_draw_walls, maze);
+        MazeWallsDraw(&maze_draw_walls, dest, left, top, cell_size, colour);
+    }
+
+    void MazeTileSolid(ksprite_t* tile, int walls, void* user) {
+        maze_tile_style_t* style = (maze_tile_style_t*)user;
+        int s = tile->w;
+        int w = KSMax(1, KSMin(style->wall_width, s/2));
+        KSSetAllPixels(tile, style->floor_colour);
+        if(walls & MAZE_DOWN) KSDrawRectFilled(tile, 0, 0, s-1, w-1, style->wall_colour);
+        if(walls & MAZE_UP) KSDrawRectFilled(tile, 0, s-w, s-1, s-1, style->wall_colour);
+        if(walls & MAZE_LEFT) KSDrawRectFilled(tile, 0, 0, w-1, s-1, style->wall_colour);
+        if(walls & MAZE_RIGHT) KSDrawRectFilled(tile, s-w, 0, s-1, s-1, style->wall_colour);
+        KSDrawRectFilled(tile, 0, 0, w-1, w-1, style->wall_colour);
+        KSDrawRectFilled(tile, s-w, 0, s-1, w-1, style->wall_colour);
+        KSDrawRectFilled(tile, 0, s-w, w-1, s-1, style->wall_colour);
+        KSDrawRectFilled(tile, s-w, s-w, s-1, s-1, style->wall_colour);
+    }
+
+    void MazeTilesCreate(maze_tiles_t* tiles, int cell_size, maze_tile_func_t DrawTile, void* user) {
+        tiles->cell_size = cell_size;
+        KSCreate(&tiles->atlas, cell_size, cell_size*MAZE_TILES);
+        for(int walls = 0; walls < MAZE_TILES; ++walls) {
+            ksprite_t tile = { cell_size, cell_size, tiles->atlas.pixels + walls*cell_size*cell_size, 0, 0 };
+            DrawTile(&tile, walls, user);
+        }
+    }
+
+    void MazeTilesDraw(const maze_tiles_t* tiles, ksprite_t* dest, const maze_t* maze, int left, int top) {
+        KPROF_FUNCTION();
+        int s = tiles->cell_size;
+        // Visible cells, then the part of the first and last column of them that's on screen
+        int x0 = KSMax(0, (-left)/s);
+        int x1 = KSMin(maze->width, (dest->w - left + s-1)/s);
+        int y0 = KSMax(0, (-top)/s);
+        int y1 = KSMin(maze->height, (dest->h - top + s-1)/s);
+        if(x0 >= x1 || y0 >= y1) return;
+        int first_skip = KSMax(0, -(left + x0*s));
+        int last_width = KSMin(s, dest->w - (left + (x1-1)*s));
+        KSMarkDirty(dest, left + x0*s, top + y0*s, left + x1*s - 1, top + y1*s - 1);
+        for(int y = y0; y < y1; ++y) {
+            const uint8_t* row = maze->cells + (size_t)y*maze->width;
+            int tile_top = KSMax(0, -(top + y*s));
+            int tile_bottom = KSMin(s, dest->h - (top + y*s));
+            // Walk the destination in memory order, one pixel row of the whole row of cells at a time
+            for(int ty = tile_top; ty < tile_bottom; ++ty) {
+                uint32_t* dest_row = dest->pixels + (size_t)(top + y*s + ty)*dest->w + left;
+                const uint32_t* tile_row = tiles->atlas.pixels + ty*s;
+                int x = x0;
+                if(first_skip) {
+                    memcpy(dest_row + x*s + first_skip, tile_row + (~row[x] & (MAZE_TILES-1))*s*s + first_skip, (KSMin(s, x == x1-1 ? last_width : s) - first_skip)*sizeof(uint32_t));
+                    ++x;
+                }
+                int full_end = last_width < s ? x1-1 : x1;
+                // Small tiles are common for overviews, and a fixed size memcpy gets inlined instead of being a call
+                if(s == 4) {
+                    for(; x < full_end; ++x) {
+                        memcpy(dest_row + x*4, tile_row + (~row[x] & (MAZE_TILES-1))*4*4, 4*sizeof(uint32_t));
+                    }
+                }
+                else if(s == 8) {
+                    for(; x < full_end; ++x) {
+                        memcpy(dest_row + x*8, tile_row + (~row[x] & (MAZE_TILES-1))*8*8, 8*sizeof(uint32_t));
+                    }
+                }
+                for(; x < full_end; ++x) {
+                    memcpy(dest_row + x*s, tile_row + (~row[x] & (MAZE_TILES-1))*s*s, s*sizeof(uint32_t));
+                }
+                if(x < x1) {
+                    memcpy(dest_row + x*s, tile_row + (~row[x] & (MAZE_TILES-1))*s*s, last_width*sizeof(uint32_t));
+                }
+            }
+        }
+    }
+
+    void MazeTilesFree(maze_tiles_t* tiles) {
+        KSFree(&tiles->atlas);
+    }
+
+    // Moves bit i of bits to bit 2i
+    static inline uint64_t MazeSpreadBits(uint32_t bits) {
+        uint64_t x = bits;
+        x = (x | x<<16) & 0x0000ffff0000ffffull;
+        x = (x | x<<8) & 0x00ff00ff00ff00ffull;
+        x = (x | x<<4) & 0x0f0f0f0f0f0f0f0full;
+        x = (x | x<<2) & 0x3333333333333333ull;
+        x = (x | x<<1) & 0x5555555555555555ull;
+        return x;
+    }
+
+#define MAZE_CORNER_BITS 0x5555555555555555ull
+
+    void MazeBitplaneBuild(maze_bitplane_t* plane, const maze_t* maze) {
+        plane->w = maze->width*2 + 1;
+        plane->h = maze->height*2 + 1;
+        plane->words_per_row = (plane->w + 63)/64;
+        // One spare word so MazeExpandBits can always read the word after the one it's in
+        size_t num_words = (size_t)plane->words_per_row*plane->h + 1;
+        if(plane->bits_capacity < num_words) {
+            plane->bits_capacity = num_words;
+            plane->bits = (uint64_t*)realloc(plane->bits, num_words*sizeof(uint64_t));
+        }
+        memset(plane->bits, 0, num_words*sizeof(uint64_t));
+        // Word i of a grid row covers cells 32i to 32i+31. Their walls above or below land on the odd bits of the word, and
+        // their right walls on the even bits one along, the last of which is bit 0 of the next word.
+        int num_chunks = (maze->width + 31)/32;
+        for(int y = -1; y < maze->height; ++y) {
+            uint64_t* below = plane->bits + (size_t)(2*y + 2)*plane->words_per_row;
+            uint64_t* cells = plane->bits + (size_t)(2*y + 1)*plane->words_per_row; // Unused for the top edge
+            const uint8_t* row = maze->cells + (size_t)KSMax(y, 0)*maze->width;
+            uint8_t flag = y < 0 ? MAZE_DOWN : MAZE_UP;
+            for(int chunk = 0; chunk < num_chunks; ++chunk) {
+                int count = KSMin(32, maze->width - chunk*32);
+                below[chunk] = MazeSpreadBits((uint32_t)MazeWallMask(row + chunk*32, count, flag))<<1 | MAZE_CORNER_BITS;
+                if(y < 0) continue;
+                uint64_t right = MazeSpreadBits((uint32_t)MazeWallMask(row + chunk*32, count, MAZE_RIGHT));
+                cells[chunk] |= right<<2;
+                if(chunk+1 < plane->words_per_row) cells[chunk+1] |= right>>62;
+            }
+            if(num_chunks < plane->words_per_row) {
+                below[num_chunks] |= MAZE_CORNER_BITS;
+            }
+            if(y >= 0 && !(row[0] & MAZE_LEFT)) {
+                cells[0] |= 1;
+            }
+        }
+    }
+
+    // dest[i] is wall_colour if bit first+i is set, otherwise floor_colour
+    static void MazeExpandBits(uint32_t* dest, const uint64_t* bits, int first, int count, uint32_t floor_colour, uint32_t wall_colour) {
+        int i = 0;
+#ifdef __SSE2__
+        __m128i floor_pixels = _mm_set1_epi32((int)floor_colour);
+        __m128i difference = _mm_set1_epi32((int)(floor_colour ^ wall_colour));
+        __m128i low_bits = _mm_set_epi32(8, 4, 2, 1);
+        __m128i high_bits = _mm_set_epi32(128, 64, 32, 16);
+        for(; i+8 <= count; i += 8) {
+            int bit = first + i;
+            int shift = bit & 63;
+            uint64_t word = bits[bit>>6] >> shift;
+            if(shift > 56) word |= bits[(bit>>6) + 1] << (64 - shift);
+            __m128i byte = _mm_set1_epi32((int)(word & 0xff));
+            __m128i low = _mm_cmpeq_epi32(_mm_and_si128(byte, low_bits), low_bits);
+            __m128i high = _mm_cmpeq_epi32(_mm_and_si128(byte, high_bits), high_bits);
+            _mm_storeu_si128((__m128i*)(dest + i), _mm_xor_si128(floor_pixels, _mm_and_si128(low, difference)));
+            _mm_storeu_si128((__m128i*)(dest + i + 4), _mm_xor_si128(floor_pixels, _mm_and_si128(high, difference)));
+        }
+#endif
+        for(; i < count; ++i) {
+            int bit = first + i;
+            dest[i] = bits[bit>>6]>>(bit & 63) & 1 ? wall_colour : floor_colour;
+        }
+    }
+
+    // Writes count pixels, dest[i] = source[(i + skip)/scale]
+    static void MazeUpscaleRow(uint32_t* dest, const uint32_t* source, int skip, int count, int scale) {
+        // The partly visible first pixel
+        source += skip/scale;
+        int first = KSMin(count, scale - skip%scale);
+        if(skip%scale) {
+            for(int i = 0; i < first; ++i) {
+                *dest++ = *source;
+            }
+            ++source;
+            count -= first;
+        }
+        int whole = count/scale;
+        int i = 0;
+        if(scale == 1) {
+            memcpy(dest, source, whole*sizeof(uint32_t));
+            i = whole;
+        }
+#ifdef __SSE2__
+        else if(scale == 2) {
+            for(; i+4 <= whole; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(source + i));
+                _mm_storeu_si128((__m128i*)(dest + i*2), _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128((__m128i*)(dest + i*2 + 4), _mm_unpackhi_epi32(v, v));
+            }
+        }
+        else if(scale == 4) {
+            for(; i+4 <= whole; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(source + i));
+                _mm_storeu_si128((__m128i*)(dest + i*4), _mm_shuffle_epi32(v, 0x00));
+                _mm_storeu_si128((__m128i*)(dest + i*4 + 4), _mm_shuffle_epi32(v, 0x55));
+                _mm_storeu_si128((__m128i*)(dest + i*4 + 8), _mm_shuffle_epi32(v, 0xaa));
+                _mm_storeu_si128((__m128i*)(dest + i*4 + 12), _mm_shuffle_epi32(v, 0xff));
+            }
+        }
+        else if(scale >= 4) {
+            // Whole vectors of each pixel, then whatever's left of the block
+            for(; i < whole; ++i) {
+                __m128i v = _mm_set1_epi32((int)source[i]);
+                uint32_t* block = dest + i*scale;
+                int j = 0;
+                for(; j+4 <= scale; j += 4) {
+                    _mm_storeu_si128((__m128i*)(block + j), v);
+                }
+                for(; j < scale; ++j) {
+                    block[j] = source[i];
+                }
+            }
+        }
+#endif
+        for(; i < whole; ++i) {
+            for(int j = 0; j < scale; ++j) {
+                dest[i*scale + j] = source[i];
+            }
+        }
+        // The partly visible last pixel
+        for(int j = whole*scale; j < count; ++j) {
+            dest[j] = source[whole];
+        }
+    }
+
+    void MazeBitplaneDraw(maze_bitplane_t* plane, ksprite_t* dest, int left, int top, int scale, uint32_t floor_colour, uint32_t wall_colour) {
+        KPROF_FUNCTION();
+        if(scale < 1 || left >= dest->w || top >= dest->h) return;
+        // Visible grid columns and rows
+        int c0 = KSMax(0, -left/scale);
+        int c1 = KSMin(plane->w, (dest->w - left + scale-1)/scale);
+        int r0 = KSMax(0, -top/scale);
+        int r1 = KSMin(plane->h, (dest->h - top + scale-1)/scale);
+        if(c0 >= c1 || r0 >= r1) return;
+        int x0 = KSMax(0, left + c0*scale);
+        int x1 = KSMin(dest->w, left + c1*scale);
+        KSMarkDirty(dest, x0, top + r0*scale, x1-1, top + r1*scale - 1);
+        if(plane->row_capacity < c1 - c0) {
+            plane->row_capacity = c1 - c0;
+            plane->row = (uint32_t*)realloc(plane->row, plane->row_capacity*sizeof(uint32_t));
+        }
+        for(int r = r0; r < r1; ++r) {
+            int y0 = KSMax(0, top + r*scale);
+            int y1 = KSMin(dest->h, top + (r+1)*scale);
+            uint32_t* first_row = dest->pixels + (size_t)y0*dest->w + x0;
+            const uint64_t* bits = plane->bits + (size_t)r*plane->words_per_row;
+            if(scale == 1) {
+                MazeExpandBits(first_row, bits, c0, x1 - x0, floor_colour, wall_colour);
+            }
+            else {
+                MazeExpandBits(plane->row, bits, c0, c1 - c0, floor_colour, wall_colour);
+                MazeUpscaleRow(first_row, plane->row, x0 - (left + c0*scale), x1 - x0, scale);
+            }
+            for(int y = y0+1; y < y1; ++y) {
+                memcpy(dest->pixels + (size_t)y*dest->w + x0, first_row, (x1 - x0)*sizeof(uint32_t));
+            }
+        }
+    }
+
+    void MazeBitplaneFree(maze_bitplane_t* plane) {
+        free(plane->bits);
+        free(plane->row);
+        memset(plane, 0, sizeof(*plane));
+    }
+
+    static maze_bitplane_t maze_overview_plane;
+
+    void MazeDrawOverview(ksprite_t* dest, const maze_t* maze, int left, int top, int scale, uint32_t floor_colour, uint32_t wall_colour) {
+        KPROF_FUNCTION();
+        MazeBitplaneBuild(&maze_overview_plane, maze);
+        MazeBitplaneDraw(&maze_overview_plane, dest, left, top, scale, floor_colour, wall_colour);
+    }
+
+    //------------------------------------------------------------
+
+#ifdef __cplusplus
+}
+#endif
+
+#define MAZE_RENDER_H
+#endif